@@ -12,12 +12,16 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "capture.hpp"
 #include "communication.hpp"
 #include "config.h"
 #include "logger.hpp"
+#include "pool.hpp"
+#include "profiler.hpp"
 #include "protocol.hpp"
 #include "server.hpp"
 #include "socket.hpp"
+#include "stats.hpp"
 
 #include <stdlib.h>
 #include <sys/types.h>
@@ -28,29 +32,87 @@
 #define PJON_ID 0x42
 #define UPDATE_PERIOD 4'000 // in us
 
+static const struct {
+	const char *device;
+	uint32_t baudrate;
+} serial_buses[] = SERIAL_BUSES;
+
+static const struct {
+	com_id id;
+	unsigned int bus;
+} bus_routes[] = BUS_ROUTES;
+
+static const struct {
+	const char *module;
+	unsigned int level;
+} log_module_levels[] = LOG_MODULE_LEVELS;
+
 int main()
 {
 	/* LOGGER */
 	FILE* log_outputs[1] = {stdout};
 	log_init(1, log_outputs);
-	log_set_level(1); // only warnings and errors
+	log_set_level(LOG_LEVEL);
+	for (const auto &m : log_module_levels)
+		log_set_module_level(m.module, m.level);
+#ifdef LOG_TRACE_FILE
+	log_trace_init(LOG_TRACE_FILE, LOG_TRACE_SIZE, LOG_TRACE_FILES);
+#endif
+#ifdef CAPTURE_FILE
+	capture_open(CAPTURE_FILE);
+#endif
 
 	/* COMMUNICATION */
-	if (!com_init(PJON_ID, SERIAL_DEVICE, BAUDRATE)) {
-		log_error(nullptr, "Socket inititalization failure, exiting");
+	if (!com_init(PJON_ID)) {
+		log_error(nullptr, "Communication inititalization failure, exiting");
 		return EXIT_FAILURE;
 	}
+	for (auto &bus : serial_buses)
+		com_add_bus(bus.device, bus.baudrate);
+	for (auto &route : bus_routes) {
+		if (!com_add_route(route.id, route.bus))
+			return EXIT_FAILURE;
+	}
 	com_set_time_period(1, 1.4);
 	com_set_max_attempts(40);
+#ifdef STATS_SHM
+	stats_open(STATS_SHM);
+#endif
+	prof_init(PROF_DUMP_PATH);
+
+	/* PACKET POOL */
+	if (!pool_init(POOL_SIZE)) {
+		log_error(nullptr, "Packet pool allocation failure, exiting");
+		return EXIT_FAILURE;
+	}
 
 	/* SOCKET */
 	if (!socket_init("/tmp/PJON.sock", 1024)){
 		log_error(nullptr, "Socket inititalization failure, exiting");
 		return EXIT_FAILURE;
 	}
+#ifdef SOCKET_SEQPACKET
+	if (!socket_init_seqpacket(SOCKET_SEQPACKET)) {
+		log_error(nullptr, "SOCK_SEQPACKET socket inititalization failure, exiting");
+		return EXIT_FAILURE;
+	}
+#endif
+#ifdef SOCKET_TCP
+	if (!socket_init_tcp(SOCKET_TCP, SOCKET_TCP_PORT)) {
+		log_error(nullptr, "TCP socket inititalization failure, exiting");
+		return EXIT_FAILURE;
+	}
+#endif
 
 	/* SERVER */
+#ifdef SERVER_WORKERS
+	server_set_workers(SERVER_WORKERS);
+#endif
+#ifdef METRICS_SOCKET
+	server_init(UPDATE_PERIOD, METRICS_SOCKET);
+#else
 	server_init(UPDATE_PERIOD);
+#endif
 	server_run();
 }
 
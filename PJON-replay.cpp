@@ -0,0 +1,399 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Replay of a capture (see capture.hpp) against a running daemon: the socket
+// frames the clients sent are written again through as many connections, and
+// the PJON side is a simulated bus on a pseudo-terminal. There, the packets
+// received in the capture are sent again and the packets of the daemon are
+// acknowledged, or not, as they were in the capture. The latencies of the
+// requests are reported next to the captured ones as key=value lines.
+
+#include "bench.hpp"
+#include "capture.hpp"
+#include "communication.hpp"
+#include "config.h"
+#include "protocol.hpp"
+#include "simulation.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <getopt.h>
+#include <map>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Time left to the pending requests after the last event
+#define REPLAY_DRAIN_TIME 2'000'000 // in us
+
+// Time the daemon is waited for to accept the connections
+#define REPLAY_CONNECT_TIME 10'000'000 // in us
+
+struct Event {
+	uint64_t time; // in us from the start of the capture
+	capture_record record;
+	std::string data;
+};
+
+// captured outcomes of the packets sent to a node with the same payload, in
+// the order they were sent
+struct Outcome {
+	bool acknowledged;
+	uint64_t duration; // from the request to its result in us
+};
+
+static volatile sig_atomic_t running = 1;
+static std::map<std::string, std::deque<Outcome>> outcomes;
+static std::map<std::string, uint64_t> lost_until;
+static struct {
+	unsigned long socket_frames;
+	unsigned long pjon_frames;
+	unsigned long acknowledged;
+	unsigned long unexpected;
+	unsigned long results[4];
+	unsigned long captured_results[4];
+	uint64_t max_lag;
+	std::vector<uint32_t> result_latency;
+	std::vector<uint32_t> captured_latency;
+} stats;
+
+static void usage(const char *name);
+static bool load(const char *path, std::vector<Event> &events);
+static void analyze(const std::vector<Event> &events);
+static void handle_packet(bench_connection &c, const proto_packet *p);
+static void handle_frame(int fd, const uint8_t *data, size_t n, uint32_t bd,
+		uint32_t ack_latency);
+static std::string key(uint8_t id, const void *data, size_t n);
+static unsigned int result_index(int8_t state);
+static void stop(int sig);
+
+int main(int argc, char *argv[])
+{
+	const char *device = SERIAL_DEVICE;
+	const char *socket_name = SOCKET_FILE;
+	uint32_t baudrate = BAUDRATE;
+	uint8_t target = ID_COMPUTER;
+	double speed = 1;
+	uint32_t ack_latency = 500;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:S:b:t:x:a:h")) != -1) {
+		switch (opt) {
+			case 'd': device = optarg; break;
+			case 'S': socket_name = optarg; break;
+			case 'b': baudrate = strtoul(optarg, nullptr, 0); break;
+			case 't': target = strtoul(optarg, nullptr, 0); break;
+			case 'x': speed = strtod(optarg, nullptr); break;
+			case 'a': ack_latency = strtoul(optarg, nullptr, 0); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1 || speed <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<Event> events;
+	if (!load(argv[optind], events))
+		return EXIT_FAILURE;
+	analyze(events);
+
+	int fd = sim_open_pty(device);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	printf("Replaying %zu events on %s, waiting for the daemon\n",
+			events.size(), device);
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	// one connection per captured client, once the daemon is up
+	std::map<int32_t, bench_connection> conns;
+	for (auto &e : events) {
+		if (e.record.type == CAPTURE_SOCKET_IN)
+			conns[e.record.ref].fd = -1;
+	}
+	uint64_t deadline = sim_micros() + REPLAY_CONNECT_TIME;
+	for (auto &c : conns) {
+		while ((c.second.fd = bench_connect(socket_name, SOCK_STREAM)) < 0) {
+			if (!running || sim_micros() > deadline) {
+				fprintf(stderr, "Cannot connect to the daemon on %s\n", socket_name);
+				unlink(device);
+				return EXIT_FAILURE;
+			}
+			usleep(100'000);
+		}
+	}
+
+	std::vector<struct pollfd> pfds;
+	std::vector<bench_connection*> polled;
+	pfds.push_back((struct pollfd){fd, POLLIN, 0});
+	for (auto &c : conns) {
+		pfds.push_back((struct pollfd){c.second.fd, POLLIN, 0});
+		polled.push_back(&c.second);
+	}
+
+	frame_tsa_reader reader = {};
+	uint64_t start = sim_micros();
+	uint64_t end = 0;
+	size_t next = 0;
+	while (running) {
+		uint64_t now = sim_micros();
+
+		// events due, at the replay speed
+		for (; next < events.size(); next++) {
+			const Event &e = events[next];
+			uint64_t due = start + e.time / speed;
+			if (due > now)
+				break;
+			stats.max_lag = std::max(stats.max_lag, now - due);
+
+			if (e.record.type == CAPTURE_SOCKET_IN) {
+				bench_connection &c = conns[e.record.ref];
+				if (write(c.fd, e.data.data(), e.data.size())
+						!= (ssize_t) e.data.size()) {
+					perror("write");
+					running = 0;
+					break;
+				}
+				if (e.data[0] == PROTO_HEAD_OUTGOING_MSG)
+					c.in_flight.push_back(now);
+				stats.socket_frames++;
+			} else if (e.record.type == CAPTURE_PJON_RECEIVE) {
+				frame_packet p = {};
+				p.receiver = target;
+				p.sender = e.record.id;
+				p.header = FRAME_DEFAULT_HEADER;
+				p.length = e.data.size();
+				memcpy(p.payload, e.data.data(), e.data.size());
+				if (sim_write_packet(fd, &p, baudrate))
+					stats.pjon_frames++;
+			}
+		}
+
+		// pending requests are waited for after the last event
+		if (next == events.size()) {
+			bool pending = false;
+			for (auto &c : conns)
+				pending = pending || !c.second.in_flight.empty();
+			if (!end)
+				end = now;
+			if (!pending || now >= end + REPLAY_DRAIN_TIME)
+				break;
+		}
+
+		if (poll(pfds.data(), pfds.size(), 1) < 0) {
+			if (running)
+				perror("poll");
+			break;
+		}
+		if (pfds[0].revents & POLLIN) {
+			uint8_t buf[FRAME_TSA_MAX_LENGTH];
+			ssize_t count = read(fd, buf, sizeof(buf));
+			for (ssize_t i = 0; i < count; i++) {
+				size_t n = frame_tsa_feed(&reader, buf[i]);
+				if (n)
+					handle_frame(fd, reader.data, n, baudrate, ack_latency);
+			}
+		}
+		for (size_t i = 1; i < pfds.size(); i++) {
+			if ((pfds[i].revents & (POLLIN | POLLHUP))
+					&& !bench_read(*polled[i-1], handle_packet))
+				running = 0;
+		}
+	}
+	unlink(device);
+
+	printf("events=%zu\n", events.size());
+	printf("speed=%.2f\n", speed);
+	printf("duration_s=%.3f\n", (sim_micros() - start) / 1e6);
+	printf("max_lag_us=%lu\n", (unsigned long) stats.max_lag);
+	printf("socket_frames=%lu\n", stats.socket_frames);
+	printf("pjon_frames=%lu\n", stats.pjon_frames);
+	printf("acknowledged=%lu\n", stats.acknowledged);
+	printf("unexpected=%lu\n", stats.unexpected);
+	static const char *names[] = {"success", "content_too_long",
+		"connection_lost", "other"};
+	for (unsigned int i = 0; i < 4; i++) {
+		printf("results_%s=%lu\n", names[i], stats.results[i]);
+		printf("captured_results_%s=%lu\n", names[i], stats.captured_results[i]);
+	}
+	bench_report("result", stats.result_latency);
+	bench_report("captured_result", stats.captured_latency);
+	return EXIT_SUCCESS;
+}
+
+void usage(const char *name)
+{
+	printf("Usage: %s [-d device] [-S socket] [-b baudrate] [-t target] "
+			"[-x speed] [-a ack_us] capture\n"
+			"Replay a capture of PJON-daemon (CAPTURE_FILE) against the daemon, to "
+			"be\nstarted after this command. All the buses are replayed on device.\n"
+			"  -d  link to the pseudo-terminal (default: %s)\n"
+			"  -S  daemon socket name (default: %s)\n"
+			"  -b  emulated baudrate (default: %d)\n"
+			"  -t  PJON id of the daemon (default: 0x%02x)\n"
+			"  -x  speed factor of the replay (default: 1)\n"
+			"  -a  acknowledgement latency of the nodes in us (default: 500)\n",
+			name, SERIAL_DEVICE, SOCKET_FILE, BAUDRATE, ID_COMPUTER);
+}
+
+bool load(const char *path, std::vector<Event> &events)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+
+	capture_file_header h;
+	if (fread(&h, sizeof(h), 1, fp) != 1
+			|| memcmp(h.magic, CAPTURE_MAGIC, sizeof(h.magic)) != 0) {
+		fprintf(stderr, "%s: not a capture file\n", path);
+		fclose(fp);
+		return false;
+	}
+
+	// a record truncated by the end of the capture is ignored
+	Event e;
+	while (fread(&e.record, sizeof(e.record), 1, fp) == 1) {
+		e.data.resize(e.record.length);
+		if (e.record.length && fread(&e.data[0], e.record.length, 1, fp) != 1)
+			break;
+		if (e.record.time < h.monotonic)
+			continue;
+		e.time = (e.record.time - h.monotonic) / 1'000;
+		if (e.record.type == CAPTURE_SOCKET_IN && e.data.size() != PROTO_PACKET_SIZE)
+			continue;
+		events.push_back(e);
+	}
+	fclose(fp);
+	return true;
+}
+
+// outcomes of the PJON requests and latencies of the client requests
+void analyze(const std::vector<Event> &events)
+{
+	std::map<int32_t, const Event*> sent;
+	std::map<int32_t, std::deque<uint64_t>> requested;
+
+	for (auto &e : events) {
+		const capture_record &r = e.record;
+		switch (r.type) {
+			case CAPTURE_PJON_SEND:
+				sent[r.ref] = &e;
+				break;
+			case CAPTURE_PJON_RESULT: {
+				auto it = sent.find(r.ref);
+				if (it == sent.end())
+					break;
+				const Event &s = *it->second;
+				outcomes[key(s.record.id, s.data.data(), s.data.size())].push_back(
+						(Outcome){r.state == COM_SUCCESS, e.time - s.time});
+				sent.erase(it);
+				break;
+			}
+			case CAPTURE_SOCKET_IN:
+				if (e.data[0] == PROTO_HEAD_OUTGOING_MSG)
+					requested[r.ref].push_back(e.time);
+				break;
+			case CAPTURE_SOCKET_OUT: {
+				auto *p = (const proto_packetOutgoingResult*) e.data.data();
+				auto &q = requested[r.ref];
+				if (p->head != PROTO_HEAD_OUTGOING_RESULT || q.empty())
+					break;
+				stats.captured_latency.push_back(e.time - q.front());
+				stats.captured_results[result_index(p->result)]++;
+				q.pop_front();
+				break;
+			}
+		}
+	}
+}
+
+void handle_packet(bench_connection &c, const proto_packet *p)
+{
+	auto *r = (const proto_packetOutgoingResult*) p;
+	if (r->head != PROTO_HEAD_OUTGOING_RESULT || c.in_flight.empty())
+		return;
+	stats.result_latency.push_back(sim_micros() - c.in_flight.front());
+	stats.results[result_index(r->result)]++;
+	c.in_flight.pop_front();
+}
+
+// Acknowledge the packet as it was in the capture. The retries of a packet
+// that was not acknowledged are ignored as long as the daemon retried it in
+// the capture, packets absent from the capture are acknowledged.
+void handle_frame(int fd, const uint8_t *data, size_t n, uint32_t bd,
+		uint32_t ack_latency)
+{
+	frame_packet p;
+	if (!frame_decode(data, n, &p) || !(p.header & FRAME_ACK_REQ_BIT))
+		return;
+
+	uint64_t now = sim_micros();
+	std::string k = key(p.receiver, p.payload, p.length);
+	auto lost = lost_until.find(k);
+	if (lost != lost_until.end()) {
+		if (now < lost->second)
+			return;
+		lost_until.erase(lost);
+	}
+
+	auto it = outcomes.find(k);
+	if (it == outcomes.end() || it->second.empty()) {
+		stats.unexpected++;
+	} else {
+		Outcome o = it->second.front();
+		it->second.pop_front();
+		if (!o.acknowledged) {
+			lost_until[k] = now + o.duration;
+			return;
+		}
+	}
+
+	usleep(sim_line_time(n + 2, bd) + ack_latency);
+	uint8_t ack = FRAME_ACK;
+	if (write(fd, &ack, 1) == 1)
+		stats.acknowledged++;
+}
+
+std::string key(uint8_t id, const void *data, size_t n)
+{
+	return std::string(1, (char) id) + std::string((const char*) data, n);
+}
+
+unsigned int result_index(int8_t state)
+{
+	switch (state) {
+		case PROTO_OUTGOING_RESULT_SUCCESS: return 0;
+		case PROTO_OUTGOING_RESULT_CONTENT_TOO_LONG: return 1;
+		case PROTO_OUTGOING_RESULT_CONNECTION_LOST: return 2;
+		default: return 3;
+	}
+}
+
+void stop(int sig)
+{
+	(void) sig;
+	running = 0;
+}
@@ -0,0 +1,190 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simulation.hpp"
+#include "config.h"
+
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t running = 1;
+static struct {
+	unsigned long received;
+	unsigned long invalid;
+	unsigned long acknowledged;
+	unsigned long sent;
+} stats;
+
+static void usage(const char *name);
+static bool parse_node(char *arg, sim_node *node);
+static void handle_packet(int fd, Simulation &simulation, const uint8_t *data,
+		size_t n, uint32_t bd);
+static void stop(int sig);
+
+int main(int argc, char *argv[])
+{
+	const char *device = SERIAL_DEVICE;
+	uint32_t baudrate = BAUDRATE;
+	uint8_t target = ID_COMPUTER;
+	uint32_t seed = 1;
+	bool stamped = false;
+	std::vector<sim_node> nodes;
+	sim_node node;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:b:t:s:n:Th")) != -1) {
+		switch (opt) {
+			case 'd':
+				device = optarg;
+				break;
+			case 'b':
+				baudrate = strtoul(optarg, nullptr, 0);
+				break;
+			case 't':
+				target = strtoul(optarg, nullptr, 0);
+				break;
+			case 's':
+				seed = strtoul(optarg, nullptr, 0);
+				break;
+			case 'T':
+				stamped = true;
+				break;
+			case 'n':
+				if (!parse_node(optarg, &node)) {
+					fprintf(stderr, "Invalid node: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				nodes.push_back(node);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	Simulation simulation(target, seed);
+	simulation.set_stamped(stamped);
+	if (nodes.empty())
+		nodes = LOOPBACK_NODES;
+	for (auto &n : nodes)
+		simulation.add_node(n);
+
+	int fd = sim_open_pty(device);
+	if (fd < 0)
+		return EXIT_FAILURE;
+	printf("Simulating %zu nodes on %s at %u bauds\n", nodes.size(), device,
+			baudrate);
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	frame_tsa_reader reader = {};
+	while (running) {
+
+		// line reception
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (poll(&pfd, 1, 1) > 0 && (pfd.revents & POLLIN)) {
+			uint8_t buf[FRAME_TSA_MAX_LENGTH];
+			ssize_t count = read(fd, buf, sizeof(buf));
+			for (ssize_t i = 0; i < count; i++) {
+				size_t n = frame_tsa_feed(&reader, buf[i]);
+				if (n)
+					handle_packet(fd, simulation, reader.data, n, baudrate);
+			}
+		}
+
+		// replies and unsolicited messages
+		frame_packet p;
+		while (simulation.poll(sim_micros(), &p)) {
+			if (sim_write_packet(fd, &p, baudrate))
+				stats.sent++;
+		}
+	}
+
+	unlink(device);
+	printf("received=%lu invalid=%lu acknowledged=%lu sent=%lu\n",
+			stats.received, stats.invalid, stats.acknowledged, stats.sent);
+	return EXIT_SUCCESS;
+}
+
+void usage(const char *name)
+{
+	printf("Usage: %s [-d device] [-b baudrate] [-t target] [-s seed] [-T] "
+			"[-n node]...\n"
+			"Simulate PJON nodes on a pseudo-terminal linked to device.\n"
+			"  -d  link to the pseudo-terminal (default: %s)\n"
+			"  -b  emulated baudrate (default: %d)\n"
+			"  -t  id the replies and unsolicited messages are sent to "
+			"(default: 0x%02x)\n"
+			"  -s  seed of the drops (default: 1)\n"
+			"  -T  stamp the unsolicited messages with their sending time\n"
+			"  -n  id[,ack_us[,reply_us[,drop_rate[,echo|none[,period_us]]]]]\n"
+			"      add a node, the nodes of LOOPBACK_NODES are used if none\n",
+			name, SERIAL_DEVICE, BAUDRATE, ID_COMPUTER);
+}
+
+bool parse_node(char *arg, sim_node *node)
+{
+	*node = (sim_node){0, 0, 0, 0, SIM_REPLY_NONE, 0};
+	char *field = strtok(arg, ",");
+	for (unsigned int i = 0; field; i++, field = strtok(nullptr, ",")) {
+		switch (i) {
+			case 0: node->id = strtoul(field, nullptr, 0); break;
+			case 1: node->ack_latency = strtoul(field, nullptr, 0); break;
+			case 2: node->reply_latency = strtoul(field, nullptr, 0); break;
+			case 3: node->drop_rate = strtof(field, nullptr); break;
+			case 4:
+				if (strcmp(field, "echo") == 0)
+					node->reply = SIM_REPLY_ECHO;
+				else if (strcmp(field, "none") != 0)
+					return false;
+				break;
+			case 5: node->period = strtoul(field, nullptr, 0); break;
+			default: return false;
+		}
+	}
+	return node->id != 0;
+}
+
+void handle_packet(int fd, Simulation &simulation, const uint8_t *data,
+		size_t n, uint32_t bd)
+{
+	frame_packet p;
+	if (!frame_decode(data, n, &p)) {
+		stats.invalid++;
+		return;
+	}
+	stats.received++;
+
+	uint32_t ack_delay;
+	if (!simulation.deliver(&p, sim_micros(), &ack_delay))
+		return;
+
+	// the frame is received once it went through the line
+	usleep(sim_line_time(n + 2, bd) + ack_delay);
+	uint8_t ack = FRAME_ACK;
+	if (write(fd, &ack, 1) == 1)
+		stats.acknowledged++;
+}
+
+void stop(int sig)
+{
+	(void) sig;
+	running = 0;
+}
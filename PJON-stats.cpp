@@ -0,0 +1,128 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Print the statistics a daemon publishes in shared memory (STATS_SHM) as
+// key=value lines, once or periodically with the rates over the period.
+
+#include "config.h"
+#include "stats.hpp"
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(const char *name);
+static void print(const stats_page *page, const stats_data *d,
+		const stats_data *previous);
+
+int main(int argc, char *argv[])
+{
+	const char *name = STATS_SHM;
+	unsigned int interval = 0;
+	unsigned long count = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:i:n:h")) != -1) {
+		switch (opt) {
+			case 's': name = optarg; break;
+			case 'i': interval = strtoul(optarg, nullptr, 0); break;
+			case 'n': count = strtoul(optarg, nullptr, 0); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	const stats_page *page = stats_map(name);
+	if (!page) {
+		fprintf(stderr, "No stats page %s\n", name);
+		return EXIT_FAILURE;
+	}
+
+	stats_data previous, d;
+	stats_read(page, &d);
+	print(page, &d, nullptr);
+	for (unsigned long i = 1; interval && (!count || i < count); i++) {
+		previous = d;
+		usleep(interval * 1'000);
+		stats_read(page, &d);
+		printf("\n");
+		print(page, &d, &previous);
+	}
+	return EXIT_SUCCESS;
+}
+
+void usage(const char *name)
+{
+	printf("Usage: %s [-s name] [-i interval] [-n count]\n"
+			"  -s  name of the shared memory page (default: %s)\n"
+			"  -i  print every interval ms with the rates since the previous "
+			"print\n"
+			"  -n  number of prints with -i (default: until interrupted)\n",
+			name, STATS_SHM);
+}
+
+void print(const stats_page *page, const stats_data *d,
+		const stats_data *previous)
+{
+	bool alive = kill(page->pid, 0) == 0 || errno == EPERM;
+	printf("pid=%u\n", page->pid);
+	printf("alive=%d\n", alive);
+	printf("clients=%u\n", d->clients);
+	printf("pending=%u\n", d->pending);
+	printf("success=%llu\n", (unsigned long long) d->success);
+	printf("lost=%llu\n", (unsigned long long) d->lost);
+	printf("too_long=%llu\n", (unsigned long long) d->too_long);
+	printf("received=%llu\n", (unsigned long long) d->received);
+	printf("fwd_dropped=%llu\n", (unsigned long long) d->fwd_dropped);
+	printf("log_dropped=%llu\n", (unsigned long long) d->log_dropped);
+	printf("rtt_us_p50=%u\nrtt_us_p90=%u\nrtt_us_p99=%u\nrtt_us_max=%u\n",
+			d->rtt_p50, d->rtt_p90, d->rtt_p99, d->rtt_max);
+	printf("loop_us_p50=%u\nloop_us_p99=%u\nloop_us_max=%u\n", d->loop_p50,
+			d->loop_p99, d->loop_max);
+
+	for (unsigned int b = 0; b < d->n_buses && b < STATS_MAX_BUSES; b++) {
+		const stats_bus &bus = d->buses[b];
+		printf("bus%u_connected=%u\n", b, bus.connected);
+		printf("bus%u_outgoing=%u\n", b, bus.outgoing);
+		printf("bus%u_reception=%u\n", b, bus.reception);
+		printf("bus%u_dropped=%llu\n", b, (unsigned long long) bus.dropped);
+		printf("bus%u_reconnects=%llu\n", b, (unsigned long long) bus.reconnects);
+	}
+
+	for (unsigned int id = 0; id < 256; id++) {
+		const stats_node &n = d->nodes[id];
+		if (!n.success && !n.lost)
+			continue;
+		printf("node_0x%02x_success=%llu\n", id, (unsigned long long) n.success);
+		printf("node_0x%02x_lost=%llu\n", id, (unsigned long long) n.lost);
+		printf("node_0x%02x_rtt_us_p50=%u\n", id, n.rtt_p50);
+		printf("node_0x%02x_rtt_us_p99=%u\n", id, n.rtt_p99);
+	}
+
+	// rates over the interval, the page may not have been published again
+	if (!previous || d->time <= previous->time)
+		return;
+	double dt = (d->time - previous->time) / 1e6;
+	uint64_t success = d->success - previous->success;
+	uint64_t lost = d->lost - previous->lost;
+	printf("interval_s=%.3f\n", dt);
+	printf("success_s=%.1f\n", success / dt);
+	printf("received_s=%.1f\n", (d->received - previous->received) / dt);
+	if (success + lost)
+		printf("success_rate=%.4f\n", (double) success / (success + lost));
+}
@@ -0,0 +1,287 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Render the binary traces of the daemon (see log_trace_init) in the text
+// format of the logs.
+
+#include "protocol.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+struct File {
+	uint64_t generation;
+	std::vector<char> data;
+};
+
+struct Site {
+	bool defined;
+	uint8_t kind;
+	std::string module;
+	std::string format;
+	int n_specs;
+	trace_spec specs[TRACE_MAX_ARGS];
+};
+
+static bool colors = false;
+
+static bool load(const char *path, File &f);
+static void dump(const File &f);
+static void render(const Site &site, const trace_header *h, const char *end);
+static size_t render_message(const Site &site, const char *c, const char *end,
+		char *out, size_t size);
+static size_t render_spec(const char *format, const trace_spec &spec,
+		const char *&c, const char *end, char *out, size_t size);
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "ch")) != -1) {
+		if (opt == 'c') {
+			colors = true;
+			continue;
+		}
+		printf("Usage: %s [-c] file...\n"
+				"Render the trace files of PJON-daemon as its text logs, in the order "
+				"they\nwere written.\n"
+				"  -c  enable colors\n", argv[0]);
+		return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	std::vector<File> files;
+	for (int i = optind; i < argc; i++) {
+		File f;
+		if (load(argv[i], f))
+			files.push_back(std::move(f));
+	}
+	std::sort(files.begin(), files.end(), [](const File &a, const File &b) {
+		return a.generation < b.generation;
+	});
+	for (auto &f : files)
+		dump(f);
+	return EXIT_SUCCESS;
+}
+
+bool load(const char *path, File &f)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	f.data.resize(ftell(fp));
+	fseek(fp, 0, SEEK_SET);
+	size_t n = fread(f.data.data(), 1, f.data.size(), fp);
+	fclose(fp);
+
+	auto *h = (const trace_file_header*) f.data.data();
+	if (n != f.data.size() || n < sizeof(*h)
+			|| memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		return false;
+	}
+	f.generation = h->generation;
+	return true;
+}
+
+void dump(const File &f)
+{
+	std::vector<Site> sites(TRACE_MAX_SITES);
+	const char *c = f.data.data() + sizeof(trace_file_header);
+	const char *end = f.data.data() + f.data.size();
+
+	while (c + sizeof(trace_header) <= end) {
+		auto *h = (const trace_header*) c;
+		if (h->size < sizeof(trace_header) || c + h->size > end)
+			break;
+		const char *body = c + sizeof(trace_header);
+		c += h->size;
+
+		if (h->site >= TRACE_MAX_SITES)
+			continue;
+		Site &site = sites[h->site];
+
+		if (h->type == TRACE_RECORD_SITE) {
+			auto *b = (const uint8_t*) body;
+			size_t module_n = b[1];
+			size_t format_n = b[2] | b[3] << 8;
+			site.defined = true;
+			site.kind = b[0];
+			site.module.assign(body + 4, module_n);
+			site.format.assign(body + 4 + module_n, format_n);
+			site.n_specs = trace_parse_format(site.format.c_str(), site.specs,
+					TRACE_MAX_ARGS);
+			continue;
+		}
+
+		if (h->type == TRACE_RECORD_EVENT && site.defined && site.n_specs >= 0)
+			render(site, h, c);
+	}
+}
+
+// same layout as the text logs, the kinds being the logger's log_kind
+void render(const Site &site, const trace_header *h, const char *end)
+{
+	static const struct {
+		const char *prefix;
+		const char *esc;
+	} kinds[] = {
+		{"", nullptr},
+		{"PACKET : ", nullptr},
+		{"WARNING : ", "\x1b[93m\x1b[1m"},
+		{"ERROR : ", "\x1b[91m\x1b[1m"},
+		{"ERROR : ", "\x1b[91m\x1b[1m"},
+	};
+	char message[1024];
+	char suffix[1024];
+	const char *c = (const char*) (h + 1);
+
+	suffix[0] = '\0';
+	if (h->flags & TRACE_FLAG_ERROR) {
+		snprintf(suffix, sizeof(suffix), " : %s", strerror(*(int64_t*) c));
+		c += 8;
+	}
+	if (h->flags & TRACE_FLAG_PACKET) {
+		proto_packet p;
+		memcpy(&p, c, sizeof(p));
+		strcpy(suffix, " : ");
+		proto_packet_to_str(&p, &suffix[3], sizeof(suffix) - 3);
+		c += TRACE_PACKET_SIZE;
+	}
+	render_message(site, c, end, message, sizeof(message));
+
+	char date[64];
+	time_t t = h->time / 1'000'000'000;
+	struct tm tmp;
+	localtime_r(&t, &tmp);
+	strftime(date, sizeof(date), "%FT%TZ", &tmp);
+
+	uint8_t kind = site.kind < 5 ? site.kind : 0;
+	const char *esc = colors ? kinds[kind].esc : nullptr;
+	printf("%s - %s%s%s%s%s%s%s\n", date, site.module.c_str(),
+			site.module.empty() ? "" : " - ", esc ? esc : "", kinds[kind].prefix,
+			esc ? "\x1b[0m" : "", message, suffix);
+}
+
+size_t render_message(const Site &site, const char *c, const char *end,
+		char *out, size_t size)
+{
+	const char *format = site.format.c_str();
+	size_t n = 0;
+	size_t literal = 0;
+
+	for (int i = 0; i <= site.n_specs && n < size; i++) {
+		// literal text up to the conversion, with %% unescaped
+		size_t stop = i < site.n_specs ? site.specs[i].start : site.format.size();
+		for (size_t j = literal; j < stop && n < size - 1; j++) {
+			if (format[j] == '%' && format[j+1] == '%')
+				j++;
+			out[n++] = format[j];
+		}
+		if (i == site.n_specs)
+			break;
+		n += render_spec(format, site.specs[i], c, end, &out[n], size - n);
+		literal = site.specs[i].start + site.specs[i].length;
+	}
+	out[n < size ? n : size - 1] = '\0';
+	return n;
+}
+
+// rebuild the conversion with the recorded width and precision, and a long
+// long length for the integers since the arguments are recorded in 8 bytes
+size_t render_spec(const char *format, const trace_spec &spec, const char *&c,
+		const char *end, char *out, size_t size)
+{
+	char f[64];
+	size_t n = 0;
+	int64_t slot;
+
+	for (uint16_t i = spec.start; i < spec.start + spec.length - 1
+			&& n < sizeof(f) - 24; i++) {
+		char x = format[i];
+		if (x == '*') {
+			if (c + 8 > end)
+				return 0;
+			memcpy(&slot, c, 8);
+			c += 8;
+			n += snprintf(&f[n], sizeof(f) - n, "%d", (int) slot);
+		} else if (!strchr("hlzjtqL", x)) {
+			f[n++] = x;
+		}
+	}
+	char conversion = format[spec.start + spec.length - 1];
+	if (spec.conversion == 'i' || spec.conversion == 'u') {
+		f[n++] = 'l';
+		f[n++] = 'l';
+	}
+	f[n++] = conversion;
+	f[n] = '\0';
+
+	if (spec.conversion == 'n')
+		return snprintf(out, size, "%s", f);
+	if (c + 8 > end)
+		return 0;
+	memcpy(&slot, c, 8);
+	c += 8;
+
+	int count = 0;
+	switch (spec.conversion) {
+		case 'i': {
+			long long v = spec.size == 1 ? (int8_t) slot : spec.size == 2 ?
+				(int16_t) slot : spec.size == 4 ? (int32_t) slot : slot;
+			count = snprintf(out, size, f, v);
+			break;
+		}
+		case 'u': {
+			unsigned long long v = spec.size == 1 ? (uint8_t) slot : spec.size == 2 ?
+				(uint16_t) slot : spec.size == 4 ? (uint32_t) slot : (uint64_t) slot;
+			count = snprintf(out, size, f, v);
+			break;
+		}
+		case 'f': {
+			double v;
+			memcpy(&v, &slot, 8);
+			count = snprintf(out, size, f, v);
+			break;
+		}
+		case 'c':
+			count = snprintf(out, size, f, (int) slot);
+			break;
+		case 'p':
+			count = snprintf(out, size, f, (void*) slot);
+			break;
+		case 's': {
+			size_t length = slot;
+			if (length > TRACE_MAX_STRING || c + ALIGN(length) > end)
+				return 0;
+			std::string s(c, length);
+			c += ALIGN(length);
+			count = snprintf(out, size, f, s.c_str());
+			break;
+		}
+	}
+	if (count < 0)
+		return 0;
+	return (size_t) count < size ? count : size - 1;
+}
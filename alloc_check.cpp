@@ -0,0 +1,111 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "alloc_check.hpp"
+
+#if ALLOC_CHECK
+
+#include <execinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// glibc's allocator, the functions below replace its public names
+extern "C" {
+  void *__libc_malloc(size_t n);
+  void *__libc_calloc(size_t n, size_t size);
+  void *__libc_realloc(void *p, size_t n);
+  void __libc_free(void *p);
+}
+
+// in the static TLS of the executable, reading them does not allocate
+static thread_local const char *section = nullptr;
+static thread_local unsigned int allowed = 0;
+static thread_local unsigned long allocations = 0;
+static thread_local unsigned long sections = 0;
+
+static void fail();
+
+static inline void count()
+{
+  if (!section || allowed)
+    return;
+  allocations++;
+  if (sections >= ALLOC_CHECK_WARMUP)
+    fail();
+}
+
+extern "C" void *malloc(size_t n)
+{
+  count();
+  return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+  count();
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t n)
+{
+  count();
+  return __libc_realloc(p, n);
+}
+
+extern "C" void free(void *p)
+{
+  __libc_free(p);
+}
+
+void alloc_check_begin(const char *s)
+{
+  allocations = 0;
+  section = s;
+}
+
+void alloc_check_end()
+{
+  section = nullptr;
+  sections++;
+}
+
+unsigned long alloc_check_count()
+{
+  return allocations;
+}
+
+AllocAllowed::AllocAllowed()
+{
+  allowed++;
+}
+
+AllocAllowed::~AllocAllowed()
+{
+  allowed--;
+}
+
+// backtrace may allocate when it loads libgcc, the counting is stopped first
+void fail()
+{
+  const char *s = section;
+  section = nullptr;
+  fprintf(stderr, "Allocation in %s after the warm-up (run %lu)\n", s,
+      sections + 1);
+  void *frames[32];
+  int n = backtrace(frames, 32);
+  backtrace_symbols_fd(frames, n, 2);
+  abort();
+}
+
+#endif
@@ -0,0 +1,72 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+// Allocation check of the debug builds (ALLOC_CHECK = 1 in config.mk):
+// malloc, calloc and realloc, and so operator new, are counted on the threads
+// between alloc_check_begin and alloc_check_end. Once the section ran
+// ALLOC_CHECK_WARMUP times, an allocation aborts the daemon with the
+// backtrace of the call. In the other builds the functions are no-ops.
+
+#ifndef ALLOC_CHECK
+#define ALLOC_CHECK 0
+#endif
+
+// Number of sections allowed to allocate while the buffers reach their
+// working size
+#ifndef ALLOC_CHECK_WARMUP
+#define ALLOC_CHECK_WARMUP 1000
+#endif
+
+#if ALLOC_CHECK
+
+// Start counting the allocations of the calling thread in the section named
+// section (a static string)
+void alloc_check_begin(const char *section);
+
+// Stop counting
+void alloc_check_end();
+
+// Return the number of allocations since alloc_check_begin
+unsigned long alloc_check_count();
+
+// Allocations are allowed in its scope (e.g. new connections, on-demand
+// dumps)
+class AllocAllowed {
+
+  public:
+
+    AllocAllowed();
+    ~AllocAllowed();
+
+};
+
+#else
+
+inline void alloc_check_begin(const char *section) { (void) section; }
+inline void alloc_check_end() {}
+inline unsigned long alloc_check_count() { return 0; }
+
+class AllocAllowed {
+
+  public:
+
+    ~AllocAllowed() {}
+
+};
+
+#endif
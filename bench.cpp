@@ -0,0 +1,81 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bench.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int bench_connect(const char *name, int type)
+{
+  int fd = socket(PF_LOCAL, type, 0);
+  if (fd < 0)
+    return -1;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_LOCAL;
+  strncpy(addr.sun_path+1, name, sizeof(addr.sun_path)-2);
+  socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(name) + 1;
+  if (connect(fd, (struct sockaddr*) &addr, len) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+bool bench_read(bench_connection &c,
+    void (*handle)(bench_connection &c, const proto_packet *p))
+{
+  ssize_t count = read(c.fd, &c.buffer[c.n], sizeof(c.buffer) - c.n);
+  if (count <= 0) {
+    fprintf(stderr, "Connection closed by the daemon\n");
+    return false;
+  }
+  c.n += count;
+
+  size_t i;
+  for (i = 0; i + PROTO_PACKET_SIZE <= c.n; i += PROTO_PACKET_SIZE)
+    handle(c, (const proto_packet*) &c.buffer[i]);
+  memmove(c.buffer, &c.buffer[i], c.n - i);
+  c.n -= i;
+  return true;
+}
+
+void bench_report(const char *name, std::vector<uint32_t> &latency)
+{
+  static const struct {
+    const char *name;
+    double q;
+  } percentiles[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99},
+    {"p999", 0.999}};
+
+  printf("%s_samples=%zu\n", name, latency.size());
+  if (latency.empty())
+    return;
+  std::sort(latency.begin(), latency.end());
+  for (auto &p : percentiles) {
+    printf("%s_latency_us_%s=%u\n", name, p.name,
+        latency[(size_t) (p.q * (latency.size() - 1))]);
+  }
+  printf("%s_latency_us_max=%u\n", name, latency.back());
+}
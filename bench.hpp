@@ -0,0 +1,48 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "protocol.hpp"
+
+#include <deque>
+#include <stdint.h>
+#include <vector>
+
+// Client side shared by the tools driving a running daemon (pjon-bench and
+// PJON-replay): the connection, the reassembly of the packets read from it and
+// the report of the latencies.
+
+// a connection to the daemon and the send times (sim_micros) of its outgoing
+// messages waiting for their result, in order
+struct bench_connection {
+  int fd = -1;
+  std::deque<uint64_t> in_flight;
+  size_t n = 0;
+  char buffer[16*PROTO_PACKET_SIZE];
+};
+
+// Connect to the daemon listening on name in the abstract namespace, with a
+// socket of the given type (SOCK_STREAM or SOCK_SEQPACKET)
+// Return the socket, or -1 with errno set
+int bench_connect(const char *name, int type);
+
+// Read the packets available on c, handle is called with each complete one
+// Return false if the daemon closed the connection, true otherwise
+bool bench_read(bench_connection &c,
+    void (*handle)(bench_connection &c, const proto_packet *p));
+
+// Print the number of samples and the percentiles of latency (sorted) in us,
+// as key=value lines prefixed by name
+void bench_report(const char *name, std::vector<uint32_t> &latency);
@@ -0,0 +1,114 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "capture.hpp"
+#include "logger.hpp"
+
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t now(clockid_t clock);
+static void write_record(const capture_record *r, const void *data);
+static void close_file();
+
+static FILE *file = nullptr;
+static char buffer[CAPTURE_BUFFER_SIZE];
+static std::mutex file_mutex; // the workers capture their clients
+
+bool capture_open(const char *path)
+{
+  capture_close();
+
+  file = fopen(path, "wb");
+  if (!file) {
+    log_perror("capture", "Failed to open capture %s", path);
+    return false;
+  }
+  setvbuf(file, buffer, _IOFBF, sizeof(buffer));
+
+  capture_file_header h;
+  memcpy(h.magic, CAPTURE_MAGIC, sizeof(h.magic));
+  h.monotonic = now(CLOCK_MONOTONIC);
+  h.realtime = now(CLOCK_REALTIME);
+  if (fwrite(&h, sizeof(h), 1, file) != 1) {
+    log_perror("capture", "Failed to write capture %s", path);
+    capture_close();
+    return false;
+  }
+  log_info("capture", "Capturing to %s", path);
+  return true;
+}
+
+void capture_flush()
+{
+  std::lock_guard<std::mutex> lock(file_mutex);
+  if (file && fflush(file) != 0) {
+    log_perror("capture", "Capture stopped");
+    close_file();
+  }
+}
+
+void capture_close()
+{
+  std::lock_guard<std::mutex> lock(file_mutex);
+  close_file();
+}
+
+void capture_socket(enum capture_type type, int sock, const proto_packet *p)
+{
+  if (!file)
+    return;
+  capture_record r = {now(CLOCK_MONOTONIC), type, 0, 0, 0, sock,
+    sizeof(proto_packet)};
+  write_record(&r, p);
+}
+
+void capture_pjon(enum capture_type type, int ref, uint8_t id, uint8_t bus,
+    int8_t state, const void *data, uint16_t n)
+{
+  if (!file)
+    return;
+  capture_record r = {now(CLOCK_MONOTONIC), type, id, bus, state, ref, n};
+  write_record(&r, data);
+}
+
+uint64_t now(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
+// the capture stops at the first failure, e.g. when the disk is full
+void write_record(const capture_record *r, const void *data)
+{
+  std::lock_guard<std::mutex> lock(file_mutex);
+  if (!file)
+    return;
+  if (fwrite(r, sizeof(*r), 1, file) != 1
+      || (r->length && fwrite(data, r->length, 1, file) != 1)) {
+    log_perror("capture", "Capture stopped");
+    close_file();
+  }
+}
+
+void close_file()
+{
+  if (!file)
+    return;
+  fclose(file);
+  file = nullptr;
+}
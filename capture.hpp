@@ -0,0 +1,74 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "protocol.hpp"
+
+#include <stdint.h>
+
+// Capture of the traffic crossing the daemon, replayed by PJON-replay. The
+// file is the CAPTURE_MAGIC header followed by records appended as they
+// happen, each one being a capture_record and its data. The records of the
+// client workers and of the bus owner are serialized by a lock.
+
+#define CAPTURE_MAGIC "PJONCAP1"
+
+#ifndef CAPTURE_BUFFER_SIZE
+#	define CAPTURE_BUFFER_SIZE (64 << 10)
+#endif
+
+enum capture_type : uint8_t {
+  CAPTURE_SOCKET_IN,    // proto_packet received from the client ref
+  CAPTURE_SOCKET_OUT,   // proto_packet pushed to the client ref
+  CAPTURE_PJON_SEND,    // PJON payload of the request ref pushed to id
+  CAPTURE_PJON_RESULT,  // com_state of the request ref
+  CAPTURE_PJON_RECEIVE  // PJON payload received from id
+};
+
+typedef struct {
+  char magic[8];
+  uint64_t monotonic; // start of the capture in ns (CLOCK_MONOTONIC)
+  uint64_t realtime;  // start of the capture in ns (CLOCK_REALTIME)
+} capture_file_header;
+
+typedef struct __attribute__((packed)) {
+  uint64_t time;   // in ns (CLOCK_MONOTONIC)
+  uint8_t type;    // capture_type
+  uint8_t id;      // PJON destination or source
+  uint8_t bus;
+  int8_t state;    // com_state of CAPTURE_PJON_RESULT
+  int32_t ref;     // client socket or request reference
+  uint16_t length; // of the data following the record
+} capture_record;
+
+// start to capture to the file at path, which is truncated
+// Return false in case of failure, true otherwise
+bool capture_open(const char *path);
+
+// write the buffered records, called once per loop of the server so the
+// capture survives the daemon being killed
+void capture_flush();
+
+// write the buffered records and stop the capture
+void capture_close();
+
+// capture the proto_packet p received from or pushed to the client sock
+// type: CAPTURE_SOCKET_IN or CAPTURE_SOCKET_OUT
+void capture_socket(enum capture_type type, int sock, const proto_packet *p);
+
+// capture a PJON packet or the result of a request
+// type: CAPTURE_PJON_SEND, CAPTURE_PJON_RESULT or CAPTURE_PJON_RECEIVE
+void capture_pjon(enum capture_type type, int ref, uint8_t id, uint8_t bus,
+    int8_t state, const void *data, uint16_t n);
@@ -20,13 +20,38 @@
 #define PJON_INCLUDE_TSA true // Only include ThroughSerialAsync
 
 #include "communication.hpp"
+#include "capture.hpp"
 #include "logger.hpp"
-
-#include <map>
+#include "metrics.hpp"
+#include "profiler.hpp"
+
+#include <atomic>
+#include <errno.h>
+#include <limits.h>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 #include "PJON.h"
+#include "loopback.hpp"
+#include "serial.hpp"
+
+#ifndef COM_STRATEGY
+#define COM_STRATEGY ThroughSerialAsync
+#endif
+
+#ifndef LOOPBACK_NODES
+#define LOOPBACK_NODES {}
+#endif
+
+static_assert(SERIAL_ACK == PJON_ACK && SERIAL_FAIL == PJON_FAIL,
+		"the results of SerialStrategy must be the ones of PJON");
 
 #define min(a, b) (a > b ? b : a)
 #define max(a, b) (a > b ? a : b)
@@ -75,22 +100,122 @@ class ApproxFloatingMean {
 		T mean;
 };
 
-static PJON<ThroughSerialAsync> bus;
-static std::map<com_ref, Packet> packets;
+// How a bus opens, checks and closes the device of its PJON strategy, given by
+// a specialization for each strategy. Only the one of COM_STRATEGY is used.
+template<typename Strategy>
+struct StrategyLink;
+
+template<>
+struct StrategyLink<ThroughSerialAsync> {
+	static bool open(ThroughSerialAsync &s, const char *dev, uint32_t bd,
+			com_id id);
+	static bool is_connected(ThroughSerialAsync &s);
+	static void close(ThroughSerialAsync &s);
+};
+
+template<>
+struct StrategyLink<SerialStrategy> {
+	static bool open(SerialStrategy &s, const char *dev, uint32_t bd,
+			com_id id);
+	static bool is_connected(SerialStrategy &s);
+	static void close(SerialStrategy &s);
+};
+
+template<>
+struct StrategyLink<LoopbackStrategy> {
+	static bool open(LoopbackStrategy &s, const char *dev, uint32_t bd,
+			com_id id);
+	static bool is_connected(LoopbackStrategy &s);
+	static void close(LoopbackStrategy &s);
+};
+
+// A bus served by its own thread. The server thread and the bus thread only
+// share the queues guarded by mutex, the bus I/O is done without holding it.
+// The PJON strategy is chosen at build time with COM_STRATEGY.
+template<typename Strategy>
+class Bus {
+
+	public:
+
+		Bus(unsigned int index, com_id id, const char *dev, uint32_t bd);
+		~Bus();
+
+		bool connect();
+		bool is_connected();
+		void stop();
+		void push(com_ref r, const Packet &p);
+		void cancel(com_ref r);
+		size_t pop_results(com_request *results, size_t n_max);
+		size_t pop_reception(com_message *m, size_t n_max);
+
+	private:
+
+		void run();
+		bool open();
+		void lose();
+		void watch();
+		void unwatch();
+		void wait_device();
+		void send();
+		void receive();
+		void publish();
+		void drop_cancelled();
+		void keep(size_t i, size_t kept);
+		void record_ping(float t);
+		void record_success_rate(bool success);
+		static void receiver(uint8_t * data, uint16_t n,
+				const PJON_Packet_Info &packet_info);
+
+		unsigned int index;
+		com_id id;
+		char *device;
+		uint32_t baudrate;
+		PJON<Strategy> pjon;
+		std::thread thread;
+		std::atomic<bool> running;
+		std::atomic<bool> connected;
+		uint32_t last_connection_attempt;
+		uint32_t reconnect_period;
+		uint32_t last_link_check;
+		bool link_suspect;
+		bool state_log_connected;
+		bool opened;
+
+		// inotify watching the directory of the device while disconnected
+		int watch_fd;
+		bool appeared;
+
+		// shared with the server thread, guarded by mutex
+		std::mutex mutex;
+		std::vector<std::pair<com_ref, Packet>> incoming;
+		std::vector<com_ref> cancelled;
+		std::vector<com_request> results;
+		std::vector<com_message> reception;
+
+		// owned by the bus thread, in their order of arrival
+		std::vector<std::pair<com_ref, Packet>> packets;
+		std::vector<com_request> finished;
+		std::vector<com_message> received;
+		ApproxFloatingMean<float> success_rate;
+		ApproxFloatingMean<float> ping;
+
+};
+
+static com_id pjon_id;
+static const sim_node loopback_nodes[] = LOOPBACK_NODES;
+static std::vector<std::unique_ptr<Bus<COM_STRATEGY>>> buses;
+static int routes[256];
+static bool routes_static[256];
+// bus index of the pending requests by reference, NO_BUS if none
+#define NO_BUS 0xFF
+static uint8_t pending[1 << 16];
+static size_t pending_n = 0;
+static int notify_fd = -1;
 static unsigned int max_attempts = 32;
-static uint32_t baudrate;
-static char* serial_device_path = nullptr;
 static float initial_period = 10; // in us
 static float period_factor = 1.2;
-static com_message reception[COM_MAX_INCOMING_MESSAGES];
-static unsigned int reception_p = 0;
-static bool state_log_connected = true;
-static ApproxFloatingMean<float> success_rate(16, 1.0);
-static ApproxFloatingMean<float> ping(8, 0);
 
-static void receiver(uint8_t * data, uint16_t n, const PJON_Packet_Info &packet_info);
-static void record_ping(float t);
-static void record_success_rate(bool success);
+static void notify();
 
 Packet::Packet(com_id dest, size_t n, const void* data)
 {
@@ -105,134 +230,321 @@ Packet::Packet(com_id dest, size_t n, const void* data)
 		memcpy(this->content, data, n); 
 }
 
-bool com_init(com_id id, const char *dev, uint32_t bd)
+template<typename Strategy>
+Bus<Strategy>::Bus(unsigned int index, com_id id, const char *dev, uint32_t bd):
+	running(false), connected(false), success_rate(16, 1.0), ping(8, 0)
 {
-	log_info("com", "Initialization with id: 0x%02x", id);
-	bus.set_id(id);
-	bus.set_receiver(receiver);
-	baudrate = bd;
-	if (serial_device_path)
-		free(serial_device_path);
-	serial_device_path = (char*) malloc((strlen(dev)+1)*sizeof(char));
-	strcpy(serial_device_path, dev);
-	return true;
+	this->index = index;
+	this->id = id;
+	this->device = (char*) malloc((strlen(dev)+1)*sizeof(char));
+	strcpy(this->device, dev);
+	this->baudrate = bd;
+	this->last_connection_attempt = 0;
+	this->reconnect_period = COM_RECONNECT_PERIOD;
+	this->last_link_check = 0;
+	this->link_suspect = false;
+	this->state_log_connected = true;
+	this->opened = false;
+	this->watch_fd = -1;
+	this->appeared = false;
+	this->pjon.set_id(id);
+	this->pjon.set_custom_pointer(this);
+	this->pjon.set_receiver(Bus<Strategy>::receiver);
+
+	// no allocation in the steady state
+	this->incoming.reserve(COM_RESERVED_REQUESTS);
+	this->cancelled.reserve(COM_RESERVED_REQUESTS);
+	this->results.reserve(COM_RESERVED_REQUESTS);
+	this->reception.reserve(COM_MAX_INCOMING_MESSAGES);
+	this->packets.reserve(COM_RESERVED_REQUESTS);
+	this->finished.reserve(COM_RESERVED_REQUESTS);
+	this->received.reserve(COM_MAX_INCOMING_MESSAGES);
 }
 
-void com_set_max_attempts(unsigned int m)
+template<typename Strategy>
+Bus<Strategy>::~Bus()
 {
-	max_attempts = m;
+	this->stop();
+	this->unwatch();
+	StrategyLink<Strategy>::close(this->pjon.strategy);
+	free(this->device);
 }
 
-void com_set_time_period(float t0, float f)
+template<typename Strategy>
+bool Bus<Strategy>::connect()
 {
-	initial_period = t0;
-	period_factor = f;
+	// the bus thread handles reconnections once started
+	if (this->running)
+		return this->connected;
+
+	this->open();
+	this->running = true;
+	this->thread = std::thread(&Bus<Strategy>::run, this);
+	return this->connected;
 }
 
-bool com_connect()
+template<typename Strategy>
+bool Bus<Strategy>::is_connected()
 {
-	// open serial
-	bus.strategy.set_serial(serialOpen(serial_device_path, baudrate));
-	if (!com_is_connected()) {
-		if (state_log_connected)
-			log_error("com", "Failed to open serial device: %s", serial_device_path);
-		state_log_connected = false;
-		return false;
+	return this->connected;
+}
+
+template<typename Strategy>
+void Bus<Strategy>::stop()
+{
+	if (!this->running)
+		return;
+	this->running = false;
+	this->thread.join();
+}
+
+template<typename Strategy>
+void Bus<Strategy>::push(com_ref r, const Packet &p)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->incoming.push_back(std::pair<com_ref, Packet>(r, p));
+}
+
+template<typename Strategy>
+void Bus<Strategy>::cancel(com_ref r)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	// r may be reused by the next push, nothing of this one must come back
+	for (auto it = this->incoming.begin(); it != this->incoming.end(); it++) {
+		if (it->first == r) {
+			this->incoming.erase(it);
+			break;
+		}
 	}
-	state_log_connected = true;
-	log_info("com", "Serial device opened: %s", serial_device_path);
+	for (auto it = this->results.begin(); it != this->results.end(); it++) {
+		if (it->ref == r) {
+			this->results.erase(it);
+			break;
+		}
+	}
+	this->cancelled.push_back(r);
+}
 
-	// setting bus
-	log_info("com", "Setting up bus with baudrate = %ld", baudrate);
-	bus.strategy.set_baud_rate(baudrate);
-	bus.set_synchronous_acknowledge(true);
-	bus.set_asynchronous_acknowledge(false);
-	bus.begin();
+template<typename Strategy>
+size_t Bus<Strategy>::pop_results(com_request *results, size_t n_max)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	size_t n = min(n_max, this->results.size());
+	memcpy(results, this->results.data(), n*sizeof(com_request));
+	this->results.erase(this->results.begin(), this->results.begin()+n);
+	return n;
+}
 
-	return true;
+template<typename Strategy>
+size_t Bus<Strategy>::pop_reception(com_message *m, size_t n_max)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	size_t n = min(n_max, this->reception.size());
+	memcpy(m, this->reception.data(), n*sizeof(com_message));
+	this->reception.erase(this->reception.begin(), this->reception.begin()+n);
+	return n;
 }
 
-//TODO be sure of the implementation -> seems ok -> more tests?
-bool com_is_connected(void)
+template<typename Strategy>
+void Bus<Strategy>::run()
 {
-	fd_set nfds;
-	FD_ZERO(&nfds);
-	FD_SET(bus.strategy.serial, &nfds);
+	char name[16];
+	snprintf(name, sizeof(name), "bus %u", this->index);
+	prof_set_thread_name(name);
+
+	while (this->running) {
+
+		if (!this->connected) {
+			// right away when the device shows up, with a growing period otherwise
+			bool appeared = this->appeared;
+			this->appeared = false;
+			if ((appeared || PJON_MICROS() - this->last_connection_attempt
+						>= this->reconnect_period) && !this->open() && !appeared)
+				this->reconnect_period = min(this->reconnect_period * 2,
+						COM_RECONNECT_MAX_PERIOD);
+		} else if (this->link_suspect
+				|| PJON_MICROS() - this->last_link_check >= COM_LINK_CHECK_PERIOD) {
+			// after a failed attempt, the hang up is reported right away
+			this->link_suspect = false;
+			this->last_link_check = PJON_MICROS();
+			if (!StrategyLink<Strategy>::is_connected(this->pjon.strategy))
+				this->lose();
+		}
 
-	if (bus.strategy.serial < 0)
-		return false;
+		this->send();
+		this->receive();
+		this->publish();
+	}
+}
 
-	struct timeval tv = {0, 1};
-	select(bus.strategy.serial+1, &nfds, NULL, NULL, &tv);
-	if (FD_ISSET(bus.strategy.serial, &nfds)) {
-		size_t len = 0;
-		ioctl(bus.strategy.serial, FIONREAD, &len);
-		if(len == 0) // no data available -> disconnected
-			return false;
+template<typename Strategy>
+bool Bus<Strategy>::open()
+{
+	this->last_connection_attempt = PJON_MICROS();
+	if (!StrategyLink<Strategy>::open(this->pjon.strategy, this->device,
+				this->baudrate, this->id)) {
+		if (this->state_log_connected)
+			log_error("com", "Failed to open serial device: %s", this->device);
+		this->state_log_connected = false;
+		StrategyLink<Strategy>::close(this->pjon.strategy);
+		this->watch();
+		return false;
 	}
+	this->state_log_connected = true;
+	this->reconnect_period = COM_RECONNECT_PERIOD;
+	this->last_link_check = PJON_MICROS();
+	this->link_suspect = false;
+	this->unwatch();
+	log_info("com", "Serial device opened: %s (bus %d)", this->device,
+			this->index);
 
+	// setting bus
+	this->pjon.set_synchronous_acknowledge(true);
+	this->pjon.set_asynchronous_acknowledge(false);
+	this->pjon.begin();
+
+	if (this->opened)
+		metrics_add(METRICS_BUS_RECONNECTS, this->index);
+	this->opened = true;
+	metrics_set(METRICS_BUS_CONNECTED, this->index, 1);
+	this->connected = true;
+	notify();
 	return true;
 }
 
-bool com_push(com_ref r, com_id dest, size_t n, const void* data)
+// the device hung up or failed, it is closed to be opened again once back
+template<typename Strategy>
+void Bus<Strategy>::lose()
 {
-	packets.insert(std::pair<com_ref, Packet>(r, Packet(dest, n, data)));
-	if (packets.size() > COM_OUTGOING_QUEUE_WARNING_THRESHOLD) {
-		log_warn("com", "Outgoing packets queue is filling up %d/%d",
-				packets.size(), COM_OUTGOING_QUEUE_WARNING_THRESHOLD);
+	log_error("com", "Serial device lost: %s", this->device);
+	StrategyLink<Strategy>::close(this->pjon.strategy);
+	this->connected = false;
+	this->reconnect_period = COM_RECONNECT_PERIOD;
+	this->last_connection_attempt = PJON_MICROS();
+	this->watch();
+	metrics_set(METRICS_BUS_CONNECTED, this->index, 0);
+	notify();
+}
+
+// watch the creation and the changes of attributes (e.g. permissions set by
+// udev) of the files of the directory of the device, the reconnection only
+// relies on its period if the directory cannot be watched (e.g. a
+// /dev/serial/by-id link whose directory went away with the device)
+template<typename Strategy>
+void Bus<Strategy>::watch()
+{
+	if (this->watch_fd >= 0)
+		return;
+	const char *slash = strrchr(this->device, '/');
+	if (!slash)
+		return;
+
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%.*s", slash == this->device ? 1
+			: (int) (slash - this->device), this->device);
+	this->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (this->watch_fd < 0) {
+		log_perror("com", "Failed to create inotify instance");
+		return;
+	}
+	if (inotify_add_watch(this->watch_fd, dir,
+				IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+		log_info("com", "Cannot watch %s: %s", dir, strerror(errno));
+		this->unwatch();
 	}
-	return true;
 }
 
-void com_cancel(com_ref r)
+template<typename Strategy>
+void Bus<Strategy>::unwatch()
 {
-	auto it = packets.find(r);
-	if (it != packets.end())
-		packets.erase(r);
+	if (this->watch_fd < 0)
+		return;
+	close(this->watch_fd);
+	this->watch_fd = -1;
 }
 
-size_t com_send(com_request * results, size_t n_max)
+// wait for a reception window for the device to show up in its directory
+template<typename Strategy>
+void Bus<Strategy>::wait_device()
 {
-	size_t n = 0;
-	auto to_cancel = std::vector<com_ref>();
+	if (this->watch_fd < 0) {
+		PJON_DELAY_MICROSECONDS(COM_RECEIVE_TIME);
+		return;
+	}
 
-	for (auto &it : packets) {
+	struct pollfd pfd = {this->watch_fd, POLLIN, 0};
+	struct timespec timeout = {0, COM_RECEIVE_TIME * 1'000};
+	if (ppoll(&pfd, 1, &timeout, nullptr) <= 0)
+		return;
+
+	const char *name = strrchr(this->device, '/') + 1;
+	alignas(struct inotify_event) char buf[4096];
+	ssize_t len;
+	while ((len = read(this->watch_fd, buf, sizeof(buf))) > 0) {
+		for (char *e = buf; e < buf + len;) {
+			auto *event = (struct inotify_event*) e;
+			if (event->len && strcmp(event->name, name) == 0)
+				this->appeared = true;
+			e += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
 
-		auto r = it.first;
-		auto &p = it.second;
+template<typename Strategy>
+void Bus<Strategy>::send()
+{
+	// take the new and cancelled requests from the server thread
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->drop_cancelled();
+		this->packets.insert(this->packets.end(), this->incoming.begin(),
+				this->incoming.end());
+		this->incoming.clear();
+	}
+	metrics_set(METRICS_BUS_OUTGOING, this->index, this->packets.size());
+
+	// the unfinished packets are moved to the front, the storage is kept
+	size_t kept = 0;
+	for (size_t i = 0; i < this->packets.size(); i++) {
 
-		// break in case of full results array
-		if (n >= n_max)
-			return n;
+		auto r = this->packets[i].first;
+		auto &p = this->packets[i].second;
 
 		// send only if dt >= period
-		if (PJON_MICROS() - p.timing < p.period)
+		if (PJON_MICROS() - p.timing < p.period) {
+			this->keep(i, kept++);
 			continue;
+		}
 
 		// CONTENT_TOO_LONG
 		if (p.state == PJON_CONTENT_TOO_LONG) {
 			log_warn("com", "COM_CONTENT_TOO_LONG for request ref=%d", r);
-			results[n] = (com_request){r, COM_CONTENT_TOO_LONG};
-			n++;
-			to_cancel.push_back(r);
-			record_success_rate(false);
+			metrics_add(METRICS_PJON_TOO_LONG, p.dest);
+			this->finished.push_back((com_request){r, COM_CONTENT_TOO_LONG});
+			this->record_success_rate(false);
 			continue;
 		}
 
-		p.state = bus.send_packet(p.dest, (char*) p.content, p.length);
+		uint32_t attempt = PJON_MICROS();
+		{
+			PROF_SCOPE(PROF_SEND_PACKET, p.dest);
+			p.state = this->pjon.send_packet(p.dest, (char*) p.content, p.length);
+		}
+		this->link_suspect = p.state != PJON_ACK;
 		p.attempts++;
 		p.timing = PJON_MICROS();
 		p.period *= period_factor;
 
 		// SUCCESS 
 		if (p.state == PJON_ACK) {
-			log_info("com", "COM_SUCCESS for request ref=%d after t=%'ldus", r,
+			log_info("com", "COM_SUCCESS for request ref=%d after t=%'uus", r,
 					p.timing-p.registration);
-			results[n] = (com_request){r, COM_SUCCESS};
-			n++;
-			record_success_rate(true);
-			record_ping(p.timing-p.registration);
-			to_cancel.push_back(r);
+			metrics_add(METRICS_PJON_SUCCESS, p.dest);
+			metrics_observe(METRICS_PJON_RTT, p.dest, p.timing - attempt);
+			metrics_observe(METRICS_PJON_ATTEMPTS, p.dest, p.attempts);
+			this->finished.push_back((com_request){r, COM_SUCCESS});
+			this->record_success_rate(true);
+			this->record_ping(p.timing-p.registration);
 			continue;
 		}
 
@@ -240,57 +552,364 @@ size_t com_send(com_request * results, size_t n_max)
 		if (p.attempts > max_attempts) {
 			log_warn("com", "COM_CONNECTION_LOST for request %d (dest: 0x%02x)", r,
 					p.dest);
-			results[n] = (com_request){r, COM_CONNECTION_LOST};
-			n++;
-			to_cancel.push_back(r);
-			record_success_rate(false);
+			metrics_add(METRICS_PJON_LOST, p.dest);
+			this->finished.push_back((com_request){r, COM_CONNECTION_LOST});
+			this->record_success_rate(false);
 			continue;
 		}
 
+		this->keep(i, kept++);
 	}
+	this->packets.erase(this->packets.begin() + kept, this->packets.end());
+}
 
-	for (auto &r : to_cancel)
-		com_cancel(r);
+template<typename Strategy>
+void Bus<Strategy>::keep(size_t i, size_t kept)
+{
+	if (i != kept)
+		this->packets[kept] = this->packets[i];
+}
 
+template<typename Strategy>
+void Bus<Strategy>::receive()
+{
+	if (!this->connected) {
+		this->wait_device();
+		return;
+	}
+	this->pjon.receive(COM_RECEIVE_TIME);
+}
+
+// give the finished requests and the received messages to the server thread
+template<typename Strategy>
+void Bus<Strategy>::publish()
+{
+	if (this->finished.empty() && this->received.empty())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		// cancelled while being sent
+		this->drop_cancelled();
+		this->results.insert(this->results.end(), this->finished.begin(),
+				this->finished.end());
+		size_t room = COM_MAX_INCOMING_MESSAGES - this->reception.size();
+		if (this->received.size() > room) {
+			log_warn("com", "Reception queue of bus %d is full, %zu messages lost",
+					this->index, this->received.size() - room);
+			metrics_add(METRICS_BUS_DROPPED, this->index,
+					this->received.size() - room);
+			this->received.resize(room);
+		}
+		this->reception.insert(this->reception.end(), this->received.begin(),
+				this->received.end());
+		metrics_set(METRICS_BUS_RECEPTION, this->index, this->reception.size());
+	}
+	this->finished.clear();
+	this->received.clear();
+	notify();
+}
+
+// forget the cancelled requests, still to be sent or finished but not
+// published, with mutex held
+template<typename Strategy>
+void Bus<Strategy>::drop_cancelled()
+{
+	for (auto &r : this->cancelled) {
+		for (auto it = this->packets.begin(); it != this->packets.end(); it++) {
+			if (it->first == r) {
+				this->packets.erase(it);
+				break;
+			}
+		}
+		for (auto it = this->finished.begin(); it != this->finished.end(); it++) {
+			if (it->ref == r) {
+				this->finished.erase(it);
+				break;
+			}
+		}
+	}
+	this->cancelled.clear();
+}
+
+template<typename Strategy>
+void Bus<Strategy>::receiver(uint8_t * data, uint16_t n,
+		const PJON_Packet_Info &packet_info)
+{
+	auto *bus = (Bus<Strategy>*) packet_info.custom_pointer;
+	log_info("com", "Reception: (%d) %.*s / bus %d", n, n, data, bus->index);
+	com_message m;
+	m.src = packet_info.sender_id;
+	m.bus = bus->index;
+	m.n = min(n, sizeof(m.data));
+	memcpy(&m.data, data, m.n);
+	bus->received.push_back(m);
+}
+
+template<typename Strategy>
+void Bus<Strategy>::record_ping(float t)
+{
+	if (this->ping.push(t) >= COM_PING_WARNING_THRESHOLD) {
+		log_warn("com", "Ping is high on bus %d: %.3fms (warning threshold: "
+				"%.3fms)", this->index, this->ping.get()/1000.f,
+				COM_PING_WARNING_THRESHOLD/1000.f);
+	}
+}
+
+template<typename Strategy>
+void Bus<Strategy>::record_success_rate(bool success)
+{
+	if (this->success_rate.push(success) <= COM_SUCCESS_RATE_WARNING_THRESHOLD) {
+		log_warn("com", "Success rate is low on bus %d: %.2f%% (warning "
+				"threshold: %.2f%%)", this->index, this->success_rate.get()*100.f,
+				COM_SUCCESS_RATE_WARNING_THRESHOLD*100.f);
+	}
+}
+
+bool com_init(com_id id)
+{
+	log_info("com", "Initialization with id: 0x%02x", id);
+	pjon_id = id;
+	for (unsigned int i = 0; i < 256; i++) {
+		routes[i] = COM_DEFAULT_BUS;
+		routes_static[i] = false;
+	}
+	memset(pending, NO_BUS, sizeof(pending));
+	pending_n = 0;
+	if (notify_fd < 0)
+		notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notify_fd < 0) {
+		log_perror("com", "Failed to create notification eventfd");
+		return false;
+	}
+	return true;
+}
+
+int com_add_bus(const char *dev, uint32_t bd)
+{
+	unsigned int index = buses.size();
+	if (index >= NO_BUS) {
+		log_error("com", "Too many buses, %s is not added", dev);
+		return -1;
+	}
+	log_info("com", "New bus %d on %s", index, dev);
+	buses.push_back(std::unique_ptr<Bus<COM_STRATEGY>>(
+			new Bus<COM_STRATEGY>(index, pjon_id, dev, bd)));
+	return index;
+}
+
+bool com_add_route(com_id id, unsigned int b)
+{
+	if (b >= buses.size()) {
+		log_error("com", "Cannot route 0x%02x to unknown bus %d", id, b);
+		return false;
+	}
+	routes[id] = b;
+	routes_static[id] = true;
+	return true;
+}
+
+void com_set_max_attempts(unsigned int m)
+{
+	max_attempts = m;
+}
+
+void com_set_time_period(float t0, float f)
+{
+	initial_period = t0;
+	period_factor = f;
+}
+
+bool com_connect()
+{
+	bool connected = true;
+	for (auto &bus : buses)
+		connected = bus->connect() && connected;
+	return connected;
+}
+
+bool com_is_connected(void)
+{
+	for (auto &bus : buses) {
+		if (!bus->is_connected())
+			return false;
+	}
+	return true;
+}
+
+int com_get_fd()
+{
+	return notify_fd;
+}
+
+unsigned int com_get_n_buses()
+{
+	return buses.size();
+}
+
+bool com_push(com_ref r, com_id dest, size_t n, const void* data)
+{
+	if (pending[(uint16_t) r] != NO_BUS) {
+		log_warn("com", "Request ref=%d is already pending", r);
+		return false;
+	}
+	unsigned int b = routes[dest] < (int) buses.size() ? routes[dest] : 0;
+	buses[b]->push(r, Packet(dest, n, data));
+	pending[(uint16_t) r] = b;
+	pending_n++;
+	metrics_set(METRICS_COM_PENDING, 0, pending_n);
+	capture_pjon(CAPTURE_PJON_SEND, r, dest, b, COM_PENDING, data, n);
+	if (pending_n > COM_OUTGOING_QUEUE_WARNING_THRESHOLD) {
+		log_warn("com", "Outgoing packets queue is filling up %zu/%d",
+				pending_n, COM_OUTGOING_QUEUE_WARNING_THRESHOLD);
+	}
+	return true;
+}
+
+bool com_is_pending(com_ref r)
+{
+	return pending[(uint16_t) r] != NO_BUS;
+}
+
+void com_cancel(com_ref r)
+{
+	uint8_t b = pending[(uint16_t) r];
+	if (b == NO_BUS)
+		return;
+	buses[b]->cancel(r);
+	pending[(uint16_t) r] = NO_BUS;
+	pending_n--;
+	metrics_set(METRICS_COM_PENDING, 0, pending_n);
+}
+
+size_t com_send(com_request * results, size_t n_max)
+{
+	size_t n = 0;
+	for (auto &bus : buses)
+		n += bus->pop_results(&results[n], n_max - n);
+	for (size_t i = 0; i < n; i++) {
+		uint8_t &b = pending[(uint16_t) results[i].ref];
+		if (b != NO_BUS) {
+			capture_pjon(CAPTURE_PJON_RESULT, results[i].ref, 0, b,
+					results[i].state, nullptr, 0);
+			b = NO_BUS;
+			pending_n--;
+		}
+	}
+	metrics_set(METRICS_COM_PENDING, 0, pending_n);
 	return n;
 }
 
 size_t com_receive(com_message *m, size_t n_max)
 {
-	bus.receive(10000);
-	size_t n = min(n_max, reception_p);
-	reception_p = 0;
-	memcpy(m, reception, n*sizeof(com_message));
+	uint64_t count;
+	if (notify_fd >= 0)
+		read(notify_fd, &count, sizeof(count));
+
+	size_t n = 0;
+	for (auto &bus : buses)
+		n += bus->pop_reception(&m[n], n_max - n);
+
+	// learn the routes from the traffic
+	for (size_t i = 0; i < n; i++) {
+		if (!routes_static[m[i].src])
+			routes[m[i].src] = m[i].bus;
+		capture_pjon(CAPTURE_PJON_RECEIVE, 0, m[i].src, m[i].bus, COM_PENDING,
+				m[i].data, m[i].n);
+		metrics_add(METRICS_PJON_RECEIVED, m[i].src);
+	}
 	return n;
 }
 
 void com_quit()
 {
+	for (auto &bus : buses)
+		bus->stop();
+	buses.clear();
+	memset(pending, NO_BUS, sizeof(pending));
+	pending_n = 0;
 }
 
-void receiver(uint8_t * data, uint16_t n, const PJON_Packet_Info &packet_info)
+void notify()
 {
-	log_info("com", "Reception: (%d) %.*s / %d\n", n, n, data, reception_p);
-	reception[reception_p].src = packet_info.sender_id;
-	reception[reception_p].n = n;
-	memcpy(&reception[reception_p].data, data,
-			sizeof(reception[reception_p].data));
-	reception_p++;
+	uint64_t one = 1;
+	if (notify_fd >= 0)
+		write(notify_fd, &one, sizeof(one));
 }
 
-void record_ping(float t)
+bool StrategyLink<ThroughSerialAsync>::open(ThroughSerialAsync &s,
+		const char *dev, uint32_t bd, com_id id)
 {
-	if (ping.push(t) >= COM_PING_WARNING_THRESHOLD) {
-		log_warn("com", "Ping is high: %.3fms (warning threshold: %.3fms)",
-				ping.get()/1000.f, COM_PING_WARNING_THRESHOLD/1000.f);
-	}
+	(void) id;
+	s.set_serial(serialOpen(dev, bd));
+	if (!is_connected(s))
+		return false;
+	log_info("com", "Setting up bus with baudrate = %u", bd);
+	s.set_baud_rate(bd);
+	return true;
 }
 
-void record_success_rate(bool success)
+// a device unplugged (or the other end of a pseudo-terminal closed) hangs up,
+// its reads and writes fail from then on
+bool StrategyLink<ThroughSerialAsync>::is_connected(ThroughSerialAsync &s)
 {
-	if (success_rate.push(success) <= COM_SUCCESS_RATE_WARNING_THRESHOLD) {
-		log_warn("com", "Success rate is low: %.2f\% (warning threshold: %.2f\%)",
-				success_rate.get()*100.f, COM_SUCCESS_RATE_WARNING_THRESHOLD*100.f);
-	}
+	if (s.serial < 0)
+		return false;
+
+	struct pollfd pfd = {s.serial, 0, 0};
+	if (poll(&pfd, 1, 0) < 0)
+		return errno == EINTR;
+	return !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL));
+}
+
+void StrategyLink<ThroughSerialAsync>::close(ThroughSerialAsync &s)
+{
+	if (s.serial < 0)
+		return;
+	::close(s.serial);
+	s.set_serial(-1);
 }
 
+bool StrategyLink<SerialStrategy>::open(SerialStrategy &s,
+		const char *dev, uint32_t bd, com_id id)
+{
+	(void) id;
+	if (!s.open(dev, bd))
+		return false;
+	log_info("com", "Setting up bus with baudrate = %u", bd);
+	return true;
+}
+
+bool StrategyLink<SerialStrategy>::is_connected(SerialStrategy &s)
+{
+	return s.is_connected();
+}
+
+void StrategyLink<SerialStrategy>::close(SerialStrategy &s)
+{
+	s.close();
+}
+
+// the device and the baudrate are not used, every loopback bus gets the nodes
+// of LOOPBACK_NODES
+bool StrategyLink<LoopbackStrategy>::open(LoopbackStrategy &s,
+		const char *dev, uint32_t bd, com_id id)
+{
+	(void) dev;
+	(void) bd;
+	s.simulation = Simulation(id);
+	for (auto &node : loopback_nodes)
+		s.simulation.add_node(node);
+	return true;
+}
+
+bool StrategyLink<LoopbackStrategy>::is_connected(LoopbackStrategy &s)
+{
+	(void) s;
+	return true;
+}
+
+void StrategyLink<LoopbackStrategy>::close(LoopbackStrategy &s)
+{
+	(void) s;
+}
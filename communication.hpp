@@ -32,6 +32,11 @@
 #	define COM_MAX_INCOMING_MESSAGES 1024
 #endif
 
+// Requests a bus holds without allocating, its queues grow beyond
+#ifndef COM_RESERVED_REQUESTS
+#	define COM_RESERVED_REQUESTS 1024
+#endif
+
 #ifndef COM_OUTGOING_QUEUE_WARNING_THRESHOLD
 #	define COM_OUTGOING_QUEUE_WARNING_THRESHOLD 32
 #endif
@@ -44,6 +49,32 @@
 #	define COM_SUCCESS_RATE_WARNING_THRESHOLD 0.95
 #endif
 
+// Period between two attempts to open a lost device, doubled after each
+// failure up to COM_RECONNECT_MAX_PERIOD. A device showing up again in its
+// directory (inotify) is opened right away.
+#ifndef COM_RECONNECT_PERIOD
+#	define COM_RECONNECT_PERIOD 500'000 // in us
+#endif
+#ifndef COM_RECONNECT_MAX_PERIOD
+#	define COM_RECONNECT_MAX_PERIOD 30'000'000 // in us
+#endif
+
+// Period of the check of a hang up of a connected device, also checked after
+// each failed attempt
+#ifndef COM_LINK_CHECK_PERIOD
+#	define COM_LINK_CHECK_PERIOD 100'000 // in us
+#endif
+
+// Duration of a reception window of a bus thread
+#ifndef COM_RECEIVE_TIME
+#	define COM_RECEIVE_TIME 1'000 // in us
+#endif
+
+// Bus used for the ids without route
+#ifndef COM_DEFAULT_BUS
+#	define COM_DEFAULT_BUS 0
+#endif
+
 typedef uint8_t com_id;
 typedef int16_t com_ref;
 
@@ -62,18 +93,29 @@ typedef struct {
 
 typedef struct {
 	com_id src;
+	uint8_t bus;
 	size_t n;
 	char data[PJON_PACKET_MAX_LENGTH];
 } com_message;
 
 
-// Initiate communication with the given id. The device dev is used
-// with a baudrate bd for serial communication.
+// Initiate communication with the given id, buses are then added with
+// com_add_bus
 // id: PJON id
+// Return true in case of success, false otherwise
+bool com_init(com_id id);
+
+// Add a bus on the serial device dev used with a baudrate bd. Each bus has its
+// own outgoing queue and is served by its own thread once connected.
 // dev: serial device path (should be in /dev/)
 // bd: serial baudrate
-// Return true in case of success, false otherwise
-bool com_init(com_id id, const char *dev, uint32_t bd);
+// Return the index of the bus
+int com_add_bus(const char *dev, uint32_t bd);
+
+// Route the packets for the PJON id to the bus b. The ids without static route
+// are routed to the bus they were last heard from, COM_DEFAULT_BUS otherwise.
+// Return false if the bus b does not exist, true otherwise
+bool com_add_route(com_id id, unsigned int b);
 
 // Set maximum of attempts m for a outgoing packet before COM_CONNECTION_LOST
 // is returned.
@@ -84,26 +126,38 @@ void com_set_max_attempts(unsigned int m);
 // is multiplied by f until the maximum attempts number is reached or success.
 void com_set_time_period(float t0, float f);
 
-// Connect to serial device given at initialization.
-// Return true in case of successfull connection, false otherwise
+// Connect to the serial devices of the buses and start their threads, a bus
+// thread then handles its reconnections by itself.
+// Return true if every bus is connected, false otherwise
 bool com_connect();
 
-// Return true in case of successfull connection, false otherwise
+// Return true if every bus is connected, false otherwise
 bool com_is_connected();
 
-// Add with the reference r, the data of n bytes to the outgoing stack to be
-// send to dest at the next com_send call
+// Return a file descriptor readable when results or messages are waiting for
+// com_send or com_receive, or when a bus got connected or disconnected
+int com_get_fd();
+
+// Return the number of buses
+unsigned int com_get_n_buses();
+
+// Add with the reference r, the data of n bytes to the outgoing queue of the
+// bus routed to dest
 // r: reference of the request, is returned by com_send
 // dest: PJON id of the destination
 // n: size in bytes of the data
 // data: raw data to be sent
-// return true in case of success, false otherwise (e.g. stack is full)
+// return true in case of success, false otherwise (e.g. r is already pending)
 bool com_push(com_ref r, com_id dest, size_t n, const void* data);
 
-// Cancel the request given by the reference r
+// return true if the request of reference r is pending, false otherwise
+bool com_is_pending(com_ref r);
+
+// Cancel the request given by the reference r, its result is not returned by
+// com_send and r can be pushed again right away
 void com_cancel(com_ref r);
 
-// Try to sends the packet in the outgoing stack. Fill results with the state
+// Collect the requests finished by the bus threads. Fill results with the state
 // of finished requests with their reference. The states may be COM_SUCCESS,
 // COM_FAILED_OPEN_SERIAL, COM_CONTENT_TOO_LONG or COM_CONNECTION_LOST.
 // results: a n_max long array to be filled with the finished results
@@ -112,11 +166,14 @@ void com_cancel(com_ref r);
 // read in results)
 size_t com_send(com_request *results, size_t n_max);
 
-// Try to receive messages. Fill reception with the received messages.
+// Collect the messages received by the bus threads. Fill reception with the
+// received messages.
 // reception: a n_max long array to be filled with the received messages
-// n_max: the maximum number of received messages, if full some received 
-// messages may be lost so take a large number
+// n_max: the maximum number of received messages, no message is lost if full
+// but a bus drops its messages beyond COM_MAX_INCOMING_MESSAGES
 // return the number of received messages (a.k.a. the number of element to
 // read in reception)
 size_t com_receive(com_message *reception, size_t n_max);
 
+// Stop the bus threads and remove the buses
+void com_quit();
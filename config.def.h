@@ -17,10 +17,81 @@
 #define MAX_CONNECTION 1
 #define UPDATE_PERIOD 2000
 
+/* I/O of the client sockets through io_uring (Linux 5.19 or later), select is
+   used when it is unavailable or when this is commented out */
+#define SOCKET_IO_URING
+
+/* Local socket (abstract namespace) also taking the clients with
+   SOCK_SEQPACKET, each packet being one message */
+#define SOCKET_SEQPACKET "/tmp/PJON.seq"
+
+/* TCP listener for the clients which cannot reach the local sockets (e.g. in
+   containers), as an address and a port */
+//#define SOCKET_TCP "127.0.0.1"
+#define SOCKET_TCP_PORT 7470
+
+/* Threads serving the clients, each one owning a shard of the connections,
+   around the thread owning the buses */
+#define SERVER_WORKERS 2
+
+/* Slots of the pool of the packets queued by the daemon, allocated at
+   startup (64 bytes each and 8 of bookkeeping) */
+#define POOL_SIZE 65536
+
+/* Packets queued for a client beyond which it is disconnected as not reading,
+   well below POOL_SIZE */
+#define SOCKET_MAX_QUEUED 4096
+
 #define SERIAL_DEVICE "/dev/escaperoom"
 #define BAUDRATE 115200
 #define ID_COMPUTER 0x42
 #define ID_UNO	0x22
 #define ID_NANO 0x33
 
+/* Serial buses as {device, baudrate}, the first one is the default bus */
+#define SERIAL_BUSES { {SERIAL_DEVICE, BAUDRATE} }
+/* Static routes as {PJON id, bus index}, other ids are learned from traffic */
+#define BUS_ROUTES { {ID_UNO, 0}, {ID_NANO, 0} }
+
+/* PJON strategy of the buses: ThroughSerialAsync (PJON's one),
+   SerialStrategy (serial device handled by the daemon) or LoopbackStrategy
+   (all are overridden by the build of pjon-microbench) */
+#ifndef COM_STRATEGY
+#define COM_STRATEGY ThroughSerialAsync
+#endif
+/* Simulated nodes of LoopbackStrategy as {id, ack latency (us), reply latency
+   (us), drop rate, SIM_REPLY_NONE or SIM_REPLY_ECHO, period of unsolicited
+   messages (us, 0 for none)} */
+#ifndef LOOPBACK_NODES
+#define LOOPBACK_NODES { \
+	{ID_UNO, 500, 2'000, 0.01, SIM_REPLY_ECHO, 0}, \
+	{ID_NANO, 500, 0, 0.01, SIM_REPLY_NONE, 1'000'000} \
+}
+#endif
+
+/* Log level (0: everything, 1: warnings and errors, 2: only errors) and
+   levels of single modules as {module, level}, the modules being com, socket,
+   server, logger, fwd, capture, metrics, stats, profiler and pool */
+#define LOG_LEVEL 1
+#define LOG_MODULE_LEVELS { {"com", 1} }
+
+/* Binary trace of the logs, rendered by PJON-tracedump: path prefix of the
+   files, size of each file (bytes) and number of rotated files */
+//#define LOG_TRACE_FILE "/tmp/PJON.trace"
+#define LOG_TRACE_SIZE (16 << 20)
+#define LOG_TRACE_FILES 4
+
+/* Local socket (abstract namespace) serving the metrics as Prometheus text,
+   e.g. socat - ABSTRACT-CONNECT:/tmp/PJON.metrics */
+#define METRICS_SOCKET "/tmp/PJON.metrics"
+
+/* Shared memory page of the statistics, read by PJON-stats */
+#define STATS_SHM "/PJON-stats"
+
+/* Capture of the traffic to be replayed by PJON-replay */
+//#define CAPTURE_FILE "/tmp/PJON.cap"
+
+/* Path prefix of the profiles dumped on SIGUSR1 or PROTO_HEAD_PROFILE_DUMP */
+#define PROF_DUMP_PATH "/tmp/PJON-profile"
+
 #define COM_MAX_INCOMING_MESSAGES 1024
@@ -3,8 +3,17 @@ PREFIX = /usr/local
 CC = gcc
 
 INCS = -IPJON/src
-LIBS = -lstdc++ -lgfortran -lcrypt -lm -lrt
+LIBS = -lstdc++ -lgfortran -lcrypt -lm -lrt -pthread
 
-CFLAGS = -g -Wall -Wextra -DLINUX $(INCS) -std=gnu++17
+# logs under this level are compiled out (0: everything, 1: warnings and
+# errors, 2: only errors)
+LOG_MIN_LEVEL = 0
+
+# debug build aborting when an iteration of the server loop allocates after
+# the warm-up (0: disabled, 1: enabled)
+ALLOC_CHECK = 0
+
+CFLAGS = -g -Wall -Wextra -DLINUX -DLOG_MIN_LEVEL=$(LOG_MIN_LEVEL) \
+	-DALLOC_CHECK=$(ALLOC_CHECK) $(INCS) -std=gnu++17 -pthread
 LDFLAGS = $(LIBS)
 
@@ -0,0 +1,181 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "forward.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+#include <string.h>
+
+// Forwarded packets use negative references, below SOCKET_ALL (-1), so their
+// results are never mistaken for a client's
+#define FWD_REF_FIRST (-2)
+#define FWD_REF_LAST (FWD_REF_FIRST - FWD_MAX_PENDING + 1)
+
+typedef struct {
+  com_id src;
+  com_id dest;
+  uint8_t prefix_n;
+  uint8_t tmpl_n;
+  char prefix[FWD_PREFIX_MAX_LENGTH];
+  char tmpl[FWD_TEMPLATE_MAX_LENGTH];
+} fwd_rule;
+
+static fwd_rule rules[FWD_MAX_RULES];
+static size_t rules_n = 0;
+static com_ref next_ref = FWD_REF_FIRST;
+
+static bool match(const fwd_rule *rule, const com_message *m);
+static ssize_t expand(const fwd_rule *rule, const com_message *m, char *out,
+    size_t size);
+
+bool fwd_add(com_id src, const void *prefix, size_t prefix_n, com_id dest,
+    const void *tmpl, size_t tmpl_n)
+{
+  if (prefix_n > FWD_PREFIX_MAX_LENGTH || tmpl_n > FWD_TEMPLATE_MAX_LENGTH) {
+    log_warn("fwd", "Rule too long (prefix: %zu, template: %zu)", prefix_n,
+        tmpl_n);
+    return false;
+  }
+  if (rules_n >= FWD_MAX_RULES) {
+    log_warn("fwd", "Rule table is full (%d rules)", FWD_MAX_RULES);
+    return false;
+  }
+
+  fwd_rule &rule = rules[rules_n];
+  rule.src = src;
+  rule.dest = dest;
+  rule.prefix_n = prefix_n;
+  rule.tmpl_n = tmpl_n;
+  memcpy(rule.prefix, prefix, prefix_n);
+  memcpy(rule.tmpl, tmpl, tmpl_n);
+  rules_n++;
+
+  log_info("fwd", "New rule 0x%02x '%.*s' -> 0x%02x", src, (int) prefix_n,
+      (const char*) prefix,
+      dest);
+  return true;
+}
+
+size_t fwd_remove(com_id src, const void *prefix, size_t prefix_n)
+{
+  size_t removed = 0;
+  for (size_t i = 0; i < rules_n;) {
+    fwd_rule &rule = rules[i];
+    if (rule.src == src && rule.prefix_n == prefix_n
+        && memcmp(rule.prefix, prefix, prefix_n) == 0) {
+      memmove(&rules[i], &rules[i+1], (rules_n-i-1)*sizeof(fwd_rule));
+      rules_n--;
+      removed++;
+      continue;
+    }
+    i++;
+  }
+  log_info("fwd", "Removed %zu rules", removed);
+  return removed;
+}
+
+void fwd_clear()
+{
+  rules_n = 0;
+  log_info("fwd", "Rules cleared");
+}
+
+size_t fwd_apply(const com_message *m)
+{
+  char payload[COM_PACKET_MAX_LENGTH];
+  size_t n = 0;
+
+  for (size_t i = 0; i < rules_n; i++) {
+    const fwd_rule *rule = &rules[i];
+    if (!match(rule, m))
+      continue;
+
+    ssize_t length = expand(rule, m, payload, sizeof(payload));
+    if (length < 0) {
+      log_warn("fwd", "Forwarded payload from 0x%02x to 0x%02x is too long",
+          m->src, rule->dest);
+      continue;
+    }
+
+    com_ref r = next_ref;
+    next_ref = (next_ref == FWD_REF_LAST) ? FWD_REF_FIRST : next_ref - 1;
+    if (!com_push(r, rule->dest, length, payload)) {
+      log_warn("fwd", "Too many pending forwarded packets, dropping packet "
+          "from 0x%02x to 0x%02x", m->src, rule->dest);
+      metrics_add(METRICS_FWD_DROPPED, 0);
+      continue;
+    }
+    n++;
+  }
+
+  return n;
+}
+
+bool fwd_is_ref(com_ref r)
+{
+  return r <= FWD_REF_FIRST && r >= FWD_REF_LAST;
+}
+
+void fwd_result(com_ref r, enum com_state state)
+{
+  if (state != COM_SUCCESS)
+    log_warn("fwd", "Forwarded packet ref=%d failed with state %d", r, state);
+}
+
+bool match(const fwd_rule *rule, const com_message *m)
+{
+  if (rule->src != FWD_ANY_SRC && rule->src != m->src)
+    return false;
+  if (rule->prefix_n > m->n)
+    return false;
+  return memcmp(rule->prefix, m->data, rule->prefix_n) == 0;
+}
+
+ssize_t expand(const fwd_rule *rule, const com_message *m, char *out,
+    size_t size)
+{
+  size_t n = 0;
+
+  for (size_t i = 0; i < rule->tmpl_n; i++) {
+    const char *chunk = &rule->tmpl[i];
+    size_t chunk_n = 1;
+
+    if (rule->tmpl[i] == '%' && i+1 < rule->tmpl_n) {
+      i++;
+      switch (rule->tmpl[i]) {
+        case 'p':
+          chunk = m->data;
+          chunk_n = m->n;
+          break;
+        case 'r':
+          chunk = m->data + rule->prefix_n;
+          chunk_n = m->n - rule->prefix_n;
+          break;
+        case 's':
+          chunk = (const char*) &m->src;
+          break;
+        default: // %% and unknown directives are copied without the %
+          chunk = &rule->tmpl[i];
+      }
+    }
+
+    if (n + chunk_n > size)
+      return -1;
+    memcpy(&out[n], chunk, chunk_n);
+    n += chunk_n;
+  }
+
+  return n;
+}
@@ -0,0 +1,67 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "communication.hpp"
+
+#ifndef FWD_MAX_RULES
+#define FWD_MAX_RULES 64
+#endif
+
+#ifndef FWD_PREFIX_MAX_LENGTH
+#define FWD_PREFIX_MAX_LENGTH 16
+#endif
+
+#ifndef FWD_TEMPLATE_MAX_LENGTH
+#define FWD_TEMPLATE_MAX_LENGTH 42
+#endif
+
+// Number of forwarded packets that can be pending at the same time
+#ifndef FWD_MAX_PENDING
+#define FWD_MAX_PENDING 64
+#endif
+
+// Source id matching any sender (0 is the PJON broadcast id, never a sender)
+#define FWD_ANY_SRC 0
+
+// Add a forwarding rule: every message received from src (or from anyone if
+// src is FWD_ANY_SRC) starting with the prefix of prefix_n bytes is sent to
+// dest with a payload built from the template tmpl of tmpl_n bytes.
+// The template is copied as is except for the following directives:
+//   %p: the whole received payload
+//   %r: the received payload without the matched prefix
+//   %s: the sender id (one byte)
+//   %%: a literal %
+// Return false if the rule is invalid or the table is full, true otherwise
+bool fwd_add(com_id src, const void *prefix, size_t prefix_n, com_id dest,
+    const void *tmpl, size_t tmpl_n);
+
+// Remove the rules with the source src and the exact prefix of prefix_n bytes
+// Return the number of removed rules
+size_t fwd_remove(com_id src, const void *prefix, size_t prefix_n);
+
+// Remove every rule
+void fwd_clear();
+
+// Apply the rules to the received message m, the forwarded packets are pushed
+// with com_push to be sent at the next com_send call
+// Return the number of forwarded packets
+size_t fwd_apply(const com_message *m);
+
+// Return true if the reference r was given to a forwarded packet
+bool fwd_is_ref(com_ref r);
+
+// Handle the result of the forwarded packet with the reference r
+void fwd_result(com_ref r, enum com_state state);
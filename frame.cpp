@@ -0,0 +1,197 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "frame.hpp"
+
+#include <string.h>
+
+static size_t overhead(uint8_t header);
+
+uint8_t frame_crc8(const uint8_t *data, size_t n)
+{
+  uint8_t crc = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint8_t b = data[i];
+    for (uint8_t bit = 8; bit; bit--, b >>= 1) {
+      bool odd = (crc ^ b) & 0x01;
+      crc >>= 1;
+      if (odd)
+        crc ^= 0x97;
+    }
+  }
+  return crc;
+}
+
+uint32_t frame_crc32(const uint8_t *data, size_t n)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < n; i++) {
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      if ((crc ^ (data[i] >> bit)) & 1)
+        crc = (crc >> 1) ^ 0xEDB88320;
+      else
+        crc >>= 1;
+    }
+  }
+  return ~crc;
+}
+
+size_t frame_encode(const frame_packet *p, uint8_t *buf, size_t size)
+{
+  uint8_t header = p->header & ~(FRAME_MODE_BIT | FRAME_EXT_LEN_BIT);
+  if (p->length + overhead(header) > 15)
+    header |= FRAME_CRC_BIT;
+  size_t n = p->length + overhead(header);
+  if (n > FRAME_MAX_LENGTH || n > size)
+    return 0;
+
+  size_t i = 0;
+  buf[i++] = p->receiver;
+  buf[i++] = header;
+  buf[i++] = n;
+  buf[i] = frame_crc8(buf, i);
+  i++;
+  if (header & FRAME_TX_INFO_BIT)
+    buf[i++] = p->sender;
+  if (header & FRAME_PACKET_ID_BIT) {
+    buf[i++] = p->id >> 8;
+    buf[i++] = p->id & 0xFF;
+  }
+  if (header & FRAME_PORT_BIT) {
+    buf[i++] = p->port >> 8;
+    buf[i++] = p->port & 0xFF;
+  }
+  memcpy(&buf[i], p->payload, p->length);
+  i += p->length;
+
+  if (header & FRAME_CRC_BIT) {
+    uint32_t crc = frame_crc32(buf, i);
+    buf[i++] = crc >> 24;
+    buf[i++] = crc >> 16;
+    buf[i++] = crc >> 8;
+    buf[i++] = crc;
+  } else {
+    buf[i] = frame_crc8(buf, i);
+    i++;
+  }
+  return i;
+}
+
+bool frame_decode(const uint8_t *buf, size_t n, frame_packet *p)
+{
+  if (n < 5 || buf[3] != frame_crc8(buf, 3))
+    return false;
+
+  uint8_t header = buf[1];
+  size_t length = buf[2];
+  if ((header & (FRAME_MODE_BIT | FRAME_EXT_LEN_BIT)) || length > n
+      || length < overhead(header))
+    return false;
+
+  if (header & FRAME_CRC_BIT) {
+    uint32_t crc = frame_crc32(buf, length-4);
+    const uint8_t *c = &buf[length-4];
+    if (crc != ((uint32_t) c[0] << 24 | c[1] << 16 | c[2] << 8 | c[3]))
+      return false;
+  } else if (buf[length-1] != frame_crc8(buf, length-1)) {
+    return false;
+  }
+
+  size_t i = 4;
+  p->receiver = buf[0];
+  p->header = header;
+  p->sender = (header & FRAME_TX_INFO_BIT) ? buf[i++] : 0;
+  p->id = 0;
+  p->port = 0;
+  if (header & FRAME_PACKET_ID_BIT) {
+    p->id = buf[i] << 8 | buf[i+1];
+    i += 2;
+  }
+  if (header & FRAME_PORT_BIT) {
+    p->port = buf[i] << 8 | buf[i+1];
+    i += 2;
+  }
+  p->length = length - overhead(header);
+  memcpy(p->payload, &buf[i], p->length);
+  return true;
+}
+
+size_t frame_tsa_wrap(const uint8_t *data, size_t n, uint8_t *buf, size_t size)
+{
+  size_t i = 0;
+  if (size < 2)
+    return 0;
+
+  buf[i++] = FRAME_TSA_START;
+  for (size_t j = 0; j < n; j++) {
+    uint8_t b = data[j];
+    bool special = b == FRAME_TSA_START || b == FRAME_TSA_END
+      || b == FRAME_TSA_ESC;
+    if (i + (special ? 2 : 1) >= size)
+      return 0;
+    if (special) {
+      buf[i++] = FRAME_TSA_ESC;
+      b ^= FRAME_TSA_ESC;
+    }
+    buf[i++] = b;
+  }
+  buf[i++] = FRAME_TSA_END;
+  return i;
+}
+
+size_t frame_tsa_feed(frame_tsa_reader *r, uint8_t b)
+{
+  if (b == FRAME_TSA_START) {
+    r->in_frame = true;
+    r->escaped = false;
+    r->n = 0;
+    return 0;
+  }
+  if (!r->in_frame)
+    return 0;
+
+  if (b == FRAME_TSA_END) {
+    r->in_frame = false;
+    return r->n;
+  }
+  if (b == FRAME_TSA_ESC) {
+    r->escaped = true;
+    return 0;
+  }
+  if (r->escaped) {
+    b ^= FRAME_TSA_ESC;
+    r->escaped = false;
+  }
+
+  // too long, wait for the next frame
+  if (r->n >= sizeof(r->data)) {
+    r->in_frame = false;
+    return 0;
+  }
+  r->data[r->n++] = b;
+  return 0;
+}
+
+size_t overhead(uint8_t header)
+{
+  size_t n = 4; // receiver id, header, length and header CRC8
+  if (header & FRAME_TX_INFO_BIT)
+    n += 1;
+  if (header & FRAME_PACKET_ID_BIT)
+    n += 2;
+  if (header & FRAME_PORT_BIT)
+    n += 2;
+  n += (header & FRAME_CRC_BIT) ? 4 : 1;
+  return n;
+}
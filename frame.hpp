@@ -0,0 +1,88 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// PJON packets as specified by the PJON protocol specification v3.x
+// (PJON 11), local mode only:
+// RECEIVER ID | HEADER | LENGTH | CRC8 | [SENDER ID] | [PACKET ID] | [PORT] |
+// PAYLOAD | CRC8 or CRC32
+// and their ThroughSerialAsync framing:
+// START | packet with START, END and ESC bytes escaped | END
+// the synchronous acknowledgement being a single unframed FRAME_ACK byte
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_MODE_BIT       0x01
+#define FRAME_TX_INFO_BIT    0x02
+#define FRAME_ACK_REQ_BIT    0x04
+#define FRAME_ACK_MODE_BIT   0x08
+#define FRAME_PORT_BIT       0x10
+#define FRAME_CRC_BIT        0x20
+#define FRAME_EXT_LEN_BIT    0x40
+#define FRAME_PACKET_ID_BIT  0x80
+
+#define FRAME_BROADCAST 0
+#define FRAME_ACK 6
+
+// Default header of the daemon's packets (sender id and synchronous ack)
+#define FRAME_DEFAULT_HEADER (FRAME_TX_INFO_BIT | FRAME_ACK_REQ_BIT)
+
+#define FRAME_MAX_LENGTH 255
+
+#define FRAME_TSA_START 149
+#define FRAME_TSA_END   234
+#define FRAME_TSA_ESC   187
+#define FRAME_TSA_MAX_LENGTH (2*FRAME_MAX_LENGTH + 2)
+
+typedef struct {
+  uint8_t receiver;
+  uint8_t sender;
+  uint8_t header;
+  uint16_t id;
+  uint16_t port;
+  uint16_t length;
+  uint8_t payload[FRAME_MAX_LENGTH];
+} frame_packet;
+
+typedef struct {
+  uint8_t data[FRAME_MAX_LENGTH];
+  size_t n;
+  bool in_frame;
+  bool escaped;
+} frame_tsa_reader;
+
+// PJON's CRC8 and CRC32 of the n bytes of data
+uint8_t frame_crc8(const uint8_t *data, size_t n);
+uint32_t frame_crc32(const uint8_t *data, size_t n);
+
+// Encode the packet p into buf of size bytes, the CRC bit is set as PJON does
+// for packets longer than 15 bytes
+// Return the length of the encoded packet, 0 if it does not fit
+size_t frame_encode(const frame_packet *p, uint8_t *buf, size_t size);
+
+// Decode the packet of n bytes in buf into p
+// Return false if the packet is malformed or its CRCs are wrong
+bool frame_decode(const uint8_t *buf, size_t n, frame_packet *p);
+
+
+// Wrap the n bytes of an encoded packet into a ThroughSerialAsync frame in buf
+// of size bytes
+// Return the length of the frame, 0 if it does not fit
+size_t frame_tsa_wrap(const uint8_t *data, size_t n, uint8_t *buf, size_t size);
+
+// Feed the byte b read from a ThroughSerialAsync line to the reader r
+// Return the length of the packet completed in r->data, 0 otherwise
+size_t frame_tsa_feed(frame_tsa_reader *r, uint8_t b);
@@ -14,25 +14,60 @@
 
 #include "logger.hpp"
 
+#include <atomic>
+#include <condition_variable>
 #include <errno.h>
+#include <mutex>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
 #include <time.h>
+#include <unistd.h>
 
-static void log(const char *module, const char *prefix, const char *suffix,
-				const char *esc, const char *format, va_list ap);
-static bool print_iso_time(FILE *fo);
-static int packet_to_str(const proto_packet *packet, char *str, size_t size);
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE-1)) == 0,
+    "LOG_RING_SIZE must be a power of two");
+
+// A slot of the ring, sequence tells whether it is free, written or read
+// (bounded MPMC queue of D. Vyukov, with a single consumer here)
+typedef struct {
+  std::atomic<size_t> sequence;
+  time_t time;
+  const char *module;
+  enum log_kind kind;
+  int error;
+  proto_packet packet;
+  char message[LOG_MAX_MESSAGE_LEN];
+} log_record;
+
+static void log(enum log_kind kind, int error, const proto_packet *p,
+    const char *module, const char *format, va_list ap);
+static log_record *reserve(size_t *pos);
+static void writer();
+static void write_record(const log_record *r);
+static const char *format_time(time_t t);
 
 static FILE ** outputs = nullptr;
 static size_t outputs_n = 0;
 static bool colors = true;
 static char *time_format = nullptr;
-static unsigned int level = 0;
+
+unsigned int log_levels[LOG_MODULES] = {};
+bool log_tracing = false;
+
+static log_record ring[LOG_RING_SIZE];
+static std::atomic<size_t> enqueue_pos(0);
+static size_t dequeue_pos = 0;
+static std::atomic<unsigned long> dropped(0);
+static std::atomic<bool> running(false);
+static std::mutex writer_mutex;
+static std::condition_variable writer_cv;
+static std::thread writer_thread;
 
 void log_init(size_t n, FILE *fo[], bool c, const char *tf)
 {
+  log_quit();
+
   if (outputs)
     free(outputs);
   if (time_format)
@@ -43,176 +78,243 @@ void log_init(size_t n, FILE *fo[], bool c, const char *tf)
   outputs_n = n;
   colors = c;
 
-  time_format = (char*) malloc((strlen(tf)+1)*sizeof(char));
-  strcpy(time_format, tf);
+  time_format = nullptr;
+  if (tf) {
+    time_format = (char*) malloc((strlen(tf)+1)*sizeof(char));
+    strcpy(time_format, tf);
+  }
+
+  for (size_t i = 0; i < LOG_RING_SIZE; i++)
+    ring[i].sequence.store(i, std::memory_order_relaxed);
+  enqueue_pos = 0;
+  dequeue_pos = 0;
+
+  static bool registered = false;
+  if (!registered)
+    atexit(log_quit);
+  registered = true;
+
+  running = true;
+  writer_thread = std::thread(writer);
 
   log_info("logger", "Initialization");
 }
 
+void log_quit()
+{
+  if (log_tracing) {
+    log_tracing = false;
+    trace_close();
+  }
+  if (!running)
+    return;
+  running = false;
+  writer_cv.notify_one();
+  writer_thread.join();
+}
+
 void log_set_level(unsigned int l)
 {
-  level = l;
+  for (auto &level : log_levels)
+    level = l;
 }
 
-void log_info(const char *module, const char *format, ...)
+bool log_set_module_level(const char *module, unsigned int l)
 {
-  if (level > 0)
-    return;
-  va_list ap;
-  va_start(ap, format);
-  log(module, "", nullptr, nullptr, format, ap);
+  enum log_module m = log_module_of(module);
+  if (module && m == LOG_MODULE_OTHER)
+    return false;
+  log_levels[m] = l;
+  return true;
 }
 
-void log_warn(const char *module, const char *format, ...)
+unsigned long log_get_dropped()
 {
-  if (level > 1)
-    return;
-  va_list ap;
-  va_start(ap, format);
-  log(module, "WARNING : ", nullptr, "\x1b[93m\x1b[1m", format, ap);
+  return dropped;
 }
 
-void log_error(const char *module, const char *format, ...)
+bool log_trace_init(const char *path, size_t size, unsigned int n)
 {
-  if (level > 2)
-    return;
-  va_list ap;
-  va_start(ap, format);
-  log(module, "ERROR : ", nullptr, "\x1b[91m\x1b[1m", format, ap);
+  log_tracing = trace_open(path, size, n);
+  if (log_tracing)
+    log_info("logger", "Tracing to %s", path);
+  else
+    log_error("logger", "Failed to open trace %s", path);
+  return log_tracing;
 }
 
-void log_perror(const char *module, const char *format, ...)
+uint16_t log_register_site(enum log_kind kind, const char *module,
+    const char *format)
 {
-  if (level > 2)
-    return;
-  va_list ap;
-  va_start(ap, format);
-  log(module, "ERROR : ", strerror(errno), "\x1b[91m\x1b[1m", format, ap);
+  return trace_register_site(kind, module, format);
 }
 
-void log_packet(const char *module, const proto_packet *p,
-				const char *format, ...)
+void log_text(enum log_kind kind, const char *module, int error,
+    const proto_packet *p, const char *format, ...)
 {
-  if (level > 0)
-    return;
-  static char packet_str[LOG_MAX_PACKET_STR_LEN];
   va_list ap;
   va_start(ap, format);
-  packet_to_str(p, packet_str, LOG_MAX_PACKET_STR_LEN);
-  log(module, "PACKET : ", packet_str, nullptr, format, ap);
+  log(kind, error, p, module, format, ap);
+  va_end(ap);
 }
 
-void log(const char *module, const char *prefix, const char *suffix,
-		 const char *esc, const char *format, va_list ap)
+void log_trace(uint16_t site, enum log_kind kind, int error,
+    const proto_packet *p, const trace_arg *args, size_t n)
 {
-  for (unsigned int i = 0; i < outputs_n; i++) {
-    FILE *f = outputs[i];
-    if (!f)
-      return;
-    if (time_format)
-      print_iso_time(f);
-    if (module)
-      fprintf(f, "%s - ", module);
-    if (esc)
-      fprintf(f, "%s", esc);
-    if (prefix)
-      fprintf(f, "%s", prefix);
-    if (esc)
-      fprintf(f, "\x1b[0m");
-    if (format)
-      vfprintf(f, format, ap);
-    if (suffix)
-      fprintf(f, " : %s", suffix);
-    fprintf(f, "\n");
-  }
+  uint8_t flags = 0;
+  if (kind == LOG_KIND_PERROR)
+    flags |= TRACE_FLAG_ERROR;
+  if (p)
+    flags |= TRACE_FLAG_PACKET;
+  trace_event(site, flags, error, p, args, n < TRACE_MAX_ARGS ? n : TRACE_MAX_ARGS);
 }
 
-bool print_iso_time(FILE *fo)
+// only the message is formatted by the caller, the rest is left to the writer
+void log(enum log_kind kind, int error, const proto_packet *p,
+    const char *module, const char *format, va_list ap)
 {
-  char outstr[LOG_MAX_PACKET_STR_LEN];
-  time_t t;
-  struct tm *tmp;
-
-  t = time(NULL);
-  tmp = localtime(&t);
-  if (tmp == NULL) {
-    fprintf(fo, "Time fail: %s - ", strerror(errno));
-    return false;
-  }
+  if (!running)
+    return;
 
-  if (strftime(outstr, sizeof(outstr), time_format, tmp) == 0) {
-    fprintf(fo, "Time fail: strftime returned 0 - ");
-    return false;
+  size_t pos;
+  log_record *r = reserve(&pos);
+  if (!r) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
   }
 
-  fprintf(fo, "%s - ", outstr);
-  return true;
+  r->time = time(NULL);
+  r->module = module;
+  r->kind = kind;
+  r->error = error;
+  if (p)
+    r->packet = *p;
+  r->message[0] = '\0';
+  if (format)
+    vsnprintf(r->message, sizeof(r->message), format, ap);
+  r->sequence.store(pos + 1, std::memory_order_release);
+
+  writer_cv.notify_one();
 }
 
-int packet_to_str(const proto_packet *packet, char *str, size_t size)
+log_record *reserve(size_t *pos)
 {
-
-  if (packet->head == PROTO_HEAD_VERSION) {
-    auto *p = (proto_packetVersion*) packet;
-    return snprintf(str, size, "\n{\n"
-        "\thead: PROTO_HEAD_VERSION (0x%02x)\n"
-        "\tversion: '%s'\n"
-        "}", PROTO_HEAD_VERSION, p->version);
+  size_t p = enqueue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    log_record *r = &ring[p & (LOG_RING_SIZE-1)];
+    size_t sequence = r->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t) sequence - (intptr_t) p;
+    if (diff == 0) {
+      if (enqueue_pos.compare_exchange_weak(p, p+1,
+            std::memory_order_relaxed)) {
+        *pos = p;
+        return r;
+      }
+    } else if (diff < 0) { // full
+      return nullptr;
+    } else {
+      p = enqueue_pos.load(std::memory_order_relaxed);
+    }
   }
+}
 
-  if (packet->head == PROTO_HEAD_INFO) {
-    auto *p = (proto_packetInfo*) packet;
-    return snprintf(str, size, "\n{\n"
-        "\thead: PROTO_HEAD_INFO (0x%02x)\n"
-        "\tcode: 0x%04x\n"
-        "}", PROTO_HEAD_INFO, p->code);
-  }
+void writer()
+{
+  unsigned long reported = 0;
 
-  if (packet->head == PROTO_HEAD_WARN) {
-    auto *p = (proto_packetWarn*) packet;
-    return snprintf(str, size, "\n{\n"
-        "\thead: PROTO_HEAD_WARN (0x%02x)\n"
-        "\tcode: 0x%04x\n"
-        "}", PROTO_HEAD_WARN, p->code);
-  }
+  while (true) {
+    log_record *r = &ring[dequeue_pos & (LOG_RING_SIZE-1)];
+    if (r->sequence.load(std::memory_order_acquire) == dequeue_pos + 1) {
+      write_record(r);
+      r->sequence.store(dequeue_pos + LOG_RING_SIZE, std::memory_order_release);
+      dequeue_pos++;
+      continue;
+    }
 
-  if (packet->head == PROTO_HEAD_ERROR) {
-    auto *p = (proto_packetError*) packet;
-    return snprintf(str, size, "\n{\n"
-        "\thead: PROTO_HEAD_ERROR (0x%02x)\n"
-        "\tcode: 0x%04x\n"
-        "}", PROTO_HEAD_ERROR, p->code);
+    // the ring is empty
+    unsigned long d = dropped;
+    if (d != reported) {
+      log_record lost;
+      lost.time = time(NULL);
+      lost.module = "logger";
+      lost.kind = LOG_KIND_WARN;
+      snprintf(lost.message, sizeof(lost.message), "%lu log records dropped",
+          d - reported);
+      write_record(&lost);
+      reported = d;
+    }
+    if (!running)
+      return;
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    writer_cv.wait_for(lock, std::chrono::milliseconds(100));
   }
+}
 
-  if (packet->head == PROTO_HEAD_INGOING_MSG) {
-    auto *p = (proto_packetIngoingMessage*) packet;
-    return snprintf(str, size, "\n{\n"
-        "\thead: PROTO_HEAD_INGOING_MSG (0x%02x)\n"
-        "\tsrc: 0x%02x\n"
-        "\tlength: %d\n"
-        "\tdata: ...\n"
-        "}", PROTO_HEAD_INGOING_MSG, p->src, p->length);
-  }
+// compose the whole line to write it at once
+void write_record(const log_record *r)
+{
+  static const struct {
+    const char *prefix;
+    const char *esc;
+  } kinds[] = { // indexed by log_kind
+    {"", nullptr},
+    {"PACKET : ", nullptr},
+    {"WARNING : ", "\x1b[93m\x1b[1m"},
+    {"ERROR : ", "\x1b[91m\x1b[1m"},
+    {"ERROR : ", "\x1b[91m\x1b[1m"},
+  };
+  char line[LOG_MAX_MESSAGE_LEN + LOG_MAX_PACKET_STR_LEN + 128];
+  char suffix[LOG_MAX_PACKET_STR_LEN];
+  const char *esc = colors ? kinds[r->kind].esc : nullptr;
+  size_t n = 0;
 
-  if (packet->head == PROTO_HEAD_OUTGOING_MSG) {
-    auto *p = (proto_packetOutgoingMessage*) packet;
-    return snprintf(str, size, "\n{\n"
-        "\thead: PROTO_HEAD_OUTGOING_MSG (0x%02x)\n"
-        "\tdest: 0x%02x\n"
-        "\tlength: %d\n"
-        "\tdata: ...\n"
-        "}", PROTO_HEAD_OUTGOING_MSG, p->dest, p->length);
+  suffix[0] = '\0';
+  if (r->kind == LOG_KIND_PERROR)
+    snprintf(suffix, sizeof(suffix), " : %s", strerror(r->error));
+  if (r->kind == LOG_KIND_PACKET) {
+    suffix[0] = ' ';
+    suffix[1] = ':';
+    suffix[2] = ' ';
+    proto_packet_to_str(&r->packet, &suffix[3], sizeof(suffix)-3);
   }
 
-  if (packet->head == PROTO_HEAD_OUTGOING_RESULT) {
-    auto *p = (proto_packetOutgoingResult*) packet;
-    return snprintf(str, size, "\n{\n"
-        "\thead: PROTO_HEAD_OUTGOING_RESULT (0x%02x)\n"
-        "\tcode: 0x%04x\n"
-        "}", PROTO_HEAD_OUTGOING_RESULT, p->result);
+  int count = snprintf(line, sizeof(line), "%s%s%s%s%s%s%s%s\n",
+      time_format ? format_time(r->time) : "",
+      r->module ? r->module : "", r->module ? " - " : "",
+      esc ? esc : "", kinds[r->kind].prefix, esc ? "\x1b[0m" : "",
+      r->message, suffix);
+  if (count < 0)
+    return;
+  n = (size_t) count < sizeof(line) ? count : sizeof(line)-1;
+
+  for (size_t i = 0; i < outputs_n; i++) {
+    FILE *f = outputs[i];
+    if (!f)
+      return;
+    if (write(fileno(f), line, n) < 0)
+      return;
   }
+}
 
+// the formatted time is cached for the current second
+const char *format_time(time_t t)
+{
+  static time_t cached_time = (time_t) -1;
+  static char cached[LOG_MAX_PACKET_STR_LEN];
 
-  return 0;
-}
+  if (t == cached_time)
+    return cached;
 
+  struct tm tmp;
+  if (localtime_r(&t, &tmp) == NULL) {
+    snprintf(cached, sizeof(cached), "Time fail: %s - ", strerror(errno));
+  } else {
+    size_t n = strftime(cached, sizeof(cached) - 3, time_format, &tmp);
+    if (n == 0)
+      snprintf(cached, sizeof(cached), "Time fail: strftime returned 0 - ");
+    else
+      strcpy(&cached[n], " - ");
+  }
+  cached_time = t;
+  return cached;
+}
@@ -15,14 +15,60 @@
 #pragma once
 
 #include "protocol.hpp"
+#include "trace.hpp"
 
+#include <errno.h>
 #include <stdio.h>
+#include <type_traits>
 
 #ifndef LOG_MAX_PACKET_STR_LEN
 #	define LOG_MAX_PACKET_STR_LEN 256
 #endif
 
-// set the n log output files fo and the format tf
+#ifndef LOG_MAX_MESSAGE_LEN
+#	define LOG_MAX_MESSAGE_LEN 192
+#endif
+
+// Number of records waiting to be written, must be a power of two. Records
+// logged while it is full are dropped and counted.
+#ifndef LOG_RING_SIZE
+#	define LOG_RING_SIZE 1024
+#endif
+
+// Level under which the log sites are compiled out (0: everything is kept,
+// 1: warnings and errors, 2: only errors)
+#ifndef LOG_MIN_LEVEL
+#	define LOG_MIN_LEVEL 0
+#endif
+
+enum log_kind : uint8_t {
+  LOG_KIND_INFO,
+  LOG_KIND_PACKET,
+  LOG_KIND_WARN,
+  LOG_KIND_ERROR,
+  LOG_KIND_PERROR
+};
+
+// modules with their own level, known from the name given to the log macros
+enum log_module : uint8_t {
+  LOG_MODULE_OTHER,
+  LOG_MODULE_COM,
+  LOG_MODULE_SOCKET,
+  LOG_MODULE_SERVER,
+  LOG_MODULE_LOGGER,
+  LOG_MODULE_FWD,
+  LOG_MODULE_CAPTURE,
+  LOG_MODULE_METRICS,
+  LOG_MODULE_STATS,
+  LOG_MODULE_PROFILER,
+  LOG_MODULE_POOL,
+  LOG_MODULES
+};
+
+// Records are queued by the callers and written by a background thread, each
+// line with a single write.
+
+// set the n log output files fo and the format tf, start the writer thread
 // n: number of outputs (set to 0 for no output)
 // fo: list of output file (don't hesitate to use stdout or stderr)
 // c: enable colors
@@ -30,16 +76,128 @@
 // to be written)
 void log_init(size_t n, FILE *fo[], bool c=true, const char *tf="%FT%TZ");
 
-// set log level
+// write the queued records and stop the writer thread, called at exit
+void log_quit();
+
+// set log level of all the modules
 // 0: everything is printed
 // 1: warnings and errors
-// 3: only errors
+// 2: only errors
 void log_set_level(unsigned int l);
 
-// log, used as printf withou \n at the end
-void log_info(const char *module, const char *format, ...);
-void log_warn(const char *module, const char *format, ...);
-void log_error(const char *module, const char *format, ...);
-void log_perror(const char *module, const char *format, ...);
-void log_packet(const char *module, const proto_packet *p,
-				const char *format, ...);
+// set the log level of a module by its name (com, socket, server, logger, fwd,
+// capture, metrics, stats, profiler, pool or nullptr for the others)
+// Return false if the module is unknown, true otherwise
+bool log_set_module_level(const char *module, unsigned int l);
+
+// return the number of records dropped because the queue was full
+unsigned long log_get_dropped();
+
+// record the logs as a binary trace in the rotation of n files of size bytes
+// at path (see trace.hpp), to be rendered by PJON-tracedump. Warnings and
+// errors are still written as text too.
+// Return false in case of failure, true otherwise
+bool log_trace_init(const char *path, size_t size, unsigned int n);
+
+// log, used as printf withou \n at the end, module must be a string literal or
+// nullptr and format a string literal. The arguments are only evaluated when
+// the level of the module lets the log through.
+#define log_info(module, ...) \
+  LOG_SITE(LOG_KIND_INFO, module, nullptr, __VA_ARGS__)
+#define log_warn(module, ...) \
+  LOG_SITE(LOG_KIND_WARN, module, nullptr, __VA_ARGS__)
+#define log_error(module, ...) \
+  LOG_SITE(LOG_KIND_ERROR, module, nullptr, __VA_ARGS__)
+#define log_perror(module, ...) \
+  LOG_SITE(LOG_KIND_PERROR, module, nullptr, __VA_ARGS__)
+#define log_packet(module, p, ...) \
+  LOG_SITE(LOG_KIND_PACKET, module, p, __VA_ARGS__)
+
+/* Internals of the log macros: sites under LOG_MIN_LEVEL are discarded at
+   compile time, the others check the level of their module before evaluating
+   the arguments. Each call site registers itself once and gets a site id used
+   by the binary trace. */
+
+#define LOG_FIRST(first, ...) first
+
+#define LOG_SITE(kind, module, p, ...) do { \
+    (void) sizeof(log_check_format(__VA_ARGS__)); \
+    if constexpr (log_kind_level(kind) >= LOG_MIN_LEVEL) { \
+      constexpr enum log_module log_module_id = log_module_of(module); \
+      if (log_kind_level(kind) >= log_levels[log_module_id]) { \
+        static const uint16_t log_site_id = log_register_site(kind, module, \
+            LOG_FIRST(__VA_ARGS__, )); \
+        log_site(log_site_id, kind, module, p, __VA_ARGS__); \
+      } \
+    } \
+  } while (0)
+
+extern unsigned int log_levels[LOG_MODULES];
+extern bool log_tracing;
+
+// never called, only lets the compiler check the format of the log sites
+[[gnu::format(printf, 1, 2)]] int log_check_format(const char *format, ...);
+
+uint16_t log_register_site(enum log_kind kind, const char *module,
+    const char *format);
+[[gnu::format(printf, 5, 6)]] void log_text(enum log_kind kind,
+    const char *module, int error, const proto_packet *p, const char *format,
+    ...);
+void log_trace(uint16_t site, enum log_kind kind, int error,
+    const proto_packet *p, const trace_arg *args, size_t n);
+
+constexpr unsigned int log_kind_level(enum log_kind kind)
+{
+  return kind >= LOG_KIND_ERROR ? 2 : kind == LOG_KIND_WARN ? 1 : 0;
+}
+
+constexpr const char *log_module_names[LOG_MODULES] = {
+  nullptr, "com", "socket", "server", "logger", "fwd", "capture",
+  "metrics", "stats", "profiler", "pool"
+};
+
+constexpr bool log_streq(const char *a, const char *b)
+{
+  while (*a && *a == *b)
+    a++, b++;
+  return *a == *b;
+}
+
+constexpr enum log_module log_module_of(const char *module)
+{
+  if (module)
+    for (uint8_t m = LOG_MODULE_OTHER+1; m < LOG_MODULES; m++)
+      if (log_streq(module, log_module_names[m]))
+        return (enum log_module) m;
+  return LOG_MODULE_OTHER;
+}
+
+template<typename T>
+inline trace_arg log_make_arg(T v)
+{
+  trace_arg a;
+  if constexpr (std::is_floating_point<T>::value)
+    a.d = v;
+  else if constexpr (std::is_pointer<T>::value)
+    a.p = (const void*) v;
+  else if constexpr (std::is_signed<T>::value)
+    a.i = v;
+  else
+    a.u = (uint64_t) v;
+  return a;
+}
+
+template<typename... Args>
+inline void log_site(uint16_t site, enum log_kind kind, const char *module,
+    const proto_packet *p, const char *format, Args... args)
+{
+  int error = errno;
+
+  if (log_tracing) {
+    trace_arg a[] = {log_make_arg(args)..., trace_arg()};
+    log_trace(site, kind, error, p, a, sizeof...(args));
+    if (kind < LOG_KIND_WARN)
+      return;
+  }
+  log_text(kind, module, error, p, format, args...);
+}
@@ -0,0 +1,95 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "simulation.hpp"
+#include "PJON.h"
+
+// Time a dispatch waits for an acknowledgement that never comes
+#ifndef LOOPBACK_RESPONSE_TIME_OUT
+#define LOOPBACK_RESPONSE_TIME_OUT 10'000 // in us
+#endif
+
+// In-process PJON strategy: the packets are handed to a Simulation instead of
+// a serial device, its nodes acknowledge and reply with their configured
+// latencies and drop rates. Used to exercise and benchmark the daemon
+// without hardware.
+class LoopbackStrategy {
+
+  public:
+
+    Simulation simulation;
+
+    uint32_t back_off(uint8_t attempts)
+    {
+      return attempts;
+    }
+
+    bool begin(uint8_t did = 0)
+    {
+      (void) did;
+      return true;
+    }
+
+    bool can_start()
+    {
+      return true;
+    }
+
+    uint8_t get_max_attempts()
+    {
+      return 5;
+    }
+
+    void handle_collision()
+    {
+    }
+
+    uint16_t receive_frame(uint8_t *data, uint16_t max_length)
+    {
+      frame_packet p;
+      if (!this->simulation.poll(sim_micros(), &p))
+        return PJON_FAIL;
+      size_t n = frame_encode(&p, data, max_length);
+      return n ? n : PJON_FAIL;
+    }
+
+    uint16_t receive_response()
+    {
+      PJON_DELAY_MICROSECONDS(this->response_delay);
+      return this->response;
+    }
+
+    void send_response(uint8_t response)
+    {
+      (void) response;
+    }
+
+    void send_frame(uint8_t *data, uint16_t length)
+    {
+      frame_packet p;
+      uint32_t delay = 0;
+      bool acked = frame_decode(data, length, &p)
+        && this->simulation.deliver(&p, sim_micros(), &delay);
+      this->response = acked ? PJON_ACK : PJON_FAIL;
+      this->response_delay = acked ? delay : LOOPBACK_RESPONSE_TIME_OUT;
+    }
+
+  private:
+
+    uint16_t response = PJON_FAIL;
+    uint32_t response_delay = 0;
+
+};
@@ -0,0 +1,360 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "metrics.hpp"
+#include "logger.hpp"
+
+#include <atomic>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SUB_N (1 << METRICS_HISTOGRAM_SUB_BITS)
+
+typedef struct {
+  std::atomic<uint64_t> buckets[METRICS_HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+} histogram;
+
+static size_t bucket(uint64_t v);
+static uint64_t bucket_bound(size_t i);
+static uint64_t quantile(const histogram *h, uint64_t count, double q);
+static void summarize(const histogram *h, uint64_t count, metrics_summary *s);
+static bool allocate();
+
+// in the order of metrics_id
+static const metrics_family families[METRICS_N] = {
+  {"pjon_rtt_us", "Round trip of the acknowledged attempts in us",
+    METRICS_HISTOGRAM, "dest", 256},
+  {"pjon_attempts", "Attempts to the acknowledgement", METRICS_HISTOGRAM,
+    "dest", 256},
+  {"pjon_success", "Acknowledged requests", METRICS_COUNTER, "dest", 256},
+  {"pjon_lost", "Requests never acknowledged", METRICS_COUNTER, "dest", 256},
+  {"pjon_too_long", "Requests too long to be sent", METRICS_COUNTER, "dest",
+    256},
+  {"pjon_received", "Received messages", METRICS_COUNTER, "src", 256},
+  {"bus_outgoing", "Requests handled by the bus thread", METRICS_GAUGE, "bus",
+    256},
+  {"bus_reception", "Received messages waiting for the server",
+    METRICS_GAUGE, "bus", 256},
+  {"bus_dropped", "Received messages lost on a full queue", METRICS_COUNTER,
+    "bus", 256},
+  {"bus_reconnects", "Reconnections of the bus", METRICS_COUNTER, "bus", 256},
+  {"bus_connected", "Whether the bus is connected", METRICS_GAUGE, "bus",
+    256},
+  {"com_pending", "Requests pushed and not finished", METRICS_GAUGE, nullptr,
+    1},
+  {"client_bytes_in", "Bytes received from the client", METRICS_COUNTER,
+    "client", METRICS_MAX_CLIENTS},
+  {"client_bytes_out", "Bytes sent to the client", METRICS_COUNTER, "client",
+    METRICS_MAX_CLIENTS},
+  {"client_packets_in", "Packets received from the client", METRICS_COUNTER,
+    "client", METRICS_MAX_CLIENTS},
+  {"client_packets_out", "Packets sent to the client", METRICS_COUNTER,
+    "client", METRICS_MAX_CLIENTS},
+  {"fwd_dropped", "Forwarded packets dropped", METRICS_COUNTER, nullptr, 1},
+  {"log_dropped", "Log records dropped", METRICS_COUNTER, nullptr, 1},
+  {"server_loop_us", "Duration of the server loop iterations in us",
+    METRICS_HISTOGRAM, nullptr, 1},
+  {"clients", "Connected clients", METRICS_GAUGE, nullptr, 1},
+  {"phase_ns", "Duration of the profiled phases in ns", METRICS_HISTOGRAM,
+    "phase", 16},
+  {"server_dropped", "Packets lost on a full queue between a worker and the "
+    "bus owner", METRICS_COUNTER, "worker", 16},
+  {"pool_used", "Slots of the packet pool out of its shared free list",
+    METRICS_GAUGE, nullptr, 1},
+  {"pool_exhausted", "Packets lost on an exhausted packet pool",
+    METRICS_COUNTER, nullptr, 1},
+  {"socket_dropped", "Packets lost for a client with SOCKET_MAX_QUEUED packets "
+    "queued", METRICS_COUNTER, "worker", 16},
+};
+
+static std::atomic<int64_t> *values[METRICS_N];
+static histogram *histograms[METRICS_N];
+static bool allocated = allocate();
+
+const metrics_family *metrics_get_family(unsigned int id)
+{
+  return id < METRICS_N ? &families[id] : nullptr;
+}
+
+void metrics_add(enum metrics_id id, size_t label, int64_t v)
+{
+  if (label < families[id].n && values[id])
+    values[id][label].fetch_add(v, std::memory_order_relaxed);
+}
+
+void metrics_set(enum metrics_id id, size_t label, int64_t v)
+{
+  if (label < families[id].n && values[id])
+    values[id][label].store(v, std::memory_order_relaxed);
+}
+
+void metrics_observe(enum metrics_id id, size_t label, uint64_t v)
+{
+  if (label >= families[id].n || !histograms[id])
+    return;
+  histogram &h = histograms[id][label];
+  h.buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+  h.sum.fetch_add(v, std::memory_order_relaxed);
+  uint64_t max = h.max.load(std::memory_order_relaxed);
+  while (v > max && !h.max.compare_exchange_weak(max, v,
+        std::memory_order_relaxed));
+  // counted last so a reader never sees more samples than in the buckets
+  h.count.fetch_add(1, std::memory_order_release);
+}
+
+void metrics_reset(enum metrics_id id, size_t label)
+{
+  if (label >= families[id].n)
+    return;
+  if (values[id])
+    values[id][label].store(0, std::memory_order_relaxed);
+  if (histograms[id]) {
+    histogram &h = histograms[id][label];
+    h.count = 0;
+    for (auto &b : h.buckets)
+      b.store(0, std::memory_order_relaxed);
+    h.sum = 0;
+    h.max = 0;
+  }
+}
+
+bool metrics_summarize(unsigned int id, size_t label, metrics_summary *s)
+{
+  if (id >= METRICS_N || label >= families[id].n)
+    return false;
+  memset(s, 0, sizeof(*s));
+
+  if (values[id]) {
+    s->value = values[id][label].load(std::memory_order_relaxed);
+    return true;
+  }
+
+  const histogram *h = &histograms[id][label];
+  summarize(h, h->count.load(std::memory_order_acquire), s);
+  return true;
+}
+
+bool metrics_summarize_all(unsigned int id, metrics_summary *s)
+{
+  if (id >= METRICS_N)
+    return false;
+  memset(s, 0, sizeof(*s));
+
+  if (values[id]) {
+    for (size_t l = 0; l < families[id].n; l++)
+      s->value += values[id][l].load(std::memory_order_relaxed);
+    return true;
+  }
+
+  // the series merged into one histogram
+  histogram all = {};
+  uint64_t count = 0;
+  for (size_t l = 0; l < families[id].n; l++) {
+    const histogram *h = &histograms[id][l];
+    uint64_t n = h->count.load(std::memory_order_acquire);
+    if (!n)
+      continue;
+    count += n;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+      all.buckets[i].fetch_add(h->buckets[i].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+    all.sum.fetch_add(h->sum.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    all.max = std::max(all.max.load(), h->max.load(std::memory_order_relaxed));
+  }
+  summarize(&all, count, s);
+  return true;
+}
+
+std::string metrics_prometheus()
+{
+  std::string text;
+  char line[256];
+
+  for (unsigned int id = 0; id < METRICS_N; id++) {
+    const metrics_family &f = families[id];
+    const char *type = f.type == METRICS_COUNTER ? "counter"
+      : f.type == METRICS_GAUGE ? "gauge" : "histogram";
+    const char *suffix = f.type == METRICS_COUNTER ? "_total" : "";
+    snprintf(line, sizeof(line), "# HELP pjon_daemon_%s%s %s\n"
+        "# TYPE pjon_daemon_%s%s %s\n", f.name, suffix, f.help, f.name, suffix,
+        type);
+    text += line;
+
+    for (size_t l = 0; l < f.n; l++) {
+      // label as {name="l"} and as the first ones of the buckets name="l",
+      char labels[64] = "";
+      char bucket_labels[64] = "";
+      if (f.label) {
+        snprintf(labels, sizeof(labels), "{%s=\"%zu\"}", f.label, l);
+        snprintf(bucket_labels, sizeof(bucket_labels), "%s=\"%zu\",", f.label,
+            l);
+      }
+
+      if (values[id]) {
+        int64_t v = values[id][l].load(std::memory_order_relaxed);
+        if (f.label && !v)
+          continue;
+        snprintf(line, sizeof(line), "pjon_daemon_%s%s%s %lld\n", f.name,
+            suffix, labels, (long long) v);
+        text += line;
+        continue;
+      }
+
+      // the le bounds are the powers of two
+      const histogram *h = &histograms[id][l];
+      uint64_t count = h->count.load(std::memory_order_acquire);
+      if (f.label && !count)
+        continue;
+      uint64_t cumulated = 0;
+      for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        cumulated += h->buckets[i].load(std::memory_order_relaxed);
+        uint64_t bound = bucket_bound(i);
+        if ((bound & (bound - 1)) != 0)
+          continue;
+        snprintf(line, sizeof(line), "pjon_daemon_%s_bucket{%sle=\"%llu\"} "
+            "%llu\n", f.name, bucket_labels, (unsigned long long) bound,
+            (unsigned long long) cumulated);
+        text += line;
+      }
+      snprintf(line, sizeof(line), "pjon_daemon_%s_bucket{%sle=\"+Inf\"} "
+          "%llu\n", f.name, bucket_labels, (unsigned long long) count);
+      text += line;
+      snprintf(line, sizeof(line), "pjon_daemon_%s_sum%s %llu\n", f.name,
+          labels, (unsigned long long) h->sum.load(std::memory_order_relaxed));
+      text += line;
+      snprintf(line, sizeof(line), "pjon_daemon_%s_count%s %llu\n", f.name,
+          labels, (unsigned long long) count);
+      text += line;
+    }
+  }
+  return text;
+}
+
+int metrics_listen(const char *name)
+{
+  int fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    log_perror("metrics", "Failed to create the metrics socket");
+    return -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_LOCAL;
+  strncpy(addr.sun_path+1, name, sizeof(addr.sun_path)-2);
+  socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(name) + 1;
+  if (bind(fd, (struct sockaddr*) &addr, len) < 0 || listen(fd, 16) < 0) {
+    log_perror("metrics", "Failed to listen on %s", name);
+    close(fd);
+    return -1;
+  }
+  log_info("metrics", "Serving the metrics on %s", name);
+  return fd;
+}
+
+// the text normally fits in the socket buffer of the new connection, a client
+// not reading it is dropped rather than blocking the caller
+void metrics_serve(int fd)
+{
+  int client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      log_perror("metrics", "Failed to accept a metrics client");
+    return;
+  }
+  std::string text = metrics_prometheus();
+  for (size_t n = 0; n < text.size();) {
+    ssize_t count = write(client, &text[n], text.size() - n);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      log_warn("metrics", "Metrics client not reading, dropped after %zu of "
+          "%zu bytes", n, text.size());
+      break;
+    }
+    if (count <= 0)
+      break;
+    n += count;
+  }
+  close(client);
+}
+
+// values 0 and 1 share the first bucket so that the bound of a bucket is the
+// greatest value it holds, as the le of Prometheus
+size_t bucket(uint64_t v)
+{
+  uint64_t k = v ? v - 1 : 0;
+  if (k < SUB_N)
+    return k;
+  if (k >> 32)
+    return METRICS_HISTOGRAM_BUCKETS - 1;
+  unsigned int e = 63 - __builtin_clzll(k);
+  unsigned int sub = (k >> (e - METRICS_HISTOGRAM_SUB_BITS)) & (SUB_N - 1);
+  return ((e - METRICS_HISTOGRAM_SUB_BITS + 1) << METRICS_HISTOGRAM_SUB_BITS)
+    + sub;
+}
+
+uint64_t bucket_bound(size_t i)
+{
+  if (i < SUB_N)
+    return i + 1;
+  unsigned int group = i >> METRICS_HISTOGRAM_SUB_BITS;
+  unsigned int sub = i & (SUB_N - 1);
+  return (uint64_t) (SUB_N + sub + 1) << (group - 1);
+}
+
+void summarize(const histogram *h, uint64_t count, metrics_summary *s)
+{
+  s->value = count;
+  s->sum = h->sum.load(std::memory_order_relaxed);
+  s->max = h->max.load(std::memory_order_relaxed);
+  s->p50 = std::min(quantile(h, count, 0.5), s->max);
+  s->p90 = std::min(quantile(h, count, 0.9), s->max);
+  s->p99 = std::min(quantile(h, count, 0.99), s->max);
+}
+
+uint64_t quantile(const histogram *h, uint64_t count, double q)
+{
+  if (!count)
+    return 0;
+  uint64_t rank = q * (count - 1) + 1;
+  uint64_t cumulated = 0;
+  for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+    cumulated += h->buckets[i].load(std::memory_order_relaxed);
+    if (cumulated >= rank)
+      return bucket_bound(i);
+  }
+  return bucket_bound(METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+bool allocate()
+{
+  for (unsigned int id = 0; id < METRICS_N; id++) {
+    if (families[id].type == METRICS_HISTOGRAM)
+      histograms[id] = new histogram[families[id].n]();
+    else
+      values[id] = new std::atomic<int64_t>[families[id].n]();
+  }
+  return true;
+}
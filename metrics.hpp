@@ -0,0 +1,125 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Counters, gauges and histograms of the daemon, each metric being a family
+// of series distinguished by one integer label (PJON id, bus, client...).
+// They can be updated from any thread and are read through the stats frame
+// of the protocol and as Prometheus text on a local socket.
+
+// Histogram buckets are log-linear: 2^METRICS_HISTOGRAM_SUB_BITS buckets per
+// power of two, values above 2^32 are counted in the last bucket
+#define METRICS_HISTOGRAM_SUB_BITS 3
+#define METRICS_HISTOGRAM_BUCKETS \
+  ((32 - METRICS_HISTOGRAM_SUB_BITS + 1) << METRICS_HISTOGRAM_SUB_BITS)
+
+#ifndef METRICS_MAX_CLIENTS
+#	define METRICS_MAX_CLIENTS 1024
+#endif
+
+enum metrics_type : uint8_t {
+  METRICS_COUNTER,
+  METRICS_GAUGE,
+  METRICS_HISTOGRAM
+};
+
+// the ids are part of the protocol (see PROTO_HEAD_STATS_REQUEST), new
+// metrics go at the end
+enum metrics_id : uint8_t {
+  METRICS_PJON_RTT,          // us of the acknowledged attempt, by destination
+  METRICS_PJON_ATTEMPTS,     // attempts to the acknowledgement, by destination
+  METRICS_PJON_SUCCESS,      // by destination
+  METRICS_PJON_LOST,         // connection lost, by destination
+  METRICS_PJON_TOO_LONG,     // content too long, by destination
+  METRICS_PJON_RECEIVED,     // by source
+  METRICS_BUS_OUTGOING,      // requests in the bus thread, by bus
+  METRICS_BUS_RECEPTION,     // messages waiting for the server, by bus
+  METRICS_BUS_DROPPED,       // messages lost on a full reception, by bus
+  METRICS_BUS_RECONNECTS,    // by bus
+  METRICS_BUS_CONNECTED,     // by bus
+  METRICS_COM_PENDING,       // requests pushed and not finished
+  METRICS_CLIENT_BYTES_IN,   // by client socket
+  METRICS_CLIENT_BYTES_OUT,  // by client socket
+  METRICS_CLIENT_PACKETS_IN, // by client socket
+  METRICS_CLIENT_PACKETS_OUT,// by client socket
+  METRICS_FWD_DROPPED,       // forwarded packets dropped
+  METRICS_LOG_DROPPED,       // log records dropped
+  METRICS_LOOP_TIME,         // us of a server loop iteration
+  METRICS_CLIENTS,           // connected clients
+  METRICS_PHASE_TIME,        // ns of a profiled phase, by prof_phase
+  METRICS_SERVER_DROPPED,    // packets lost on a full queue, by worker
+  METRICS_POOL_USED,         // slots of the packet pool in use
+  METRICS_POOL_EXHAUSTED,    // packets lost on an exhausted pool
+  METRICS_SOCKET_DROPPED,    // packets lost for a client not reading, by worker
+  METRICS_N
+};
+
+typedef struct {
+  const char *name;
+  const char *help;
+  enum metrics_type type;
+  const char *label; // nullptr for a single series
+  size_t n;          // number of series
+} metrics_family;
+
+// summary of a series, value is the count of a histogram
+typedef struct {
+  int64_t value;
+  uint64_t sum;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t max;
+} metrics_summary;
+
+// Return the definition of the metric id, nullptr if it does not exist
+const metrics_family *metrics_get_family(unsigned int id);
+
+// add v to the counter or gauge id of the label
+void metrics_add(enum metrics_id id, size_t label, int64_t v=1);
+
+// set the counter or gauge id of the label to v
+void metrics_set(enum metrics_id id, size_t label, int64_t v);
+
+// add the value v to the histogram id of the label
+void metrics_observe(enum metrics_id id, size_t label, uint64_t v);
+
+// reset all the metrics of the label of the family of id, e.g. when a client
+// socket is reused
+void metrics_reset(enum metrics_id id, size_t label);
+
+// Fill s with the summary of the series of the label of the metric id
+// Return false if it does not exist, true otherwise
+bool metrics_summarize(unsigned int id, size_t label, metrics_summary *s);
+
+// Fill s with the summary of all the series of the metric id together
+// Return false if it does not exist, true otherwise
+bool metrics_summarize_all(unsigned int id, metrics_summary *s);
+
+// Return the metrics in the Prometheus text format, the series of labeled
+// metrics that never changed are omitted
+std::string metrics_prometheus();
+
+// Listen on the local socket name (abstract namespace) for the Prometheus
+// text, to be served with metrics_serve when the returned fd is readable
+// Return the file descriptor, -1 in case of failure
+int metrics_listen(const char *name);
+
+// accept a connection on the socket fd of metrics_listen, write it the
+// Prometheus text and close it, without blocking
+void metrics_serve(int fd);
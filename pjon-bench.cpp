@@ -0,0 +1,370 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Load generator and latency benchmark of a running daemon. The report is
+// printed as key=value lines to be compared across daemon versions.
+
+#include "bench.hpp"
+#include "config.h"
+#include "protocol.hpp"
+#include "shm_ring.hpp"
+#include "simulation.hpp"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Outgoing payloads start with BENCH_MAGIC followed by their sending time, so
+// their echoes can be timed too
+#define BENCH_MAGIC "PJB"
+#define BENCH_MAGIC_LENGTH 3
+#define BENCH_STAMPED_LENGTH (BENCH_MAGIC_LENGTH + sizeof(uint64_t))
+
+// Time left to the pending requests after the end of the run
+#define BENCH_DRAIN_TIME 2'000'000 // in us
+
+struct Connection : bench_connection {
+	shm_region *shm;
+	int wake_daemon;
+	int wake;
+};
+
+static struct {
+	unsigned long sent;
+	unsigned long stalled;
+	unsigned long results[4];
+	unsigned long errors;
+	unsigned long ingoing;
+	std::vector<uint32_t> result_latency;
+	std::vector<uint32_t> echo_latency;
+	std::vector<uint32_t> delivery_latency;
+} stats;
+
+static void usage(const char *name);
+static int connect_tcp(unsigned int port);
+static bool send_message(Connection &c, uint8_t dest, size_t size);
+static bool open_shm(Connection &c);
+static void read_ring(Connection &c, bool woken);
+static void handle_packet(bench_connection &c, const proto_packet *p);
+
+int main(int argc, char *argv[])
+{
+	const char *socket_name = SOCKET_FILE;
+	unsigned int connections = 1;
+	double rate = 100;
+	size_t size = 16;
+	std::vector<uint8_t> destinations;
+	double duration = 10;
+	unsigned int window = 1;
+	bool use_shm = false;
+	int type = SOCK_STREAM;
+	unsigned int port = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "S:c:r:s:d:t:w:mqP:h")) != -1) {
+		switch (opt) {
+			case 'S': socket_name = optarg; break;
+			case 'c': connections = strtoul(optarg, nullptr, 0); break;
+			case 'r': rate = strtod(optarg, nullptr); break;
+			case 's': size = strtoul(optarg, nullptr, 0); break;
+			case 't': duration = strtod(optarg, nullptr); break;
+			case 'w': window = strtoul(optarg, nullptr, 0); break;
+			case 'm': use_shm = true; break;
+			case 'q': type = SOCK_SEQPACKET; break;
+			case 'P': port = strtoul(optarg, nullptr, 0); break;
+			case 'd':
+				for (char *id = strtok(optarg, ","); id; id = strtok(nullptr, ","))
+					destinations.push_back(strtoul(id, nullptr, 0));
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (destinations.empty())
+		destinations.push_back(ID_UNO);
+	if (size < BENCH_STAMPED_LENGTH || size > PROTO_DATA_MAX_LENGTH
+			|| !connections || !window || rate <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// the sockets then the eventfds of the rings
+	std::vector<Connection> conns(connections);
+	std::vector<struct pollfd> pfds(2*connections);
+	for (unsigned int i = 0; i < connections; i++) {
+		conns[i].fd = port ? connect_tcp(port)
+			: bench_connect(socket_name, type);
+		conns[i].shm = nullptr;
+		conns[i].wake = -1;
+		if (conns[i].fd < 0) {
+			perror("connect");
+			return EXIT_FAILURE;
+		}
+		if (use_shm && !open_shm(conns[i]))
+			return EXIT_FAILURE;
+		pfds[i] = (struct pollfd){conns[i].fd, POLLIN, 0};
+		pfds[connections+i] = (struct pollfd){conns[i].wake, POLLIN, 0};
+	}
+
+	uint64_t interval = 1'000'000 / rate;
+	uint64_t start = sim_micros();
+	uint64_t end = start + duration * 1'000'000;
+	uint64_t next_send = start;
+	unsigned int next_conn = 0, next_dest = 0;
+
+	while (true) {
+		uint64_t now = sim_micros();
+
+		// pending requests are waited for after the run
+		if (now >= end) {
+			bool pending = false;
+			for (auto &c : conns)
+				pending = pending || !c.in_flight.empty();
+			if (!pending || now >= end + BENCH_DRAIN_TIME)
+				break;
+		}
+
+		for (; now < end && next_send <= now; next_send += interval) {
+			unsigned int i;
+			for (i = 0; i < connections; i++) {
+				Connection &c = conns[(next_conn + i) % connections];
+				if (c.in_flight.size() < window)
+					break;
+			}
+			if (i == connections) {
+				stats.stalled++;
+				continue;
+			}
+			Connection &c = conns[(next_conn + i) % connections];
+			next_conn = (next_conn + i + 1) % connections;
+			if (!send_message(c, destinations[next_dest], size))
+				return EXIT_FAILURE;
+			next_dest = (next_dest + 1) % destinations.size();
+		}
+
+		int timeout = 1;
+		for (auto &c : conns) {
+			if (c.shm && !shm_ring_sleep(&c.shm->replies))
+				timeout = 0;
+		}
+		if (poll(pfds.data(), pfds.size(), timeout) < 0) {
+			perror("poll");
+			return EXIT_FAILURE;
+		}
+		for (unsigned int i = 0; i < connections; i++) {
+			if (pfds[i].revents & (POLLIN | POLLHUP)) {
+				if (!bench_read(conns[i], handle_packet))
+					return EXIT_FAILURE;
+			}
+			if (conns[i].shm)
+				read_ring(conns[i], pfds[connections+i].revents & POLLIN);
+		}
+	}
+
+	double elapsed = (sim_micros() - start) / 1e6;
+	unsigned long completed = 0;
+	for (auto n : stats.results)
+		completed += n;
+	printf("connections=%u\n", connections);
+	printf("transport=%s\n", use_shm ? "shm" : port ? "tcp"
+			: type == SOCK_SEQPACKET ? "seqpacket" : "socket");
+	printf("rate_target=%.1f\n", rate);
+	printf("size=%zu\n", size);
+	printf("duration_s=%.3f\n", elapsed);
+	printf("sent=%lu\n", stats.sent);
+	printf("stalled=%lu\n", stats.stalled);
+	printf("results_success=%lu\n", stats.results[PROTO_OUTGOING_RESULT_SUCCESS]);
+	printf("results_connection_lost=%lu\n",
+			stats.results[PROTO_OUTGOING_RESULT_CONNECTION_LOST]);
+	printf("results_other=%lu\n", completed
+			- stats.results[PROTO_OUTGOING_RESULT_SUCCESS]
+			- stats.results[PROTO_OUTGOING_RESULT_CONNECTION_LOST]);
+	printf("throughput_msg_s=%.1f\n", completed / elapsed);
+	printf("errors=%lu\n", stats.errors);
+	printf("ingoing=%lu\n", stats.ingoing);
+	bench_report("result", stats.result_latency);
+	bench_report("echo", stats.echo_latency);
+	bench_report("delivery", stats.delivery_latency);
+	return EXIT_SUCCESS;
+}
+
+void usage(const char *name)
+{
+	printf("Usage: %s [-S socket] [-c connections] [-r rate] [-s size] "
+			"[-d id,...] [-t duration] [-w window] [-m] [-q] [-P port]\n"
+			"  -S  daemon socket name (default: %s)\n"
+			"  -c  number of concurrent connections (default: 1)\n"
+			"  -r  total outgoing messages per second (default: 100)\n"
+			"  -s  payload size, %zu to %d bytes (default: 16)\n"
+			"  -d  destinations, used in turn (default: 0x%02x)\n"
+			"  -t  duration in seconds (default: 10)\n"
+			"  -w  requests in flight per connection (default: 1)\n"
+			"  -m  exchange the packets through shared memory rings\n"
+			"  -q  connect with SOCK_SEQPACKET (e.g. -S /tmp/PJON.seq)\n"
+			"  -P  connect over TCP to the port of 127.0.0.1 (SOCKET_TCP)\n"
+			"Latencies: result is push to PROTO_HEAD_OUTGOING_RESULT, echo is push "
+			"to the\ningoing echo of the message, delivery is the sending of a "
+			"simulator stamped\nmessage (PJON-simulator -T) to its delivery.\n",
+			name, SOCKET_FILE, BENCH_STAMPED_LENGTH, PROTO_DATA_MAX_LENGTH, ID_UNO);
+}
+
+// as the containers reaching the daemon over the loopback, like bench_connect
+int connect_tcp(unsigned int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+bool send_message(Connection &c, uint8_t dest, size_t size)
+{
+	proto_data data[PROTO_DATA_MAX_LENGTH] = {};
+	uint64_t now = sim_micros();
+	memcpy(data, BENCH_MAGIC, BENCH_MAGIC_LENGTH);
+	memcpy(&data[BENCH_MAGIC_LENGTH], &now, sizeof(now));
+
+	proto_packet p = {};
+	proto_new_packetOutgoingMessage((proto_packetOutgoingMessage*) &p, dest,
+			size, data);
+	// the socket is the fallback of a full ring
+	if (c.shm && shm_ring_push(&c.shm->requests, &p)) {
+		shm_ring_wake(&c.shm->requests, c.wake_daemon);
+	} else if (write(c.fd, &p, sizeof(p)) != sizeof(p)) {
+		perror("write");
+		return false;
+	}
+	c.in_flight.push_back(now);
+	stats.sent++;
+	return true;
+}
+
+// ask for the shared memory transport and wait for its grant, the packets
+// received meanwhile are handled
+bool open_shm(Connection &c)
+{
+	proto_packet p = {};
+	proto_new_packet(&p, PROTO_HEAD_SHM_REQUEST);
+	if (write(c.fd, &p, sizeof(p)) != sizeof(p)) {
+		perror("write");
+		return false;
+	}
+
+	int granted[SHM_FDS] = {-1, -1, -1};
+	while (!c.shm) {
+		int fds[SHM_FDS];
+		ssize_t count = shm_recv(c.fd, &c.buffer[c.n], sizeof(c.buffer) - c.n,
+				fds);
+		if (count <= 0) {
+			fprintf(stderr, "Connection closed by the daemon\n");
+			return false;
+		}
+		if (fds[SHM_FD_REGION] >= 0)
+			memcpy(granted, fds, sizeof(fds));
+		c.n += count;
+
+		size_t i;
+		for (i = 0; i + PROTO_PACKET_SIZE <= c.n; i += PROTO_PACKET_SIZE) {
+			auto *q = (const proto_packet*) &c.buffer[i];
+			if (q->head == PROTO_HEAD_SHM_GRANT) {
+				c.shm = shm_map(granted[SHM_FD_REGION],
+						(const proto_packetShmGrant*) q);
+				close(granted[SHM_FD_REGION]);
+				if (!c.shm) {
+					fprintf(stderr, "Invalid shared memory rings\n");
+					return false;
+				}
+				c.wake_daemon = granted[SHM_FD_DAEMON];
+				c.wake = granted[SHM_FD_CLIENT];
+			} else if (!c.shm && q->head == PROTO_HEAD_ERROR) {
+				fprintf(stderr, "Shared memory transport refused\n");
+				return false;
+			} else {
+				handle_packet(c, q);
+			}
+		}
+		memmove(c.buffer, &c.buffer[i], c.n - i);
+		c.n -= i;
+	}
+	return true;
+}
+
+// woken: the eventfd of the ring is readable and is reset
+void read_ring(Connection &c, bool woken)
+{
+	uint64_t count;
+	proto_packet p;
+	if (woken && read(c.wake, &count, sizeof(count)) < 0)
+		perror("read eventfd");
+	while (shm_ring_pop(&c.shm->replies, &p))
+		handle_packet(c, &p);
+}
+
+void handle_packet(bench_connection &c, const proto_packet *p)
+{
+	uint64_t now = sim_micros();
+
+	if (p->head == PROTO_HEAD_OUTGOING_RESULT) {
+		auto *r = (const proto_packetOutgoingResult*) p;
+		if (c.in_flight.empty()) {
+			stats.errors++;
+			return;
+		}
+		stats.result_latency.push_back(now - c.in_flight.front());
+		c.in_flight.pop_front();
+		stats.results[r->result < 4 ? r->result
+			: PROTO_OUTGOING_RESULT_INTERNAL_ERROR]++;
+		return;
+	}
+
+	if (p->head == PROTO_HEAD_INGOING_MSG) {
+		auto *m = (const proto_packetIngoingMessage*) p;
+		uint64_t stamp;
+		stats.ingoing++;
+		if (m->length < BENCH_STAMPED_LENGTH)
+			return;
+		memcpy(&stamp, &m->data[BENCH_MAGIC_LENGTH], sizeof(stamp));
+		if (memcmp(m->data, BENCH_MAGIC, BENCH_MAGIC_LENGTH) == 0)
+			stats.echo_latency.push_back(now - stamp);
+		else if (memcmp(m->data, SIM_STAMP_MAGIC, SIM_STAMP_MAGIC_LENGTH) == 0)
+			stats.delivery_latency.push_back(now - stamp);
+		return;
+	}
+
+	if (p->head == PROTO_HEAD_ERROR)
+		stats.errors++;
+}
@@ -0,0 +1,484 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Microbenchmarks of the hot paths of the daemon: client buffers, broadcast
+// to the clients, packet encoding and formatting, and the scheduling of the
+// PJON requests on a loopback bus. Each result is printed as a key=value line,
+// the best time per operation over BENCH_ROUNDS rounds in ns.
+
+#include "communication.hpp"
+#include "logger.hpp"
+#include "pool.hpp"
+#include "protocol.hpp"
+#include "socket.hpp"
+#include "socket_buffer.hpp"
+
+#include <atomic>
+#include <fcntl.h>
+#include <functional>
+#include <getopt.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_ROUNDS 5
+#define BENCH_SOCKET "/tmp/PJON-microbench.sock"
+// the echo node of the loopback bus, see the build of communication-loopback.o
+#define BENCH_NODE 0x22
+
+// A round runs n operations and returns its duration in ns
+typedef std::function<uint64_t(unsigned long n)> bench_round;
+
+static void usage(const char *name);
+static uint64_t nanos();
+static void run(const char *name, unsigned long n, bench_round round,
+		bool scaled=true);
+static void bench_input_buffer();
+static void bench_output_queue();
+static void bench_proto();
+static void bench_socket(const std::vector<unsigned int> &clients);
+static void bench_com(const std::vector<unsigned int> &pending);
+static int connect_client(const char *name);
+
+static double scale = 1;
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+			case 's':
+				scale = atof(optarg);
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (scale <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// the warnings of the filling queues would be measured too
+	log_init(0, nullptr);
+	log_set_level(2);
+	if (!pool_init()) {
+		fprintf(stderr, "Failed to allocate the packet pool\n");
+		return EXIT_FAILURE;
+	}
+
+	bench_input_buffer();
+	bench_output_queue();
+	bench_proto();
+	bench_socket({1, 8, 64});
+	bench_com({10, 100, 1'000, 10'000});
+	return EXIT_SUCCESS;
+}
+
+void usage(const char *name)
+{
+	printf("Usage: %s [-s scale]\n"
+			"  -s  factor of the number of operations of each benchmark (1)\n", name);
+}
+
+uint64_t nanos()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1'000'000'000 + t.tv_nsec;
+}
+
+// n is multiplied by the scale unless it is a parameter of the benchmark
+void run(const char *name, unsigned long n, bench_round round, bool scaled)
+{
+	if (scaled)
+		n = n * scale > 1 ? n * scale : 1;
+	uint64_t best = UINT64_MAX;
+	for (unsigned int i = 0; i < BENCH_ROUNDS; i++) {
+		uint64_t t = round(n);
+		if (t < best)
+			best = t;
+	}
+	printf("%s_ns=%.1f\n", name, (double) best / n);
+	fflush(stdout);
+}
+
+// a packet per operation, read from a pipe filled outside of the timing
+void bench_input_buffer()
+{
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	char chunk[SOCKET_INPUT_BUFFER_SIZE];
+	memset(chunk, 0x42, sizeof(chunk));
+	const unsigned long per_chunk = sizeof(chunk) / PROTO_PACKET_SIZE;
+	InputBuffer *buffer = new InputBuffer();
+
+	run("input_buffer_read_file", 100'000, [&](unsigned long n) {
+		uint64_t t = 0;
+		proto_packet p;
+		unsigned long chunks = (n + per_chunk - 1) / per_chunk;
+		for (unsigned long i = 0; i < chunks; i++) {
+			write(fds[1], chunk, sizeof(chunk));
+			uint64_t start = nanos();
+			buffer->read_file(fds[0]);
+			t += nanos() - start;
+			while (buffer->get(&p));
+		}
+		return t * n / (chunks * per_chunk);
+	});
+
+	run("input_buffer_get", 100'000, [&](unsigned long n) {
+		uint64_t t = 0;
+		proto_packet p;
+		unsigned long got = 0;
+		while (got < n) {
+			write(fds[1], chunk, sizeof(chunk));
+			buffer->read_file(fds[0]);
+			uint64_t start = nanos();
+			while (got < n && buffer->get(&p))
+				got++;
+			t += nanos() - start;
+		}
+		while (buffer->get(&p));
+		return t;
+	});
+
+	delete buffer;
+	close(fds[0]);
+	close(fds[1]);
+}
+
+void bench_output_queue()
+{
+	OutputQueue q;
+	proto_packet p;
+	memset(&p, 0, sizeof(p));
+
+	// pushed in bursts, as socket_push(SOCKET_ALL) then socket_send do
+	for (unsigned long burst : {1ul, 64ul, 1024ul}) {
+		char name[64];
+		snprintf(name, sizeof(name), "output_queue_push_pop_burst%lu", burst);
+		run(name, 1'000'000, [&](unsigned long n) {
+			uint64_t start = nanos();
+			for (unsigned long i = 0; i < n; i += burst) {
+				for (unsigned long j = 0; j < burst; j++)
+					q.push(pool_new(p));
+				while (!q.empty())
+					q.pop();
+			}
+			return nanos() - start;
+		});
+	}
+
+	// slots taken and given back from the cache of the thread, and beyond it
+	// through the shared list
+	for (unsigned long burst : {1ul, 1024ul}) {
+		char name[64];
+		static pool_handle handles[1024];
+		snprintf(name, sizeof(name), "pool_alloc_unref_burst%lu", burst);
+		run(name, 1'000'000, [&](unsigned long n) {
+			uint64_t start = nanos();
+			for (unsigned long i = 0; i < n; i += burst) {
+				for (unsigned long j = 0; j < burst; j++)
+					handles[j] = pool_alloc();
+				for (unsigned long j = 0; j < burst; j++)
+					pool_unref(handles[j]);
+			}
+			return nanos() - start;
+		});
+	}
+}
+
+void bench_proto()
+{
+	proto_data data[PROTO_DATA_MAX_LENGTH];
+	memset(data, 'a', sizeof(data));
+	proto_packet p;
+	volatile uint8_t sink = 0;
+
+	run("proto_new_packetOutgoingMessage", 1'000'000, [&](unsigned long n) {
+		uint64_t start = nanos();
+		for (unsigned long i = 0; i < n; i++) {
+			proto_new_packetOutgoingMessage((proto_packetOutgoingMessage*) &p,
+					BENCH_NODE, 32, data);
+			sink = sink + p.head;
+		}
+		return nanos() - start;
+	});
+
+	run("proto_new_packetIngoingMessage", 1'000'000, [&](unsigned long n) {
+		uint64_t start = nanos();
+		for (unsigned long i = 0; i < n; i++) {
+			proto_new_packetIngoingMessage((proto_packetIngoingMessage*) &p,
+					BENCH_NODE, 32, data);
+			sink = sink + p.head;
+		}
+		return nanos() - start;
+	});
+
+	run("proto_new_packetOutgoingResult", 1'000'000, [&](unsigned long n) {
+		uint64_t start = nanos();
+		for (unsigned long i = 0; i < n; i++) {
+			proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p,
+					PROTO_OUTGOING_RESULT_SUCCESS);
+			sink = sink + p.head;
+		}
+		return nanos() - start;
+	});
+
+	proto_new_packetIngoingMessage((proto_packetIngoingMessage*) &p, BENCH_NODE,
+			32, data);
+	run("proto_packet_to_str", 100'000, [&](unsigned long n) {
+		char str[256];
+		uint64_t start = nanos();
+		for (unsigned long i = 0; i < n; i++) {
+			proto_packet_to_str(&p, str, sizeof(str));
+			sink = sink + str[0];
+		}
+		return nanos() - start;
+	});
+}
+
+// the clients are drained by a thread so socket_send never blocks
+void bench_socket(const std::vector<unsigned int> &clients)
+{
+	unsigned int max_clients = 0;
+	for (unsigned int c : clients)
+		max_clients = c > max_clients ? c : max_clients;
+	if (!socket_init(BENCH_SOCKET, max_clients) || !socket_attach()) {
+		fprintf(stderr, "Failed to open %s\n", BENCH_SOCKET);
+		return;
+	}
+	printf("socket_backend=%s\n", socket_get_backend());
+
+	std::vector<int> fds;
+	std::vector<int> socks(max_clients);
+	std::atomic<unsigned int> n_fds(0);
+	std::atomic<bool> running(true);
+	std::atomic<unsigned long> bytes_read(0);
+	unsigned long bytes_sent = 0;
+	fds.reserve(max_clients);
+	std::thread reader([&]() {
+		char buffer[64 * PROTO_PACKET_SIZE];
+		std::vector<struct pollfd> pfds;
+		while (running) {
+			pfds.clear();
+			for (unsigned int i = 0; i < n_fds; i++)
+				pfds.push_back({fds[i], POLLIN, 0});
+			if (poll(pfds.data(), pfds.size(), 10) <= 0)
+				continue;
+			for (auto &pfd : pfds) {
+				if (!(pfd.revents & POLLIN))
+					continue;
+				ssize_t count = read(pfd.fd, buffer, sizeof(buffer));
+				if (count > 0)
+					bytes_read += count;
+			}
+		}
+	});
+
+	proto_packet p;
+	proto_data data[32];
+	memset(data, 'a', sizeof(data));
+	proto_new_packetIngoingMessage((proto_packetIngoingMessage*) &p, BENCH_NODE,
+			sizeof(data), data);
+	// write the output queues until the n packets pushed are written, and
+	// wait for the clients to read them so the next writes do not block (with
+	// io_uring, the writes are submitted and completed by socket_wait)
+	auto send_all = [&](unsigned long n) {
+		bytes_sent += n * sizeof(proto_packet);
+		while (n > 0) {
+			socket_wait(1'000);
+			size_t n_socks = socket_get_clients(socks.data(), socks.size());
+			for (size_t k = 0; k < n_socks; k++) {
+				unsigned long sent = socket_send(socks[k]);
+				n -= sent < n ? sent : n;
+			}
+		}
+		while (bytes_read < bytes_sent)
+			socket_wait(10);
+	};
+
+	for (unsigned int c : clients) {
+		// connect up to c clients, accepted by the loop of the server
+		while (fds.size() < c) {
+			int fd = connect_client(BENCH_SOCKET);
+			if (fd < 0) {
+				perror("connect");
+				running = false;
+				reader.join();
+				return;
+			}
+			fds.push_back(fd);
+			n_fds = fds.size();
+			socket_wait(100'000);
+			proto_packet packets[SOCKET_MAX_RECEPTION];
+			size_t n_socks = socket_get_clients(socks.data(), socks.size());
+			for (size_t k = 0; k < n_socks; k++)
+				socket_receive(socks[k], packets);
+			// the version packet
+			send_all(1);
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "socket_push_all_clients%u", c);
+		run(name, 100'000 / c, [&](unsigned long n) {
+			uint64_t t = 0;
+			for (unsigned long i = 0; i < n; i += 64) {
+				uint64_t start = nanos();
+				unsigned long j = i;
+				for (; j < n && j < i + 64; j++)
+					socket_push(SOCKET_ALL, p);
+				t += nanos() - start;
+				send_all((j - i) * c);
+			}
+			return t;
+		});
+
+		// per packet written to a client
+		snprintf(name, sizeof(name), "socket_send_clients%u", c);
+		run(name, 100'000, [&](unsigned long n) {
+			uint64_t t = 0;
+			unsigned long per_round = 64 * c;
+			for (unsigned long i = 0; i < n; i += per_round) {
+				for (unsigned int j = 0; j < 64; j++)
+					socket_push(SOCKET_ALL, p);
+				socket_wait(1'000);
+				unsigned long sent = 0;
+				uint64_t start = nanos();
+				size_t n_socks = socket_get_clients(socks.data(), socks.size());
+				for (size_t k = 0; k < n_socks; k++)
+					sent += socket_send(socks[k]);
+				t += nanos() - start;
+				bytes_sent += sent * sizeof(proto_packet);
+				send_all(per_round - (sent < per_round ? sent : per_round));
+			}
+			unsigned long rounds = (n + per_round - 1) / per_round;
+			return t * n / (rounds * per_round);
+		});
+	}
+
+	running = false;
+	reader.join();
+	for (int fd : fds)
+		close(fd);
+}
+
+// requests per operation from the push of n pending ones to their results,
+// and messages per operation from the push to the drain of their echoes
+void bench_com(const std::vector<unsigned int> &pending)
+{
+	if (!com_init(0x01) || com_add_bus("loopback", 0) < 0 || !com_connect()) {
+		fprintf(stderr, "Failed to start the loopback bus\n");
+		return;
+	}
+	com_set_time_period(1, 1.4);
+	com_set_max_attempts(40);
+
+	static com_request results[10'000];
+	static com_message reception[COM_MAX_INCOMING_MESSAGES];
+	char payload[32];
+	memset(payload, 'a', sizeof(payload));
+
+	for (unsigned int n_pending : pending) {
+		unsigned long received_total = 0, expected_total = 0;
+		char name[64];
+
+		uint64_t push_best = UINT64_MAX;
+		snprintf(name, sizeof(name), "com_schedule_pending%u", n_pending);
+		run(name, n_pending, [&](unsigned long n) {
+			n = n > 10'000 ? 10'000 : n;
+			uint64_t start = nanos();
+			for (unsigned long r = 0; r < n; r++)
+				com_push(r, BENCH_NODE, sizeof(payload), payload);
+			uint64_t pushed = nanos();
+			if (pushed - start < push_best)
+				push_best = pushed - start;
+
+			unsigned long done = 0, received = 0;
+			uint64_t deadline = pushed + 10'000'000'000;
+			while (done < n && nanos() < deadline) {
+				done += com_send(results, 10'000);
+				received += com_receive(reception, COM_MAX_INCOMING_MESSAGES);
+			}
+			uint64_t t = nanos() - start;
+
+			// echoes still on their way, not timed
+			while (received < n && nanos() < deadline + 100'000'000) {
+				received += com_receive(reception, COM_MAX_INCOMING_MESSAGES);
+				usleep(100);
+			}
+			received_total += received;
+			expected_total += n;
+			return t;
+		}, false);
+		printf("com_push_pending%u_ns=%.1f\n", n_pending,
+				(double) push_best / n_pending);
+		printf("com_receive_pending%u_ratio=%.3f\n", n_pending,
+				(double) received_total / expected_total);
+
+		// the drain alone, once all the echoes are waiting for the server
+		snprintf(name, sizeof(name), "com_receive_drain_pending%u", n_pending);
+		run(name, n_pending, [&](unsigned long n) {
+			n = n > COM_MAX_INCOMING_MESSAGES ? COM_MAX_INCOMING_MESSAGES : n;
+			for (unsigned long r = 0; r < n; r++)
+				com_push(r, BENCH_NODE, sizeof(payload), payload);
+			unsigned long done = 0;
+			uint64_t deadline = nanos() + 10'000'000'000;
+			while (done < n && nanos() < deadline)
+				done += com_send(results, 10'000);
+			// the echoes follow the acknowledgements within a reception window
+			usleep(5 * COM_RECEIVE_TIME);
+
+			uint64_t start = nanos();
+			size_t received = com_receive(reception, COM_MAX_INCOMING_MESSAGES);
+			uint64_t t = nanos() - start;
+			while (com_receive(reception, COM_MAX_INCOMING_MESSAGES) > 0);
+			return received ? t * n / received : t;
+		}, false);
+	}
+	fflush(stdout);
+	com_quit();
+}
+
+int connect_client(const char *name)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path + 1, name, sizeof(addr.sun_path) - 2);
+	socklen_t size = offsetof(struct sockaddr_un, sun_path) + strlen(name) + 1;
+	if (connect(fd, (struct sockaddr*) &addr, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
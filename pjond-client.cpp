@@ -0,0 +1,423 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pjond-client.h"
+#include "protocol.hpp"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static_assert((PJOND_WINDOW & (PJOND_WINDOW - 1)) == 0,
+    "PJOND_WINDOW must be a power of two");
+
+// packets read by one call
+#define INPUT_PACKETS 64
+
+struct pjond_client {
+  int fd;
+  bool connecting;
+  bool failed;
+  char version[PROTO_PACKET_SIZE];
+  proto_session session;
+  proto_seq seq;  // of the last ingoing message delivered
+  bool resuming;  // the live messages come again with the replay
+
+  pjond_result_cb on_result;
+  pjond_message_cb on_message;
+  pjond_event_cb on_event;
+  void *user;
+
+  // messages in the order they were sent, the n_slots ones from head, of which
+  // n_flight wait for their result
+  struct {
+    uint16_t tag;
+    bool pending;
+    void *arg;
+  } flight[PJOND_WINDOW];
+  unsigned int head, n_slots, n_flight;
+  uint16_t next_tag;
+
+  // queued packets, from output_off to output_len, the messages in flight and
+  // a session request
+  char output[(PJOND_WINDOW + 1) * PROTO_PACKET_SIZE];
+  size_t output_off, output_len;
+
+  char input[INPUT_PACKETS * PROTO_PACKET_SIZE];
+  size_t input_len;
+};
+
+static pjond_client *new_client(int fd, bool connecting);
+static void *queue_packet(pjond_client *c);
+static int fail(pjond_client *c, int error);
+static int read_packets(pjond_client *c);
+static void handle_packet(pjond_client *c, const proto_packet *p);
+static void handle_result(pjond_client *c, const proto_packetOutgoingResult *r);
+
+pjond_client *pjond_connect(const char *name)
+{
+  int fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return nullptr;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_LOCAL;
+  strncpy(addr.sun_path+1, name, sizeof(addr.sun_path)-2);
+  socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(name) + 1;
+  // a local connection completes at once or fails (EAGAIN: backlog full)
+  if (connect(fd, (struct sockaddr*) &addr, len) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return nullptr;
+  }
+  return new_client(fd, false);
+}
+
+pjond_client *pjond_connect_tcp(const char *host, uint16_t port)
+{
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  if (getaddrinfo(host, service, &hints, &res) != 0) {
+    errno = EHOSTUNREACH;
+    return nullptr;
+  }
+
+  int fd = socket(res->ai_family,
+      res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+  if (fd < 0) {
+    freeaddrinfo(res);
+    return nullptr;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  bool connecting = false;
+  if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+    if (errno != EINPROGRESS) {
+      int error = errno;
+      freeaddrinfo(res);
+      close(fd);
+      errno = error;
+      return nullptr;
+    }
+    connecting = true;
+  }
+  freeaddrinfo(res);
+  return new_client(fd, connecting);
+}
+
+void pjond_set_callbacks(pjond_client *c, pjond_result_cb on_result,
+    pjond_message_cb on_message, pjond_event_cb on_event, void *user)
+{
+  c->on_result = on_result;
+  c->on_message = on_message;
+  c->on_event = on_event;
+  c->user = user;
+}
+
+int pjond_fd(const pjond_client *c)
+{
+  return c->fd;
+}
+
+short pjond_events(const pjond_client *c)
+{
+  if (c->connecting || c->output_off < c->output_len)
+    return POLLIN | POLLOUT;
+  return POLLIN;
+}
+
+int pjond_send(pjond_client *c, uint8_t dest, const void *data, size_t n,
+    void *arg)
+{
+  if (c->failed) {
+    errno = EPIPE;
+    return -1;
+  }
+  if (n > PROTO_DATA_MAX_LENGTH) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (c->n_slots == PJOND_WINDOW) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  auto *p = (proto_packetOutgoingMessage*) queue_packet(c);
+  if (!p) {
+    errno = EAGAIN;
+    return -1;
+  }
+  p->head = PROTO_HEAD_OUTGOING_MSG;
+  p->dest = dest;
+  p->length = n;
+  memcpy(p->data, data, n);
+  p->tag = c->next_tag++;
+
+  unsigned int i = (c->head + c->n_slots) & (PJOND_WINDOW - 1);
+  c->flight[i].tag = p->tag;
+  c->flight[i].pending = true;
+  c->flight[i].arg = arg;
+  c->n_slots++;
+  c->n_flight++;
+  return p->tag;
+}
+
+int pjond_resume(pjond_client *c, const pjond_session *s)
+{
+  if (c->failed) {
+    errno = EPIPE;
+    return -1;
+  }
+  auto *p = (proto_packetSessionResume*) queue_packet(c);
+  if (!p) {
+    errno = EAGAIN;
+    return -1;
+  }
+  p->head = PROTO_HEAD_SESSION_RESUME;
+  if (s) {
+    p->session = s->id;
+    p->seq = s->seq;
+    c->resuming = s->id != 0;
+    if (!c->n_slots)
+      c->next_tag = s->tag;
+  }
+  return 0;
+}
+
+pjond_session pjond_get_session(const pjond_client *c)
+{
+  return {c->session, c->seq, c->next_tag};
+}
+
+int pjond_flush(pjond_client *c)
+{
+  if (c->failed) {
+    errno = EPIPE;
+    return -1;
+  }
+  while (!c->connecting && c->output_off < c->output_len) {
+    ssize_t count = send(c->fd, c->output + c->output_off,
+        c->output_len - c->output_off, MSG_NOSIGNAL);
+    if (count < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      if (errno == EINTR)
+        continue;
+      return fail(c, errno);
+    }
+    c->output_off += count;
+  }
+  return 0;
+}
+
+int pjond_process(pjond_client *c, short revents)
+{
+  if (c->failed) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  if (c->connecting && revents & (POLLOUT | POLLERR | POLLHUP)) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+      return fail(c, errno);
+    if (error)
+      return fail(c, error);
+    c->connecting = false;
+  }
+
+  if (revents & (POLLIN | POLLHUP | POLLERR) && read_packets(c) < 0)
+    return -1;
+  return pjond_flush(c);
+}
+
+unsigned int pjond_in_flight(const pjond_client *c)
+{
+  return c->n_flight;
+}
+
+const char *pjond_version(const pjond_client *c)
+{
+  return c->version;
+}
+
+void pjond_close(pjond_client *c)
+{
+  close(c->fd);
+  free(c);
+}
+
+pjond_client *new_client(int fd, bool connecting)
+{
+  auto *c = (pjond_client*) calloc(1, sizeof(pjond_client));
+  if (!c) {
+    close(fd);
+    errno = ENOMEM;
+    return nullptr;
+  }
+  c->fd = fd;
+  c->connecting = connecting;
+  return c;
+}
+
+// Return a zeroed packet appended to the queue of c, or nullptr if it is full
+void *queue_packet(pjond_client *c)
+{
+  // the written packets are dropped once the queue is drained
+  if (c->output_off == c->output_len) {
+    c->output_off = c->output_len = 0;
+  } else if (c->output_len == sizeof(c->output)) {
+    memmove(c->output, c->output + c->output_off,
+        c->output_len - c->output_off);
+    c->output_len -= c->output_off;
+    c->output_off = 0;
+  }
+  if (c->output_len == sizeof(c->output))
+    return nullptr;
+
+  void *p = c->output + c->output_len;
+  memset(p, 0, PROTO_PACKET_SIZE);
+  c->output_len += PROTO_PACKET_SIZE;
+  return p;
+}
+
+// the connection is unusable from now on
+// Return -1 with errno set to error
+int fail(pjond_client *c, int error)
+{
+  c->failed = true;
+  errno = error;
+  return -1;
+}
+
+// read the available packets of the daemon and deliver them
+// Return 0, or -1 with errno set in case of failure
+int read_packets(pjond_client *c)
+{
+  while (true) {
+    ssize_t count = recv(c->fd, c->input + c->input_len,
+        sizeof(c->input) - c->input_len, 0);
+    if (count == 0)
+      return fail(c, EPIPE);
+    if (count < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      if (errno == EINTR)
+        continue;
+      return fail(c, errno);
+    }
+    c->input_len += count;
+
+    size_t n = c->input_len / PROTO_PACKET_SIZE;
+    for (size_t i = 0; i < n && !c->failed; i++) {
+      proto_packet p;
+      memcpy(&p, c->input + i * PROTO_PACKET_SIZE, sizeof(p));
+      handle_packet(c, &p);
+    }
+    if (c->failed)
+      return -1;
+    c->input_len -= n * PROTO_PACKET_SIZE;
+    memmove(c->input, c->input + n * PROTO_PACKET_SIZE, c->input_len);
+  }
+}
+
+void handle_packet(pjond_client *c, const proto_packet *p)
+{
+  switch (p->head) {
+    case PROTO_HEAD_VERSION: {
+      auto *v = (const proto_packetVersion*) p;
+      memcpy(c->version, v->version, sizeof(v->version));
+      c->version[sizeof(v->version)] = '\0';
+      break;
+    }
+    case PROTO_HEAD_INGOING_MSG: {
+      auto *m = (const proto_packetIngoingMessage*) p;
+      size_t n = m->length <= PROTO_DATA_MAX_LENGTH ? m->length : 0;
+      // live before the replay, or already delivered
+      if (c->resuming || (c->session && m->seq && m->seq <= c->seq))
+        break;
+      if (m->seq)
+        c->seq = m->seq;
+      if (c->on_message)
+        c->on_message(c->user, m->src, m->data, n);
+      break;
+    }
+    case PROTO_HEAD_SESSION: {
+      auto *s = (const proto_packetSession*) p;
+      c->session = s->session;
+      c->seq = s->seq - 1;
+      c->resuming = false;
+      if (c->on_event)
+        c->on_event(c->user, s->head, s->resumed);
+      break;
+    }
+    case PROTO_HEAD_OUTGOING_RESULT:
+      handle_result(c, (const proto_packetOutgoingResult*) p);
+      break;
+    case PROTO_HEAD_INFO:
+    case PROTO_HEAD_WARN:
+    case PROTO_HEAD_ERROR: {
+      auto *e = (const proto_packetError*) p;
+      if (c->on_event)
+        c->on_event(c->user, e->head, e->code);
+      break;
+    }
+    default: // e.g. the replies to the requests of other tools
+      break;
+  }
+}
+
+// the results usually match the oldest message in flight, but a message
+// failed at once by the daemon (full queue) overtakes the previous ones
+void handle_result(pjond_client *c, const proto_packetOutgoingResult *r)
+{
+  unsigned int i;
+  for (i = 0; i < c->n_slots; i++) {
+    unsigned int j = (c->head + i) & (PJOND_WINDOW - 1);
+    if (c->flight[j].pending && c->flight[j].tag == r->tag)
+      break;
+  }
+  if (i == c->n_slots) { // sent by the connection before a resume
+    if (c->on_result)
+      c->on_result(c->user, r->tag, r->result, nullptr);
+    return;
+  }
+
+  unsigned int j = (c->head + i) & (PJOND_WINDOW - 1);
+  c->flight[j].pending = false;
+  c->n_flight--;
+  while (c->n_slots && !c->flight[c->head].pending) {
+    c->head = (c->head + 1) & (PJOND_WINDOW - 1);
+    c->n_slots--;
+  }
+  if (c->on_result)
+    c->on_result(c->user, r->tag, r->result, c->flight[j].arg);
+}
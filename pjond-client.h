@@ -0,0 +1,128 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Client library of the daemon: the framing of protocol.hpp behind a
+// non-blocking connection to be driven by the event loop of the application.
+// The outgoing messages are queued by pjond_send and written together by
+// pjond_flush (or pjond_process once the socket is writable), several of
+// them being in flight at once, their results coming back with their tag.
+// Results, ingoing messages and the other packets of the daemon are delivered
+// to callbacks from pjond_process, which may send but not close the client.
+//
+//   pjond_client *c = pjond_connect("/tmp/PJON.sock");
+//   pjond_set_callbacks(c, on_result, on_message, NULL, app);
+//   pjond_send(c, 0x22, "ping", 4, NULL);
+//   struct pollfd pfd = {pjond_fd(c), pjond_events(c), 0};
+//   while (poll(&pfd, 1, -1) >= 0 && pjond_process(c, pfd.revents) == 0)
+//     pfd.events = pjond_events(c);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Messages in flight of a client, a power of two
+#ifndef PJOND_WINDOW
+#define PJOND_WINDOW 64
+#endif
+
+typedef struct pjond_client pjond_client;
+
+// what a later connection needs to resume the session of a client
+typedef struct {
+  uint64_t id;  // 0 for no session
+  uint32_t seq; // of the last ingoing message delivered
+  uint16_t tag; // next tag, so the results left behind are told apart
+} pjond_session;
+
+// result (PROTO_OUTGOING_RESULT_*) of the message of tag given by pjond_send,
+// arg being the one given to it (NULL for a message sent before a resume)
+typedef void (*pjond_result_cb)(void *user, uint16_t tag, uint16_t result,
+    void *arg);
+// message of n bytes of data received from the PJON id src
+typedef void (*pjond_message_cb)(void *user, uint8_t src, const void *data,
+    size_t n);
+// any other packet of the daemon (PROTO_HEAD_INFO, _WARN, _ERROR) with its
+// code, or PROTO_HEAD_SESSION with 1 if the session was resumed and 0 if it is
+// a new one
+typedef void (*pjond_event_cb)(void *user, uint8_t head, uint16_t code);
+
+// Start to connect to the daemon on the local socket name (abstract
+// namespace, e.g. /tmp/PJON.sock)
+// Return NULL in case of failure, with errno set
+pjond_client *pjond_connect(const char *name);
+
+// Start to connect to the daemon over TCP (SOCKET_TCP) on host and port, the
+// connection being completed by pjond_process
+// Return NULL in case of failure, with errno set
+pjond_client *pjond_connect_tcp(const char *host, uint16_t port);
+
+// Set the callbacks of c, any of them can be NULL, user is given back to
+// them
+void pjond_set_callbacks(pjond_client *c, pjond_result_cb on_result,
+    pjond_message_cb on_message, pjond_event_cb on_event, void *user);
+
+// Return the file descriptor of c to be watched by the event loop
+int pjond_fd(const pjond_client *c);
+
+// Return the poll events to watch the file descriptor of c for: POLLIN, and
+// POLLOUT while connecting or with queued packets
+short pjond_events(const pjond_client *c);
+
+// Queue a message of n bytes of data (at most 50) to the PJON id dest, arg is
+// given back to the result callback
+// Return the tag of the message, or -1 with errno set to EAGAIN when
+// PJOND_WINDOW messages are in flight, EMSGSIZE when data is too long or
+// EPIPE once c failed
+int pjond_send(pjond_client *c, uint8_t dest, const void *data, size_t n,
+    void *arg);
+
+// Write the queued packets of c in as few system calls as possible, those the
+// socket cannot take yet being kept for the next call
+// Return 0, or -1 with errno set in case of failure
+int pjond_flush(pjond_client *c);
+
+// Handle the poll events revents of the file descriptor of c: complete the
+// connection, read and deliver the packets of the daemon, and flush
+// Return 0, or -1 with errno set when the connection failed or was closed (by
+// the daemon: EPIPE)
+int pjond_process(pjond_client *c, short revents);
+
+// Ask for the session s of a previous connection to be resumed on c (a new
+// one if s is NULL or unknown to the daemon): the ingoing messages it missed
+// and the results finished meanwhile are delivered, the messages already
+// delivered before being skipped
+// Return 0, or -1 with errno set to EAGAIN when the queue is full or EPIPE
+// once c failed
+int pjond_resume(pjond_client *c, const pjond_session *s);
+
+// Return the session of c, to be given to pjond_resume by a later connection
+pjond_session pjond_get_session(const pjond_client *c);
+
+// Return the number of messages of c waiting for their result
+unsigned int pjond_in_flight(const pjond_client *c);
+
+// Return the protocol version of the daemon, empty until it is received
+const char *pjond_version(const pjond_client *c);
+
+// Close the connection and free c, the messages in flight are forgotten
+void pjond_close(pjond_client *c);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,121 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pool.hpp"
+#include "logger.hpp"
+
+#include <sys/mman.h>
+
+proto_packet *pool_slots = nullptr;
+pool_meta *pool_metas = nullptr;
+static size_t n_slots = 0;
+static size_t footprint = 0;
+
+// the first free slot in the low half, a count of the updates in the high
+// half so that a slot taken and given back meanwhile fails the exchange
+static std::atomic<uint64_t> free_head;
+static std::atomic<size_t> n_free;
+
+bool pool_init(size_t n)
+{
+  if (pool_slots || n == 0 || n >= POOL_NONE)
+    return false;
+
+  // populated now, the daemon does not take more memory for its packets
+  size_t slots_size = n * sizeof(proto_packet);
+  size_t size = slots_size + n * sizeof(pool_meta);
+  void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (m == MAP_FAILED) {
+    log_perror("pool", "Failed to allocate %zu slots", n);
+    return false;
+  }
+  pool_slots = (proto_packet*) m;
+  pool_metas = (pool_meta*) ((char*) m + slots_size);
+  for (size_t i = 0; i < n; i++) {
+    pool_metas[i].refs.store(0, std::memory_order_relaxed);
+    pool_metas[i].next.store(i + 1 < n ? i + 1 : POOL_NONE,
+        std::memory_order_relaxed);
+  }
+  n_slots = n;
+  footprint = size;
+  n_free.store(n, std::memory_order_relaxed);
+  free_head.store(0, std::memory_order_release);
+  log_info("pool", "%zu slots of %zu bytes, %zu KiB", n, sizeof(proto_packet),
+      size / 1024);
+  return true;
+}
+
+// the chain at the head of the shared list is taken by a single exchange, a
+// link read from a slot taken meanwhile fails it
+bool pool_refill()
+{
+  pool_cache &c = pool_thread_cache;
+  uint64_t head = free_head.load(std::memory_order_acquire);
+  size_t n;
+  uint64_t next;
+  do {
+    n = 0;
+    pool_handle h = (pool_handle) head;
+    while (h != POOL_NONE && n < POOL_CACHE_SIZE / 2) {
+      c.handles[n++] = h;
+      h = pool_metas[h].next.load(std::memory_order_relaxed);
+    }
+    if (n == 0)
+      return false;
+    next = ((head >> 32) + 1) << 32 | h;
+  } while (!free_head.compare_exchange_weak(head, next,
+        std::memory_order_acquire, std::memory_order_acquire));
+  c.n = n;
+  n_free.fetch_sub(n, std::memory_order_relaxed);
+  return true;
+}
+
+void pool_spill()
+{
+  pool_cache &c = pool_thread_cache;
+  size_t n = POOL_CACHE_SIZE / 2;
+  for (size_t i = 0; i + 1 < n; i++)
+    pool_metas[c.handles[i]].next.store(c.handles[i + 1],
+        std::memory_order_relaxed);
+
+  uint64_t head = free_head.load(std::memory_order_relaxed);
+  uint64_t next;
+  do {
+    pool_metas[c.handles[n - 1]].next.store((pool_handle) head,
+        std::memory_order_relaxed);
+    next = ((head >> 32) + 1) << 32 | c.handles[0];
+  } while (!free_head.compare_exchange_weak(head, next,
+        std::memory_order_release, std::memory_order_relaxed));
+  n_free.fetch_add(n, std::memory_order_relaxed);
+
+  for (size_t i = n; i < POOL_CACHE_SIZE; i++)
+    c.handles[i - n] = c.handles[i];
+  c.n -= n;
+}
+
+size_t pool_get_size()
+{
+  return n_slots;
+}
+
+size_t pool_get_used()
+{
+  return n_slots - n_free.load(std::memory_order_relaxed);
+}
+
+size_t pool_get_footprint()
+{
+  return footprint;
+}
@@ -0,0 +1,131 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "protocol.hpp"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pool of the packets queued by the daemon: a table of slots of one packet
+// allocated once by pool_init, its footprint not changing afterwards. The
+// packets are handed between the queues of the threads by handle and counted
+// references, so an ingoing message is written once for the replay, the
+// broadcasts and the output queues of all the clients. The free slots are
+// linked by index in a list shared by the threads, each thread keeping a cache
+// of them to take and give back slots without touching the shared list.
+
+// Slots of the pool
+#ifndef POOL_SIZE
+#define POOL_SIZE 65536
+#endif
+
+// Free slots kept by a thread, half of them being moved at once from and to
+// the shared list
+#ifndef POOL_CACHE_SIZE
+#define POOL_CACHE_SIZE 64
+#endif
+
+typedef uint32_t pool_handle;
+
+#define POOL_NONE UINT32_MAX
+
+// the references and the link in the free list of a slot, apart from the
+// packets so that a slot is exactly a packet
+typedef struct {
+  std::atomic<uint32_t> refs;
+  std::atomic<uint32_t> next;
+} pool_meta;
+
+// the free slots of a thread
+typedef struct {
+  pool_handle handles[POOL_CACHE_SIZE];
+  size_t n;
+} pool_cache;
+
+extern proto_packet *pool_slots;
+extern pool_meta *pool_metas;
+inline thread_local pool_cache pool_thread_cache = {};
+
+// Move half of a cache from the shared list to the cache of the thread
+// Return false if the pool is exhausted
+bool pool_refill();
+
+// Move the older half of the full cache of the thread to the shared list
+void pool_spill();
+
+// Allocate the n slots of the pool, before any other function
+// Return false in case of failure, true otherwise
+bool pool_init(size_t n=POOL_SIZE);
+
+// Take a free slot with one reference
+// Return its handle, POOL_NONE if the pool is exhausted
+inline pool_handle pool_alloc()
+{
+  pool_cache &c = pool_thread_cache;
+  if (c.n == 0 && !pool_refill())
+    return POOL_NONE;
+  pool_handle h = c.handles[--c.n];
+  pool_metas[h].refs.store(1, std::memory_order_relaxed);
+  return h;
+}
+
+// Take a free slot with one reference holding a copy of the packet p
+// Return its handle, POOL_NONE if the pool is exhausted
+inline pool_handle pool_new(const proto_packet &p)
+{
+  pool_handle h = pool_alloc();
+  if (h != POOL_NONE)
+    pool_slots[h] = p;
+  return h;
+}
+
+// Return the packet of the slot h
+inline proto_packet *pool_get(pool_handle h)
+{
+  return &pool_slots[h];
+}
+
+// Add n references to the slot h
+inline void pool_ref(pool_handle h, uint32_t n=1)
+{
+  pool_metas[h].refs.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Remove a reference to the slot h, the last one freeing it
+inline void pool_unref(pool_handle h)
+{
+  // the only owner cannot be joined by another one, it frees the slot without
+  // a read-modify-write, the writes of the previous owners happen before the
+  // reuse
+  if (pool_metas[h].refs.load(std::memory_order_acquire) != 1
+      && pool_metas[h].refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+  pool_cache &c = pool_thread_cache;
+  if (c.n == POOL_CACHE_SIZE)
+    pool_spill();
+  c.handles[c.n++] = h;
+}
+
+// Return the number of slots
+size_t pool_get_size();
+
+// Return the number of slots out of the shared list, in use or in the cache
+// of a thread
+size_t pool_get_used();
+
+// Return the size in bytes of the memory of the pool
+size_t pool_get_footprint();
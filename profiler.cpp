@@ -0,0 +1,209 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profiler.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+static_assert((PROF_RING_SIZE & (PROF_RING_SIZE-1)) == 0,
+    "PROF_RING_SIZE must be a power of two");
+static_assert(PROF_PHASES <= 16, "The phase_ns metric has 16 labels");
+
+typedef struct {
+  uint64_t start; // in ns
+  uint32_t duration; // in ns
+  uint16_t arg;
+  uint8_t phase;
+} prof_event;
+
+// written by its thread only, head is the number of events ever recorded
+typedef struct {
+  std::atomic<uint64_t> head;
+  pid_t tid;
+  char name[32];
+  prof_event events[PROF_RING_SIZE];
+} prof_ring;
+
+static prof_ring *ring();
+static size_t copy(prof_ring *r, std::vector<prof_event> &events);
+static void request_dump(int sig);
+
+// in the order of prof_phase
+static const char *phase_names[PROF_PHASES] = {
+  "socket_wait",
+  "socket_receive",
+  "socket_send",
+  "connect",
+  "com_receive",
+  "com_send",
+  "send_packet",
+  "server_wait",
+  "server_requests",
+};
+
+static prof_ring rings[PROF_MAX_THREADS];
+static std::atomic<unsigned int> rings_n(0);
+static thread_local prof_ring *thread_ring = nullptr;
+static volatile sig_atomic_t dump_requested = 0;
+static const char *dump_path = "/tmp/PJON-profile";
+
+void prof_set_thread_name(const char *name)
+{
+  prof_ring *r = ring();
+  if (r)
+    snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+void prof_init(const char *path)
+{
+  dump_path = path;
+  signal(SIGUSR1, request_dump);
+}
+
+void prof_poll()
+{
+  if (!dump_requested)
+    return;
+  dump_requested = 0;
+  prof_dump();
+}
+
+void prof_record(enum prof_phase phase, uint64_t start, uint64_t end,
+    uint32_t arg)
+{
+  uint64_t duration = end - start;
+  metrics_observe(METRICS_PHASE_TIME, phase, duration);
+
+  prof_ring *r = ring();
+  if (!r)
+    return;
+  uint64_t head = r->head.load(std::memory_order_relaxed);
+  prof_event &e = r->events[head & (PROF_RING_SIZE-1)];
+  e.start = start;
+  e.duration = std::min(duration, (uint64_t) UINT32_MAX);
+  e.arg = arg;
+  e.phase = phase;
+  r->head.store(head + 1, std::memory_order_release);
+}
+
+bool prof_dump()
+{
+  char path[256];
+  snprintf(path, sizeof(path), "%s-%lld.json", dump_path,
+      (long long) time(nullptr));
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    log_perror("profiler", "Failed to open %s", path);
+    return false;
+  }
+
+  std::vector<uint32_t> durations[PROF_PHASES];
+  std::vector<prof_event> events;
+  pid_t pid = getpid();
+  bool first = true;
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  unsigned int n = std::min(rings_n.load(), (unsigned int) PROF_MAX_THREADS);
+  for (unsigned int i = 0; i < n; i++) {
+    prof_ring *r = &rings[i];
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", pid,
+        r->tid, r->name);
+    first = false;
+
+    copy(r, events);
+    for (auto &e : events) {
+      if (e.phase >= PROF_PHASES)
+        continue;
+      durations[e.phase].push_back(e.duration);
+      // timestamps and durations in us
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+          "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+          phase_names[e.phase], r->name, e.start / 1e3, e.duration / 1e3, pid,
+          r->tid);
+      if (e.phase == PROF_SEND_PACKET)
+        fprintf(f, ",\"args\":{\"dest\":%u}", e.arg);
+      fprintf(f, "}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  bool written = !ferror(f);
+  if (fclose(f) != 0 || !written) {
+    log_perror("profiler", "Failed to write %s", path);
+    return false;
+  }
+
+  log_warn("profiler", "Profile dumped to %s", path);
+  for (unsigned int p = 0; p < PROF_PHASES; p++) {
+    auto &d = durations[p];
+    if (d.empty())
+      continue;
+    std::sort(d.begin(), d.end());
+    log_warn("profiler", "%-14s n=%zu p50=%uns p99=%uns max=%uns",
+        phase_names[p], d.size(), d[d.size() / 2], d[d.size() * 99 / 100],
+        d.back());
+  }
+  return true;
+}
+
+// the ring of the calling thread, nullptr once PROF_MAX_THREADS threads
+// recorded
+prof_ring *ring()
+{
+  if (thread_ring)
+    return thread_ring;
+  unsigned int i = rings_n.fetch_add(1);
+  if (i >= PROF_MAX_THREADS)
+    return nullptr;
+  thread_ring = &rings[i];
+  thread_ring->tid = syscall(SYS_gettid);
+  snprintf(thread_ring->name, sizeof(thread_ring->name), "thread %d",
+      thread_ring->tid);
+  return thread_ring;
+}
+
+// copy the events of a ring being written, the ones its thread may have
+// overwritten during the copy are left out
+size_t copy(prof_ring *r, std::vector<prof_event> &events)
+{
+  uint64_t head = r->head.load(std::memory_order_acquire);
+  uint64_t first = head > PROF_RING_SIZE ? head - PROF_RING_SIZE : 0;
+  events.clear();
+  for (uint64_t i = first; i < head; i++)
+    events.push_back(r->events[i & (PROF_RING_SIZE-1)]);
+
+  uint64_t after = r->head.load(std::memory_order_acquire);
+  size_t overwritten = 0;
+  if (after > PROF_RING_SIZE && after - PROF_RING_SIZE > first)
+    overwritten = std::min<uint64_t>(after - PROF_RING_SIZE - first,
+        events.size());
+  events.erase(events.begin(), events.begin() + overwritten);
+  return events.size();
+}
+
+void request_dump(int sig)
+{
+  (void) sig;
+  dump_requested = 1;
+}
@@ -0,0 +1,102 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Profiler of the phases of the server loop and of the bus threads. Each
+// thread records its phases in its own ring of the last PROF_RING_SIZE
+// events, and their durations in the phase_ns histogram of the metrics. The
+// rings are dumped in the Chrome trace event format (chrome://tracing or
+// Perfetto) on SIGUSR1 or on a PROTO_HEAD_PROFILE_DUMP frame.
+
+// Number of events kept by each thread, must be a power of two
+#ifndef PROF_RING_SIZE
+#	define PROF_RING_SIZE 4096
+#endif
+
+#ifndef PROF_MAX_THREADS
+#	define PROF_MAX_THREADS 32
+#endif
+
+// the phases are labels of the phase_ns metric, new ones go at the end
+enum prof_phase : uint8_t {
+  PROF_SOCKET_WAIT,
+  PROF_SOCKET_RECEIVE,
+  PROF_SOCKET_SEND,
+  PROF_CONNECT,
+  PROF_COM_RECEIVE,
+  PROF_COM_SEND,
+  PROF_SEND_PACKET,
+  PROF_SERVER_WAIT,
+  PROF_SERVER_REQUESTS,
+  PROF_PHASES
+};
+
+// name the calling thread in the dumps
+void prof_set_thread_name(const char *name);
+
+// dump to dump_path-<time>.json on SIGUSR1, the dump is written by the next
+// call to prof_poll
+void prof_init(const char *dump_path);
+
+// dump if SIGUSR1 was received since the last call, called from the server
+// loop
+void prof_poll();
+
+// write the events of all the threads to dump_path-<time>.json and log
+// the statistics of the phases over them
+// Return false in case of failure, true otherwise
+bool prof_dump();
+
+// record a phase of the calling thread, arg is shown in the dumps (e.g. the
+// destination of a packet)
+void prof_record(enum prof_phase phase, uint64_t start, uint64_t end,
+    uint32_t arg=0);
+
+inline uint64_t prof_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1'000'000'000 + t.tv_nsec;
+}
+
+class ProfScope {
+
+  public:
+
+    ProfScope(enum prof_phase phase, uint32_t arg=0):
+      phase(phase), arg(arg), start(prof_now()) {}
+
+    ~ProfScope()
+    {
+      prof_record(this->phase, this->start, prof_now(), this->arg);
+    }
+
+  private:
+
+    enum prof_phase phase;
+    uint32_t arg;
+    uint64_t start;
+
+};
+
+#define PROF_CONCAT_(a, b) a##b
+#define PROF_CONCAT(a, b) PROF_CONCAT_(a, b)
+
+// profile the rest of the enclosing block as phase
+#define PROF_SCOPE(...) \
+  ProfScope PROF_CONCAT(prof_scope_, __LINE__)(__VA_ARGS__)
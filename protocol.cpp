@@ -14,6 +14,7 @@
 
 #include "protocol.hpp"
 
+#include <stdio.h>
 #include <string.h>
 
 proto_packet proto_read_copy(const char *buffer)
@@ -67,10 +68,12 @@ bool proto_new_packetError(proto_packetError *p, proto_code code)
 }
 
 bool proto_new_packetIngoingMessage(proto_packetIngoingMessage *p,
-				  proto_id src, proto_dataLength length, const proto_data* data)
+				  proto_id src, proto_dataLength length, const proto_data* data,
+				  proto_seq seq)
 {
   p->head = PROTO_HEAD_INGOING_MSG;
   p->src = src;
+  p->seq = seq;
   p->length = 0;
   if (length > PROTO_DATA_MAX_LENGTH)
     return false;
@@ -80,10 +83,12 @@ bool proto_new_packetIngoingMessage(proto_packetIngoingMessage *p,
 }
 
 bool proto_new_packetOutgoingMessage(proto_packetOutgoingMessage *p,
-				 proto_id dest, proto_dataLength length, const proto_data* data)
+				 proto_id dest, proto_dataLength length, const proto_data* data,
+				 proto_tag tag)
 {
   p->head = PROTO_HEAD_OUTGOING_MSG;
   p->dest = dest;
+  p->tag = tag;
   p->length = 0;
   if (length > PROTO_DATA_MAX_LENGTH)
     return false;
@@ -93,11 +98,234 @@ bool proto_new_packetOutgoingMessage(proto_packetOutgoingMessage *p,
 }
 
 bool proto_new_packetOutgoingResult(proto_packetOutgoingResult *p,
-									proto_outgoingResult result)
+									proto_outgoingResult result, proto_tag tag)
 {
   p->head = PROTO_HEAD_OUTGOING_RESULT;
   p->result = result;
+  p->tag = tag;
   return true;
 }
 
+bool proto_new_packetForwardRule(proto_packetForwardRule *p,
+				proto_forwardAction action, proto_id src, proto_id dest,
+				uint8_t prefix_length, const proto_data* prefix,
+				uint8_t template_length, const proto_data* tmpl)
+{
+  p->head = PROTO_HEAD_FORWARD_RULE;
+  p->action = action;
+  p->src = src;
+  p->dest = dest;
+  p->prefix_length = 0;
+  p->template_length = 0;
+  if (prefix_length > PROTO_FORWARD_PREFIX_MAX_LENGTH
+      || template_length > PROTO_FORWARD_TEMPLATE_MAX_LENGTH)
+    return false;
+  p->prefix_length = prefix_length;
+  p->template_length = template_length;
+  memcpy(p->prefix, prefix, prefix_length);
+  memcpy(p->tmpl, tmpl, template_length);
+  return true;
+}
 
+bool proto_new_packetStatsRequest(proto_packetStatsRequest *p,
+				proto_metric metric, proto_label label)
+{
+  memset(p, 0, sizeof(*p));
+  p->head = PROTO_HEAD_STATS_REQUEST;
+  p->metric = metric;
+  p->label = label;
+  return true;
+}
+
+// the values are set by the caller
+bool proto_new_packetStats(proto_packetStats *p, proto_metric metric,
+				proto_label label, uint8_t type, uint8_t n_metrics, const char *name)
+{
+  memset(p, 0, sizeof(*p));
+  p->head = PROTO_HEAD_STATS;
+  p->metric = metric;
+  p->label = label;
+  p->type = type;
+  p->n_metrics = n_metrics;
+  strncpy(p->name, name, PROTO_STATS_NAME_LENGTH-1);
+  return true;
+}
+
+bool proto_new_packetShmGrant(proto_packetShmGrant *p, uint32_t size,
+				uint32_t ring_size)
+{
+  memset(p, 0, sizeof(*p));
+  p->head = PROTO_HEAD_SHM_GRANT;
+  p->size = size;
+  p->ring_size = ring_size;
+  return true;
+}
+
+bool proto_new_packetSessionResume(proto_packetSessionResume *p,
+				proto_session session, proto_seq seq)
+{
+  memset(p, 0, sizeof(*p));
+  p->head = PROTO_HEAD_SESSION_RESUME;
+  p->session = session;
+  p->seq = seq;
+  return true;
+}
+
+bool proto_new_packetSession(proto_packetSession *p, proto_session session,
+				proto_seq seq, bool resumed, uint8_t n_results)
+{
+  memset(p, 0, sizeof(*p));
+  p->head = PROTO_HEAD_SESSION;
+  p->session = session;
+  p->seq = seq;
+  p->resumed = resumed;
+  p->n_results = n_results;
+  return true;
+}
+
+int proto_packet_to_str(const proto_packet *packet, char *str, size_t size)
+{
+
+  if (packet->head == PROTO_HEAD_VERSION) {
+    auto *p = (proto_packetVersion*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_VERSION (0x%02x)\n"
+        "\tversion: '%s'\n"
+        "}", PROTO_HEAD_VERSION, p->version);
+  }
+
+  if (packet->head == PROTO_HEAD_INFO) {
+    auto *p = (proto_packetInfo*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_INFO (0x%02x)\n"
+        "\tcode: 0x%04x\n"
+        "}", PROTO_HEAD_INFO, p->code);
+  }
+
+  if (packet->head == PROTO_HEAD_WARN) {
+    auto *p = (proto_packetWarn*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_WARN (0x%02x)\n"
+        "\tcode: 0x%04x\n"
+        "}", PROTO_HEAD_WARN, p->code);
+  }
+
+  if (packet->head == PROTO_HEAD_ERROR) {
+    auto *p = (proto_packetError*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_ERROR (0x%02x)\n"
+        "\tcode: 0x%04x\n"
+        "}", PROTO_HEAD_ERROR, p->code);
+  }
+
+  if (packet->head == PROTO_HEAD_INGOING_MSG) {
+    auto *p = (proto_packetIngoingMessage*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_INGOING_MSG (0x%02x)\n"
+        "\tsrc: 0x%02x\n"
+        "\tlength: %d\n"
+        "\tdata: ...\n"
+        "\tseq: %u\n"
+        "}", PROTO_HEAD_INGOING_MSG, p->src, p->length, p->seq);
+  }
+
+  if (packet->head == PROTO_HEAD_OUTGOING_MSG) {
+    auto *p = (proto_packetOutgoingMessage*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_OUTGOING_MSG (0x%02x)\n"
+        "\tdest: 0x%02x\n"
+        "\tlength: %d\n"
+        "\tdata: ...\n"
+        "\ttag: %u\n"
+        "}", PROTO_HEAD_OUTGOING_MSG, p->dest, p->length, p->tag);
+  }
+
+  if (packet->head == PROTO_HEAD_OUTGOING_RESULT) {
+    auto *p = (proto_packetOutgoingResult*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_OUTGOING_RESULT (0x%02x)\n"
+        "\tcode: 0x%04x\n"
+        "\ttag: %u\n"
+        "}", PROTO_HEAD_OUTGOING_RESULT, p->result, p->tag);
+  }
+
+  if (packet->head == PROTO_HEAD_FORWARD_RULE) {
+    auto *p = (proto_packetForwardRule*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_FORWARD_RULE (0x%02x)\n"
+        "\taction: 0x%02x\n"
+        "\tsrc: 0x%02x\n"
+        "\tdest: 0x%02x\n"
+        "\tprefix: '%.*s'\n"
+        "\ttemplate: ...\n"
+        "}", PROTO_HEAD_FORWARD_RULE, p->action, p->src, p->dest,
+        p->prefix_length > PROTO_FORWARD_PREFIX_MAX_LENGTH ?
+        PROTO_FORWARD_PREFIX_MAX_LENGTH : p->prefix_length, p->prefix);
+  }
+
+  if (packet->head == PROTO_HEAD_STATS_REQUEST) {
+    auto *p = (proto_packetStatsRequest*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_STATS_REQUEST (0x%02x)\n"
+        "\tmetric: %d\n"
+        "\tlabel: %d\n"
+        "}", PROTO_HEAD_STATS_REQUEST, p->metric, p->label);
+  }
+
+  if (packet->head == PROTO_HEAD_STATS) {
+    auto *p = (proto_packetStats*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_STATS (0x%02x)\n"
+        "\tmetric: %d (%.*s)\n"
+        "\tlabel: %d\n"
+        "\tvalue: %lld\n"
+        "}", PROTO_HEAD_STATS, p->metric, PROTO_STATS_NAME_LENGTH, p->name,
+        p->label, (long long) p->value);
+  }
+
+  if (packet->head == PROTO_HEAD_PROFILE_DUMP) {
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_PROFILE_DUMP (0x%02x)\n"
+        "}", PROTO_HEAD_PROFILE_DUMP);
+  }
+
+  if (packet->head == PROTO_HEAD_SHM_REQUEST) {
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_SHM_REQUEST (0x%02x)\n"
+        "}", PROTO_HEAD_SHM_REQUEST);
+  }
+
+  if (packet->head == PROTO_HEAD_SHM_GRANT) {
+    auto *p = (proto_packetShmGrant*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_SHM_GRANT (0x%02x)\n"
+        "\tsize: %u\n"
+        "\tring_size: %u\n"
+        "}", PROTO_HEAD_SHM_GRANT, p->size, p->ring_size);
+  }
+
+  if (packet->head == PROTO_HEAD_SESSION_RESUME) {
+    auto *p = (proto_packetSessionResume*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_SESSION_RESUME (0x%02x)\n"
+        "\tsession: %016llx\n"
+        "\tseq: %u\n"
+        "}", PROTO_HEAD_SESSION_RESUME, (unsigned long long) p->session,
+        p->seq);
+  }
+
+  if (packet->head == PROTO_HEAD_SESSION) {
+    auto *p = (proto_packetSession*) packet;
+    return snprintf(str, size, "\n{\n"
+        "\thead: PROTO_HEAD_SESSION (0x%02x)\n"
+        "\tsession: %016llx\n"
+        "\tseq: %u\n"
+        "\tresumed: %u\n"
+        "\tn_results: %u\n"
+        "}", PROTO_HEAD_SESSION, (unsigned long long) p->session, p->seq,
+        p->resumed, p->n_results);
+  }
+
+
+  return 0;
+}
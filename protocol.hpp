@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "config.h"
@@ -23,12 +24,21 @@
 #define PROTO_VERSION "0.0.1"
 #define PROTO_PACKET_SIZE 64
 #define PROTO_DATA_MAX_LENGTH 50
+#define PROTO_FORWARD_PREFIX_MAX_LENGTH 16
+#define PROTO_FORWARD_TEMPLATE_MAX_LENGTH 42
+#define PROTO_STATS_NAME_LENGTH 26
 
 typedef uint8_t proto_head;
 typedef uint8_t proto_id;
 typedef uint16_t proto_dataLength;
 typedef uint16_t proto_code;
 typedef uint16_t proto_outgoingResult;
+typedef uint16_t proto_tag;
+typedef uint32_t proto_seq;
+typedef uint64_t proto_session;
+typedef uint8_t proto_forwardAction;
+typedef uint8_t proto_metric;
+typedef uint16_t proto_label;
 typedef char proto_data;
 
 #pragma pack(push, 1)
@@ -66,8 +76,10 @@ typedef struct {
 	proto_id src;
 	proto_dataLength length;
 	proto_data data[PROTO_DATA_MAX_LENGTH];
+	proto_seq seq; // of the ingoing messages of the daemon, from 1
 	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-sizeof(proto_id)
-		-sizeof(proto_dataLength)-PROTO_DATA_MAX_LENGTH*sizeof(proto_data)];
+		-sizeof(proto_dataLength)-PROTO_DATA_MAX_LENGTH*sizeof(proto_data)
+		-sizeof(proto_seq)];
 } proto_packetIngoingMessage;
 
 typedef struct {
@@ -75,16 +87,78 @@ typedef struct {
 	proto_id dest;
 	proto_dataLength length;
 	proto_data data[PROTO_DATA_MAX_LENGTH];
+	proto_tag tag; // given back by the result
 	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-sizeof(proto_id)
-		-sizeof(proto_dataLength)-PROTO_DATA_MAX_LENGTH*sizeof(proto_data)];
+		-sizeof(proto_dataLength)-PROTO_DATA_MAX_LENGTH*sizeof(proto_data)
+		-sizeof(proto_tag)];
 } proto_packetOutgoingMessage;
 
 typedef struct {
 	proto_head head;
 	proto_outgoingResult result;
-	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-sizeof(proto_outgoingResult)];
+	proto_tag tag; // of the outgoing message
+	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-sizeof(proto_outgoingResult)
+		-sizeof(proto_tag)];
 } proto_packetOutgoingResult;
 
+typedef struct {
+	proto_head head;
+	proto_forwardAction action;
+	proto_id src;
+	proto_id dest;
+	uint8_t prefix_length;
+	uint8_t template_length;
+	proto_data prefix[PROTO_FORWARD_PREFIX_MAX_LENGTH];
+	proto_data tmpl[PROTO_FORWARD_TEMPLATE_MAX_LENGTH];
+} proto_packetForwardRule;
+
+typedef struct {
+	proto_head head;
+	proto_metric metric;
+	proto_label label;
+	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-sizeof(proto_metric)
+		-sizeof(proto_label)];
+} proto_packetStatsRequest;
+
+typedef struct {
+	proto_head head;
+	proto_metric metric;
+	proto_label label;
+	uint8_t type;
+	uint8_t n_metrics;
+	int64_t value;
+	uint64_t sum;
+	uint32_t p50;
+	uint32_t p90;
+	uint32_t p99;
+	uint32_t max;
+	char name[PROTO_STATS_NAME_LENGTH];
+} proto_packetStats;
+
+typedef struct {
+	proto_head head;
+	uint32_t size;
+	uint32_t ring_size;
+	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-2*sizeof(uint32_t)];
+} proto_packetShmGrant;
+
+typedef struct {
+	proto_head head;
+	proto_session session; // 0 to open a new one
+	proto_seq seq;         // of the last ingoing message received
+	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-sizeof(proto_session)
+		-sizeof(proto_seq)];
+} proto_packetSessionResume;
+
+typedef struct {
+	proto_head head;
+	proto_session session;
+	proto_seq seq;     // of the first ingoing message replayed
+	uint8_t resumed;   // the session existed
+	uint8_t n_results; // replayed
+	char padding[PROTO_PACKET_SIZE-sizeof(proto_head)-sizeof(proto_session)
+		-sizeof(proto_seq)-2*sizeof(uint8_t)];
+} proto_packetSession;
 
 #pragma pack(pop)
 
@@ -104,6 +178,18 @@ static_assert(sizeof(proto_packetOutgoingMessage) == PROTO_PACKET_SIZE,
 		"Invalid struct proto_packetOutgoingMessage");
 static_assert(sizeof(proto_packetOutgoingResult) == PROTO_PACKET_SIZE,
 		"Invalid struct proto_packetOutgoingResult");
+static_assert(sizeof(proto_packetForwardRule) == PROTO_PACKET_SIZE,
+		"Invalid struct proto_packetForwardRule");
+static_assert(sizeof(proto_packetStatsRequest) == PROTO_PACKET_SIZE,
+		"Invalid struct proto_packetStatsRequest");
+static_assert(sizeof(proto_packetStats) == PROTO_PACKET_SIZE,
+		"Invalid struct proto_packetStats");
+static_assert(sizeof(proto_packetShmGrant) == PROTO_PACKET_SIZE,
+		"Invalid struct proto_packetShmGrant");
+static_assert(sizeof(proto_packetSessionResume) == PROTO_PACKET_SIZE,
+		"Invalid struct proto_packetSessionResume");
+static_assert(sizeof(proto_packetSession) == PROTO_PACKET_SIZE,
+		"Invalid struct proto_packetSession");
 
 /* Heads */
 #define PROTO_HEAD_VERSION          0x00
@@ -113,12 +199,60 @@ static_assert(sizeof(proto_packetOutgoingResult) == PROTO_PACKET_SIZE,
 #define PROTO_HEAD_INGOING_MSG      0x04
 #define PROTO_HEAD_OUTGOING_MSG     0x05
 #define PROTO_HEAD_OUTGOING_RESULT  0x06
+#define PROTO_HEAD_FORWARD_RULE     0x07
+#define PROTO_HEAD_STATS_REQUEST    0x08
+#define PROTO_HEAD_STATS            0x09
+#define PROTO_HEAD_PROFILE_DUMP     0x0A
+#define PROTO_HEAD_SHM_REQUEST      0x0B
+#define PROTO_HEAD_SHM_GRANT        0x0C
+#define PROTO_HEAD_SESSION_RESUME   0x0D
+#define PROTO_HEAD_SESSION          0x0E
 
-#define PROTO_INFO_SERIAL_OPENED  0x01
+#define PROTO_INFO_SERIAL_OPENED    0x01
+#define PROTO_INFO_FORWARD_UPDATED  0x02
+#define PROTO_INFO_PROFILE_DUMPED   0x03
 
 #define PROTO_ERROR_FAILED_OPEN_SERIAL            0x01
 #define PROTO_ERROR_RECEIVED_INVALID_PACKET_HEAD  0x02
+#define PROTO_ERROR_INVALID_FORWARD_RULE          0x03
+#define PROTO_ERROR_INVALID_STATS_REQUEST         0x04
+#define PROTO_ERROR_FAILED_PROFILE_DUMP           0x05
+#define PROTO_ERROR_FAILED_SHM                    0x06
+#define PROTO_ERROR_TOO_MANY_CLIENTS              0x07
+#define PROTO_ERROR_TOO_MANY_SESSIONS             0x08
+
+/* Stats: metric is an id of metrics.hpp and label selects the series (PJON id,
+   bus, client socket or 0), the reply gives the number of metrics so they can
+   be enumerated. value is the count of a histogram, the percentiles are upper
+   bounds. */
+#define PROTO_STATS_COUNTER    0x00
+#define PROTO_STATS_GAUGE      0x01
+#define PROTO_STATS_HISTOGRAM  0x02
+
+/* Shared memory transport: the grant is sent with SCM_RIGHTS ancillary data
+   holding the memfd of the rings (size bytes, see shm_ring.hpp), the eventfd
+   waking the daemon up and the eventfd waking the client up. Every following
+   packet of the daemon is written to the replies ring. */
 
+/* Sessions: a client presents its session (0 for a new one) and the sequence
+   number of the last ingoing message it received with
+   PROTO_HEAD_SESSION_RESUME. The daemon answers with PROTO_HEAD_SESSION, then
+   replays the ingoing messages still held from the one of seq, the ones between
+   the presented sequence number and seq being lost, and the results of the
+   outgoing messages finished while the client was away, before the following
+   ingoing messages. The ones received live before PROTO_HEAD_SESSION come
+   again with the replay. A session is dropped SERVER_SESSION_TIMEOUT after its
+   client went away. */
+
+/* Forward rule actions, src 0 matches any sender */
+#define PROTO_FORWARD_ADD     0x00
+#define PROTO_FORWARD_REMOVE  0x01
+#define PROTO_FORWARD_CLEAR   0x02
+
+/* Outgoing messages: a client may push several of them without waiting for
+   their results, which are given back with the tag of the message (0 for the
+   clients not setting it) in the order of the messages, but for the ones the
+   daemon fails at once because its queues are full. */
 #define PROTO_OUTGOING_RESULT_SUCCESS             0x00
 #define PROTO_OUTGOING_RESULT_INTERNAL_ERROR      0x01
 #define PROTO_OUTGOING_RESULT_CONTENT_TOO_LONG    0x02
@@ -133,10 +267,28 @@ bool proto_new_packetInfo(proto_packetInfo *p, proto_code code);
 bool proto_new_packetWarn(proto_packetWarn *p, proto_code code);
 bool proto_new_packetError(proto_packetError *p, proto_code code);
 bool proto_new_packetIngoingMessage(proto_packetIngoingMessage *p,
-				 proto_id src, proto_dataLength length, const proto_data* data);
+				 proto_id src, proto_dataLength length, const proto_data* data,
+				 proto_seq seq=0);
 bool proto_new_packetOutgoingMessage(proto_packetOutgoingMessage *p,
-				proto_id dest, proto_dataLength length, const proto_data* data);
+				proto_id dest, proto_dataLength length, const proto_data* data,
+				proto_tag tag=0);
 bool proto_new_packetOutgoingResult(proto_packetOutgoingResult *p,
-									proto_outgoingResult result);
-
+									proto_outgoingResult result, proto_tag tag=0);
+bool proto_new_packetForwardRule(proto_packetForwardRule *p,
+				proto_forwardAction action, proto_id src, proto_id dest,
+				uint8_t prefix_length, const proto_data* prefix,
+				uint8_t template_length, const proto_data* tmpl);
+bool proto_new_packetStatsRequest(proto_packetStatsRequest *p,
+				proto_metric metric, proto_label label);
+bool proto_new_packetStats(proto_packetStats *p, proto_metric metric,
+				proto_label label, uint8_t type, uint8_t n_metrics, const char *name);
+bool proto_new_packetShmGrant(proto_packetShmGrant *p, uint32_t size,
+				uint32_t ring_size);
+bool proto_new_packetSessionResume(proto_packetSessionResume *p,
+				proto_session session, proto_seq seq);
+bool proto_new_packetSession(proto_packetSession *p, proto_session session,
+				proto_seq seq, bool resumed, uint8_t n_results);
 
+// Write a human readable description of the packet to str of size bytes
+// Return the number of characters written as snprintf
+int proto_packet_to_str(const proto_packet *packet, char *str, size_t size);
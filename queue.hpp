@@ -0,0 +1,187 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free queues between the threads of the server, their size N
+// must be a power of two. A full queue refuses the item, its producer decides
+// what to drop.
+
+// one producer thread, one consumer thread
+template<typename T, size_t N>
+class SpscQueue {
+
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+  public:
+
+    bool push(const T &item)
+    {
+      size_t tail = this->tail.load(std::memory_order_relaxed);
+      if (tail - this->head.load(std::memory_order_acquire) == N)
+        return false;
+      this->items[tail & (N - 1)] = item;
+      this->tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(T *item)
+    {
+      size_t head = this->head.load(std::memory_order_relaxed);
+      if (head == this->tail.load(std::memory_order_acquire))
+        return false;
+      *item = this->items[head & (N - 1)];
+      this->head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) T items[N];
+
+};
+
+// any number of producer threads, one consumer thread: each cell has a
+// sequence telling whether it is free for the producer claiming its position
+// or written for the consumer
+template<typename T, size_t N>
+class MpscQueue {
+
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+  public:
+
+    MpscQueue()
+    {
+      for (size_t i = 0; i < N; i++)
+        this->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const T &item)
+    {
+      size_t pos = this->tail.load(std::memory_order_relaxed);
+      Cell *c;
+      while (true) {
+        c = &this->cells[pos & (N - 1)];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+          if (this->tail.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed))
+            break;
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = this->tail.load(std::memory_order_relaxed);
+        }
+      }
+      c->item = item;
+      c->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(T *item)
+    {
+      Cell &c = this->cells[this->head & (N - 1)];
+      if (c.seq.load(std::memory_order_acquire) != this->head + 1)
+        return false;
+      *item = c.item;
+      c.seq.store(this->head + N, std::memory_order_release);
+      this->head++;
+      return true;
+    }
+
+  private:
+
+    struct Cell {
+      std::atomic<size_t> seq;
+      T item;
+    };
+
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) size_t head = 0;
+    alignas(64) Cell cells[N];
+
+};
+
+// one producer thread publishing each item once to C consumer threads at most,
+// every consumer reading all of them from its own position, an item being
+// overwritten once all the consumers read it
+template<typename T, size_t N, size_t C>
+class SpmcRing {
+
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+  public:
+
+    // the consumers 0 to n - 1 read the items pushed from now on
+    void set_consumers(size_t n)
+    {
+      this->n = n < C ? n : C;
+      size_t tail = this->tail.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < this->n; i++)
+        this->heads[i].pos.store(tail, std::memory_order_relaxed);
+      this->min_head = tail;
+    }
+
+    bool push(const T &item)
+    {
+      size_t tail = this->tail.load(std::memory_order_relaxed);
+      // the slowest consumer is only looked for when it seems to be a lap late
+      if (tail - this->min_head == N) {
+        size_t min = tail;
+        for (size_t i = 0; i < this->n; i++) {
+          size_t head = this->heads[i].pos.load(std::memory_order_acquire);
+          if (tail - head > tail - min)
+            min = head;
+        }
+        this->min_head = min;
+        if (tail - min == N)
+          return false;
+      }
+      this->items[tail & (N - 1)] = item;
+      this->tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(size_t consumer, T *item)
+    {
+      auto &head = this->heads[consumer].pos;
+      size_t pos = head.load(std::memory_order_relaxed);
+      if (pos == this->tail.load(std::memory_order_acquire))
+        return false;
+      *item = this->items[pos & (N - 1)];
+      head.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+
+    struct alignas(64) Head {
+      std::atomic<size_t> pos{0};
+    };
+
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t min_head = 0; // of the producer
+    size_t n = 0;
+    Head heads[C];
+    alignas(64) T items[N];
+
+};
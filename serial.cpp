@@ -0,0 +1,248 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "serial.hpp"
+#include "logger.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool to_speed(uint32_t bd, speed_t *speed);
+
+static uint32_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1'000'000u + ts.tv_nsec / 1'000;
+}
+
+bool SerialStrategy::open(const char *dev, uint32_t bd)
+{
+  this->close();
+
+  speed_t speed;
+  if (!to_speed(bd, &speed)) {
+    log_error("com", "Unsupported baudrate %u for %s", bd, dev);
+    return false;
+  }
+
+  this->fd = ::open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (this->fd < 0)
+    return false;
+
+  // raw bytes, 8N1 without flow control, the reads return what is waiting
+  // (VMIN and VTIME at 0: the poll waits with a finer resolution than the
+  // tenths of second of VTIME, the frames being delimited by their framing)
+  struct termios tio;
+  if (tcgetattr(this->fd, &tio) < 0) {
+    log_perror("com", "Failed to get the attributes of %s", dev);
+    this->close();
+    return false;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(this->fd, TCSANOW, &tio) < 0) {
+    log_perror("com", "Failed to set the attributes of %s", dev);
+    this->close();
+    return false;
+  }
+  tcflush(this->fd, TCIOFLUSH);
+
+  // the drivers of the USB adapters otherwise hold the received bytes for
+  // some milliseconds, not every driver has it (e.g. a pseudo-terminal)
+  struct serial_struct ss;
+  if (ioctl(this->fd, TIOCGSERIAL, &ss) == 0) {
+    ss.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(this->fd, TIOCSSERIAL, &ss) < 0)
+      log_warn("com", "Failed to set the low latency of %s: %s", dev,
+          strerror(errno));
+  }
+
+  this->failed = false;
+  this->head = this->tail = 0;
+  this->reader = {};
+  return true;
+}
+
+void SerialStrategy::close()
+{
+  if (this->fd < 0)
+    return;
+  ::close(this->fd);
+  this->fd = -1;
+}
+
+bool SerialStrategy::is_connected()
+{
+  if (this->fd < 0 || this->failed)
+    return false;
+
+  struct pollfd pfd = {this->fd, 0, 0};
+  if (poll(&pfd, 1, 0) < 0)
+    return errno == EINTR;
+  return !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL));
+}
+
+// the line is free if no frame is being received
+bool SerialStrategy::can_start()
+{
+  this->fill(0);
+  return this->head == this->tail && !this->reader.in_frame;
+}
+
+uint16_t SerialStrategy::receive_frame(uint8_t *data, uint16_t max_length)
+{
+  for (bool waited = false;; waited = true) {
+    while (this->head != this->tail) {
+      uint8_t b = this->input[this->head++ & (SERIAL_INPUT_SIZE - 1)];
+      size_t n = frame_tsa_feed(&this->reader, b);
+      if (n && n <= max_length) {
+        memcpy(data, this->reader.data, n);
+        return n;
+      }
+    }
+    if (waited || !this->fill(SERIAL_RECEIVE_WAIT))
+      return SERIAL_FAIL;
+  }
+}
+
+// the acknowledgement is a single byte out of a frame, the other bytes
+// received meanwhile are dropped
+uint16_t SerialStrategy::receive_response()
+{
+  uint32_t start = now_us();
+  while (true) {
+    while (this->head != this->tail) {
+      uint8_t b = this->input[this->head++ & (SERIAL_INPUT_SIZE - 1)];
+      if (b == FRAME_ACK && !this->reader.in_frame)
+        return SERIAL_ACK;
+      frame_tsa_feed(&this->reader, b);
+    }
+    uint32_t elapsed = now_us() - start;
+    if (elapsed >= SERIAL_RESPONSE_TIME_OUT
+        || !this->fill(SERIAL_RESPONSE_TIME_OUT - elapsed))
+      return SERIAL_FAIL;
+  }
+}
+
+void SerialStrategy::send_response(uint8_t response)
+{
+  this->write_all(&response, 1);
+}
+
+void SerialStrategy::send_frame(uint8_t *data, uint16_t length)
+{
+  uint8_t frame[FRAME_TSA_MAX_LENGTH];
+  size_t n = frame_tsa_wrap(data, length, frame, sizeof(frame));
+  if (n)
+    this->write_all(frame, n);
+}
+
+// read all the bytes waiting, after waiting for them at most timeout us
+// Return true if bytes were read, false otherwise
+bool SerialStrategy::fill(uint32_t timeout)
+{
+  if (this->fd < 0 || this->failed)
+    return false;
+  uint32_t used = this->tail - this->head;
+  if (used == SERIAL_INPUT_SIZE)
+    return true;
+
+  if (timeout) {
+    struct pollfd pfd = {this->fd, POLLIN, 0};
+    struct timespec ts = {timeout / 1'000'000,
+      (long) (timeout % 1'000'000) * 1'000};
+    int ready = ppoll(&pfd, 1, &ts, nullptr);
+    if (ready <= 0)
+      return false;
+    if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+      this->failed = true;
+      return false;
+    }
+  }
+
+  // the free space of the ring, in two parts when it wraps around
+  uint32_t start = this->tail & (SERIAL_INPUT_SIZE - 1);
+  uint32_t room = SERIAL_INPUT_SIZE - used;
+  uint32_t first = room < SERIAL_INPUT_SIZE - start ? room
+    : SERIAL_INPUT_SIZE - start;
+  struct iovec iov[2] = {
+    {&this->input[start], first},
+    {this->input, room - first}
+  };
+  ssize_t count = readv(this->fd, iov, room > first ? 2 : 1);
+  if (count > 0) {
+    this->tail += count;
+    return true;
+  }
+  // a device hung up reads the end of file
+  if (count == 0 || (errno != EAGAIN && errno != EINTR))
+    this->failed = true;
+  return false;
+}
+
+void SerialStrategy::write_all(const uint8_t *data, size_t n)
+{
+  while (n && this->fd >= 0 && !this->failed) {
+    ssize_t count = write(this->fd, data, n);
+    if (count > 0) {
+      data += count;
+      n -= count;
+      continue;
+    }
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0 && errno == EAGAIN) {
+      struct pollfd pfd = {this->fd, POLLOUT, 0};
+      if (poll(&pfd, 1, SERIAL_RESPONSE_TIME_OUT / 1'000) > 0
+          && !(pfd.revents & (POLLHUP | POLLERR | POLLNVAL)))
+        continue;
+    }
+    this->failed = true;
+  }
+}
+
+bool to_speed(uint32_t bd, speed_t *speed)
+{
+  static const struct {
+    uint32_t bd;
+    speed_t speed;
+  } speeds[] = {
+    {1200, B1200}, {2400, B2400}, {4800, B4800}, {9600, B9600},
+    {19200, B19200}, {38400, B38400}, {57600, B57600}, {115200, B115200},
+    {230400, B230400}, {460800, B460800}, {500000, B500000},
+    {576000, B576000}, {921600, B921600}, {1000000, B1000000},
+    {1500000, B1500000}, {2000000, B2000000}
+  };
+  for (auto &s : speeds) {
+    if (s.bd == bd) {
+      *speed = s.speed;
+      return true;
+    }
+  }
+  return false;
+}
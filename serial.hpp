@@ -0,0 +1,106 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "frame.hpp"
+
+#include <stdint.h>
+
+// Results of the strategy, the values of PJON_ACK and PJON_FAIL (PJON.h
+// defines the functions of its interface, so it is only included by
+// communication.cpp)
+#define SERIAL_ACK FRAME_ACK
+#define SERIAL_FAIL 65535
+
+// Bytes of the input ring of a serial bus, a power of two
+#ifndef SERIAL_INPUT_SIZE
+#define SERIAL_INPUT_SIZE 4096
+#endif
+
+// Longest wait of a frame reception for the next bytes of the line
+#ifndef SERIAL_RECEIVE_WAIT
+#define SERIAL_RECEIVE_WAIT 1'000 // in us
+#endif
+
+// Time a dispatch waits for the synchronous acknowledgement
+#ifndef SERIAL_RESPONSE_TIME_OUT
+#define SERIAL_RESPONSE_TIME_OUT 100'000 // in us
+#endif
+
+static_assert((SERIAL_INPUT_SIZE & (SERIAL_INPUT_SIZE - 1)) == 0,
+    "SERIAL_INPUT_SIZE must be a power of two");
+
+// PJON strategy of a serial device owned by the daemon, framed as
+// ThroughSerialAsync. The device is set to raw mode, with the low latency of
+// the driver when it has one, a read takes all the bytes waiting into an
+// input ring consumed by the frame parser and a frame is written by a single
+// write. The waits for the line are done in poll, so a byte is handled as
+// soon as it arrives.
+class SerialStrategy {
+
+  public:
+
+    // Open the device dev at the baudrate bd
+    // Return false in case of failure, true otherwise
+    bool open(const char *dev, uint32_t bd);
+
+    void close();
+
+    // Return false once the device hung up or failed, true otherwise
+    bool is_connected();
+
+    uint32_t back_off(uint8_t attempts)
+    {
+      return attempts;
+    }
+
+    bool begin(uint8_t did = 0)
+    {
+      (void) did;
+      return true;
+    }
+
+    bool can_start();
+
+    uint8_t get_max_attempts()
+    {
+      return 5;
+    }
+
+    void handle_collision()
+    {
+    }
+
+    uint16_t receive_frame(uint8_t *data, uint16_t max_length);
+
+    uint16_t receive_response();
+
+    void send_response(uint8_t response);
+
+    void send_frame(uint8_t *data, uint16_t length);
+
+  private:
+
+    bool fill(uint32_t timeout);
+    void write_all(const uint8_t *data, size_t n);
+
+    int fd = -1;
+    bool failed = false;
+    uint8_t input[SERIAL_INPUT_SIZE];
+    uint32_t head = 0; // read by the parser
+    uint32_t tail = 0; // written by fill
+    frame_tsa_reader reader = {};
+
+};
@@ -12,107 +12,861 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "alloc_check.hpp"
+#include "capture.hpp"
+#include "forward.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "pool.hpp"
+#include "profiler.hpp"
+#include "queue.hpp"
 #include "server.hpp"
 #include "socket.hpp"
+#include "stats.hpp"
 
+#include <atomic>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
 #include <vector>
 
+static_assert(METRICS_COUNTER == PROTO_STATS_COUNTER
+    && METRICS_GAUGE == PROTO_STATS_GAUGE
+    && METRICS_HISTOGRAM == PROTO_STATS_HISTOGRAM,
+    "The metric types are the ones of the protocol");
+static_assert(SERVER_MAX_WORKERS <= SOCKET_MAX_SHARDS,
+    "A worker serves a shard of the sockets");
+static_assert(SOCKET_MAX_QUEUED
+    > SERVER_REPLAY_SIZE + SERVER_SESSION_RESULTS + 1,
+    "A session is replayed at once into the output queue of its client");
+
+// The clients are served by the workers, each one owning a shard of the
+// sockets (see socket_attach), and the buses by the thread of server_run, the
+// bus owner. A worker forwards the requests of its clients to the bus owner
+// through the requests queue, and the bus owner gives back the replies to the
+// worker of the client and publishes the broadcasts once for all of them. The
+// replay of a session goes through the broadcasts, so it keeps its place among
+// them. The packets go through the queues by their slot in the pool, each
+// queue holding a reference.
+
+// a packet of or for the client sock
+typedef struct {
+  int sock;
+  pool_handle h;
+} server_packet;
+
+// head of the packet announcing the sock of a closed client to the bus owner
+#define SERVER_HEAD_CLOSED 0xFF
+
+struct Worker {
+  unsigned int index;
+  int fd = -1;        // eventfd waking the worker up
+  bool woken = false; // by the bus owner during its iteration
+  SpscQueue<server_packet, SERVER_QUEUE_SIZE> replies;
+  std::thread thread;
+  // reused by every iteration
+  proto_packet packets[SOCKET_MAX_RECEPTION];
+  std::vector<int> clients;
+};
+
 static unsigned int update_period;
+static int metrics_fd = -1;
+static unsigned int n_workers = 1;
+static std::vector<Worker*> workers;
+static MpscQueue<server_packet, SERVER_QUEUE_SIZE> requests;
+static SpmcRing<server_packet, SERVER_BROADCAST_SIZE, SERVER_MAX_WORKERS>
+  broadcasts; // sock is SOCKET_ALL or the one of a replay
+static int requests_fd = -1; // eventfd waking the bus owner up
+static std::atomic<bool> running(true); // cleared to stop the workers
+static std::atomic<bool> failed(false); // set by a failing worker
+
+// a session of a client, kept SERVER_SESSION_TIMEOUT after its client went
+// away with the results of its outgoing messages finished meanwhile
+struct Session {
+  proto_session id = 0; // 0 if the slot is free
+  uint16_t gen = 0;     // incremented when the slot is freed
+  int sock = -1;        // of its client, -1 while away
+  uint64_t left = 0;    // when its client went away, in us
+  unsigned int n_results = 0;
+  proto_packet results[SERVER_SESSION_RESULTS];
+};
+static Session sessions[SERVER_MAX_SESSIONS];
+
+// a client as seen by the bus owner, by sock, the connection telling apart the
+// successive clients of a sock
+struct Peer {
+  uint16_t conn = 0;
+  int16_t session = -1;
+  // the pending outgoing message of sock and the client which sent it
+  proto_tag tag = 0;
+  uint16_t pending_conn = 0;
+  int16_t pending_session = -1;
+  uint16_t pending_gen = 0;
+};
+static Peer peers[1 << 15]; // the socks are com_ref
+
+// an outgoing message of a client waiting for its previous one
+struct Deferred {
+  int sock;
+  pool_handle h;
+  uint16_t conn;
+  int16_t session;
+  uint16_t gen;
+};
+static std::vector<Deferred> deferred;
+
+// the last ingoing messages, by sequence number, POOL_NONE before the first
+// ones
+static pool_handle replay[SERVER_REPLAY_SIZE];
+static proto_seq next_seq = 1;
+
+// reused by every iteration of the loop
+static com_message reception[SERVER_MAX_RECEPTION];
+static com_request results[SERVER_MAX_SEND_RESULTS];
+
+static void work(Worker *w);
+static bool forward(Worker *w, int sock, const proto_packet *p);
+static void request(int sock, pool_handle h);
+static void outgoing(int sock, pool_handle h);
+static void push_outgoing(int sock, const proto_packetOutgoingMessage *p,
+    const Peer &sender);
+static void push_deferred();
+static void result(int sock, const proto_packet &p);
+static void closed(int sock);
+static void session_resume(int sock, const proto_packetSessionResume *p);
+static int new_session();
+static void free_session(int i);
+static void reply(int sock, const proto_packet &p);
+static void broadcast(const proto_packet &p, int sock=SOCKET_ALL);
+static void broadcast_handle(pool_handle h, int sock=SOCKET_ALL);
+static void wake_up(int fd);
+static void stop_workers();
+static void forward_rule(int sock, const proto_packetForwardRule *p);
+static void stats(int sock, const proto_packetStatsRequest *p);
+static void profile_dump(int sock);
+static void shm_request(int sock);
+static uint64_t micros();
 
-void server_init(unsigned int up)
+void server_init(unsigned int up, const char *metrics_socket)
 {
   log_info("server", "Initialization");
   update_period = up;
+  deferred.reserve(SERVER_MAX_DEFERRED);
+  for (auto &h : replay)
+    h = POOL_NONE;
+  if (pool_get_size() <= SERVER_REPLAY_SIZE + SERVER_MAX_DEFERRED)
+    log_warn("server", "The packet pool (%zu slots) may be held by the replay "
+        "and the pipelined messages (%d slots)", pool_get_size(),
+        SERVER_REPLAY_SIZE + SERVER_MAX_DEFERRED);
+  requests_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (requests_fd < 0)
+    log_perror("server", "Failed to create the requests eventfd");
+  if (metrics_socket)
+    metrics_fd = metrics_listen(metrics_socket);
+}
+
+void server_set_workers(unsigned int n)
+{
+  n_workers = n < 1 ? 1 : n > SERVER_MAX_WORKERS ? SERVER_MAX_WORKERS : n;
 }
 
 void server_run()
 {
-  log_info("server", "Running");
-  if (com_connect()) {
+  log_info("server", "Running with %u workers", n_workers);
+  prof_set_thread_name("server");
+  broadcasts.set_consumers(n_workers);
+  for (unsigned int i = 0; i < n_workers; i++) {
+    Worker *w = new Worker;
+    w->index = i;
+    w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->fd < 0) {
+      log_perror("server", "Failed to create the eventfd of worker %u", i);
+      return;
+    }
+    workers.push_back(w);
+  }
+  for (Worker *w : workers)
+    w->thread = std::thread(work, w);
+
+  // the bus threads reconnect by themselves from then on
+  bool connected = com_connect();
+  if (connected) {
     proto_packet p;
     proto_new_packetInfo((proto_packetInfo*) &p, PROTO_INFO_SERIAL_OPENED);
-    socket_push(SOCKET_ALL, p);
+    broadcast(p);
   }
 
+  // wake up as soon as a bus thread or a worker has something
+  struct pollfd pfds[3] = {
+    {com_get_fd(), POLLIN, 0},
+    {requests_fd, POLLIN, 0},
+    {metrics_fd, POLLIN, 0}
+  };
+  struct timespec period = {update_period / 1'000'000,
+    (long) (update_period % 1'000'000) * 1'000};
   while (true) {
 
-    if (!socket_wait(update_period))
+    {
+      PROF_SCOPE(PROF_SERVER_WAIT);
+      // interrupted by a signal (e.g. a profile dump request)
+      if (ppoll(pfds, metrics_fd >= 0 ? 3 : 2, &period, nullptr) < 0
+          && errno != EINTR) {
+        log_perror("server", "Wait");
+        stop_workers();
+        return;
+      }
+    }
+    if (failed.load(std::memory_order_acquire)) {
+      stop_workers();
       return;
+    }
+    uint64_t start = micros();
+    alloc_check_begin("server_run");
 
-    unsigned int max_clients = socket_get_max_clients();
-    for (unsigned int sock = 0; sock < max_clients; sock++) {
-
-      // socket reception
-      std::vector<proto_packet> packets = socket_receive(sock);
-      for (const proto_packet& p : packets) {
-        log_packet("server",  &p, "Received from %d", sock);
-        auto p1 = (proto_packetOutgoingMessage*) &p;
-        if (p.head != PROTO_HEAD_OUTGOING_MSG) {
-          proto_packet p_error;
-          log_error("server", "Received invalid packet head (expecting : %d, "
-            "received: %d)", PROTO_HEAD_INGOING_MSG, p.head);
-          proto_new_packetError((proto_packetError*) &p_error,
-              PROTO_ERROR_RECEIVED_INVALID_PACKET_HEAD);
-          socket_push(sock, p_error);
-          break;
-        }
-        com_push(sock, p1->dest, p1->length, p1->data);
-      }
+    if (metrics_fd >= 0 && (pfds[2].revents & POLLIN)) {
+      AllocAllowed allowed;
+      metrics_set(METRICS_LOG_DROPPED, 0, log_get_dropped());
+      metrics_serve(metrics_fd);
+    }
 
-      // socket emission
-      socket_send(sock);
+    {
+      AllocAllowed allowed;
+      prof_poll();
     }
 
-    if (!com_is_connected()) {
-      proto_packet p;
-      proto_new_packetError((proto_packetError*) &p,
-          PROTO_ERROR_FAILED_OPEN_SERIAL);
-      socket_push(SOCKET_ALL, p);
-      if (com_connect()) {
+    // requests of the workers
+    {
+      PROF_SCOPE(PROF_SERVER_REQUESTS);
+      uint64_t count;
+      if (pfds[1].revents & POLLIN
+          && read(requests_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_perror("server", "Read requests eventfd");
+      server_packet r;
+      while (requests.pop(&r)) {
+        request(r.sock, r.h);
+        pool_unref(r.h);
+      }
+    }
+
+    // one notification per transition, signaled by com_get_fd
+    {
+      PROF_SCOPE(PROF_CONNECT);
+      if (com_is_connected() != connected) {
+        connected = !connected;
         proto_packet p;
-        proto_new_packetInfo((proto_packetInfo*) &p, PROTO_INFO_SERIAL_OPENED);
-        socket_push(SOCKET_ALL, p);
+        if (connected)
+          proto_new_packetInfo((proto_packetInfo*) &p,
+              PROTO_INFO_SERIAL_OPENED);
+        else
+          proto_new_packetError((proto_packetError*) &p,
+              PROTO_ERROR_FAILED_OPEN_SERIAL);
+        broadcast(p);
       }
     }
 
+    // PJON reception, forwarded packets are sent by the following com_send
+    size_t n;
+    {
+      PROF_SCOPE(PROF_COM_RECEIVE);
+      n = com_receive(reception, SERVER_MAX_RECEPTION);
+    }
+    for (unsigned int i = 0; i < n; i++) {
+      // written once, for the replay and all the clients, in the slot of the
+      // oldest message of the replay when no one else holds it
+      pool_handle &held = replay[next_seq % SERVER_REPLAY_SIZE];
+      if (held != POOL_NONE)
+        pool_unref(held);
+      held = pool_alloc();
+      pool_handle h = held;
+      if (h != POOL_NONE) {
+        proto_new_packetIngoingMessage(
+            (proto_packetIngoingMessage*) pool_get(h), reception[i].src,
+            reception[i].n, reception[i].data, next_seq++);
+        broadcast_handle(h);
+      } else {
+        log_error("server", "Packet pool exhausted, dropping a message of "
+            "0x%02x", reception[i].src);
+        metrics_add(METRICS_POOL_EXHAUSTED, 0);
+      }
+      fwd_apply(&reception[i]);
+    }
+
     // PJON emission
-    com_request results[1000];
-    size_t n = com_send(results, 1000);
+    {
+      PROF_SCOPE(PROF_COM_SEND);
+      n = com_send(results, SERVER_MAX_SEND_RESULTS);
+    }
     for (unsigned int i = 0; i < n; i++) {
       com_request req = results[i];
-      proto_packet p;
+      if (fwd_is_ref(req.ref)) {
+        fwd_result(req.ref, req.state);
+        continue;
+      }
+      proto_outgoingResult code;
       switch (req.state) {
         case COM_SUCCESS:
-          proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p,
-              PROTO_OUTGOING_RESULT_SUCCESS);
+          code = PROTO_OUTGOING_RESULT_SUCCESS;
           break;
         case COM_CONTENT_TOO_LONG:
-          proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p,
-              PROTO_OUTGOING_RESULT_CONTENT_TOO_LONG);
+          code = PROTO_OUTGOING_RESULT_CONTENT_TOO_LONG;
           break;
         case COM_CONNECTION_LOST:
-          proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p,
-              PROTO_OUTGOING_RESULT_CONNECTION_LOST);
+          code = PROTO_OUTGOING_RESULT_CONNECTION_LOST;
           break;
         default:
-          proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p,
-              PROTO_OUTGOING_RESULT_INTERNAL_ERROR);
+          code = PROTO_OUTGOING_RESULT_INTERNAL_ERROR;
       }
-      socket_push(req.ref, p);
+      proto_packet p;
+      proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p, code,
+          peers[req.ref].tag);
+      result(req.ref, p);
       log_packet("com", &p, "sending");
     }
+    push_deferred();
 
-    // PJON reception
-    com_message reception[SERVER_MAX_RECEPTION];
-    n = com_receive(reception, SERVER_MAX_RECEPTION);
-    for (unsigned int i = 0; i < n; i++) {
-      proto_packet p;
-      proto_new_packetIngoingMessage((proto_packetIngoingMessage*) &p,
-          reception[i].src, reception[i].n, reception[i].data);
-      socket_push(SOCKET_ALL, p);
+    // once per iteration, what was given to a worker
+    for (Worker *w : workers) {
+      if (w->woken)
+        wake_up(w->fd);
+      w->woken = false;
+    }
+
+    capture_flush();
+    metrics_set(METRICS_POOL_USED, 0, pool_get_used());
+    metrics_observe(METRICS_LOOP_TIME, 0, micros() - start);
+    stats_update();
+    alloc_check_end();
+  }
+}
+
+// serve the shard of the clients of w, the packets of the bus owner first
+void work(Worker *w)
+{
+  char name[16];
+  snprintf(name, sizeof(name), "worker%u", w->index);
+  prof_set_thread_name(name);
+  if (!socket_attach(w->index, n_workers)) {
+    log_error("server", "Failed to attach worker %u to the sockets", w->index);
+    failed.store(true, std::memory_order_release);
+    wake_up(requests_fd);
+    return;
+  }
+  socket_watch(w->fd);
+  w->clients.resize(socket_get_max_clients());
+
+  while (running.load(std::memory_order_relaxed)) {
+
+    {
+      PROF_SCOPE(PROF_SOCKET_WAIT);
+      if (!socket_wait(update_period)) {
+        log_error("server", "Worker %u failed to wait", w->index);
+        failed.store(true, std::memory_order_release);
+        wake_up(requests_fd);
+        return;
+      }
+    }
+    alloc_check_begin("server_worker");
+
+    uint64_t count;
+    if (socket_is_readable(w->fd)
+        && read(w->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      log_perror("server", "Read worker eventfd");
+    server_packet r;
+    while (w->replies.pop(&r)) {
+      socket_push_handle(r.sock, r.h);
+      pool_unref(r.h);
+    }
+    while (broadcasts.pop(w->index, &r)) {
+      if (r.sock == SOCKET_ALL || (unsigned int) r.sock % n_workers == w->index)
+        socket_push_handle(r.sock, r.h);
+      pool_unref(r.h);
     }
+
+    // socket reception, of the clients connected by socket_wait
+    size_t n_clients = socket_get_clients(w->clients.data(),
+        w->clients.size());
+    bool forwarded = false;
+    {
+      PROF_SCOPE(PROF_SOCKET_RECEIVE);
+      for (size_t j = 0; j < n_clients; j++) {
+        int sock = w->clients[j];
+        size_t n = socket_receive(sock, w->packets);
+        for (size_t i = 0; i < n; i++) {
+          const proto_packet &p = w->packets[i];
+          log_packet("server",  &p, "Received from %d", sock);
+          if (p.head == PROTO_HEAD_SHM_REQUEST) {
+            shm_request(sock);
+            continue;
+          }
+          if (p.head != PROTO_HEAD_OUTGOING_MSG
+              && p.head != PROTO_HEAD_FORWARD_RULE
+              && p.head != PROTO_HEAD_STATS_REQUEST
+              && p.head != PROTO_HEAD_PROFILE_DUMP
+              && p.head != PROTO_HEAD_SESSION_RESUME) {
+            proto_packet p_error;
+            log_error("server", "Received invalid packet head (expecting : %d, "
+                "received: %d)", PROTO_HEAD_INGOING_MSG, p.head);
+            proto_new_packetError((proto_packetError*) &p_error,
+                PROTO_ERROR_RECEIVED_INVALID_PACKET_HEAD);
+            socket_push(sock, p_error);
+            break;
+          }
+          forwarded |= forward(w, sock, &p);
+        }
+      }
+    }
+    // the bus owner learns of the closed clients after their last requests
+    int sock;
+    while (socket_pop_closed(&sock, 1)) {
+      proto_packet p_closed;
+      proto_new_packet(&p_closed, SERVER_HEAD_CLOSED);
+      forwarded |= forward(w, sock, &p_closed);
+    }
+    if (forwarded)
+      wake_up(requests_fd);
+
+    // socket emission
+    {
+      PROF_SCOPE(PROF_SOCKET_SEND);
+      for (size_t j = 0; j < n_clients; j++)
+        socket_send(w->clients[j]);
+    }
+
+    alloc_check_end();
+  }
+}
+
+// give the packet p of the client sock to the bus owner, an outgoing message
+// not fitting is answered as failed
+// Return true if it was queued, false otherwise
+bool forward(Worker *w, int sock, const proto_packet *p)
+{
+  pool_handle h = pool_new(*p);
+  if (h != POOL_NONE && requests.push({sock, h}))
+    return true;
+
+  if (h != POOL_NONE) {
+    pool_unref(h);
+    log_error("server", "Requests queue full, dropping a packet of %d", sock);
+    metrics_add(METRICS_SERVER_DROPPED, w->index);
+  } else {
+    log_error("server", "Packet pool exhausted, dropping a packet of %d", sock);
+    metrics_add(METRICS_POOL_EXHAUSTED, 0);
   }
+  if (p->head == PROTO_HEAD_OUTGOING_MSG) {
+    proto_packet p_result;
+    proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p_result,
+        PROTO_OUTGOING_RESULT_INTERNAL_ERROR,
+        ((const proto_packetOutgoingMessage*) p)->tag);
+    socket_push(sock, p_result);
+  }
+  return false;
+}
+
+// handle the packet of the slot h of the client sock in the bus owner
+void request(int sock, pool_handle h)
+{
+  const proto_packet *p = pool_get(h);
+  switch (p->head) {
+    case PROTO_HEAD_FORWARD_RULE:
+      forward_rule(sock, (const proto_packetForwardRule*) p);
+      break;
+    case PROTO_HEAD_STATS_REQUEST:
+      stats(sock, (const proto_packetStatsRequest*) p);
+      break;
+    case PROTO_HEAD_PROFILE_DUMP:
+      profile_dump(sock);
+      break;
+    case PROTO_HEAD_SESSION_RESUME:
+      session_resume(sock, (const proto_packetSessionResume*) p);
+      break;
+    case SERVER_HEAD_CLOSED:
+      closed(sock);
+      break;
+    default:
+      outgoing(sock, h);
+  }
+}
+
+// push the outgoing message of the slot h of the client sock to the buses, or
+// keep it for after the pending one of sock
+void outgoing(int sock, pool_handle h)
+{
+  const auto *p = (const proto_packetOutgoingMessage*) pool_get(h);
+  const Peer &c = peers[sock];
+  if (!com_is_pending(sock)) {
+    push_outgoing(sock, p, c);
+    return;
+  }
+  if (deferred.size() < SERVER_MAX_DEFERRED) {
+    int16_t i = c.session;
+    pool_ref(h);
+    deferred.push_back({sock, h, c.conn, i,
+        i >= 0 ? sessions[i].gen : (uint16_t) 0});
+    return;
+  }
+
+  proto_packet p_result;
+  log_error("server", "Too many pipelined messages, failing the one of %d",
+      sock);
+  proto_new_packetOutgoingResult((proto_packetOutgoingResult*) &p_result,
+      PROTO_OUTGOING_RESULT_INTERNAL_ERROR, p->tag);
+  reply(sock, p_result);
+}
+
+// push the outgoing message p of the client sender of sock to the buses
+void push_outgoing(int sock, const proto_packetOutgoingMessage *p,
+    const Peer &sender)
+{
+  Peer &c = peers[sock];
+  c.tag = p->tag;
+  c.pending_conn = sender.conn;
+  c.pending_session = sender.session;
+  c.pending_gen = sender.session >= 0 ? sessions[sender.session].gen : 0;
+  com_push(sock, p->dest, p->length, p->data);
+}
+
+// push the kept outgoing messages of the clients without a pending one, in
+// their order
+void push_deferred()
+{
+  size_t n = 0;
+  for (const Deferred &d : deferred) {
+    if (com_is_pending(d.sock)) {
+      deferred[n++] = d;
+      continue;
+    }
+    Peer sender;
+    sender.conn = d.conn;
+    sender.session = d.session;
+    push_outgoing(d.sock, (const proto_packetOutgoingMessage*) pool_get(d.h),
+        sender);
+    peers[d.sock].pending_gen = d.gen;
+    pool_unref(d.h);
+  }
+  deferred.resize(n);
+}
+
+// give the result p of the pending outgoing message of sock to the client
+// which sent it, or keep it in its session if it went away
+void result(int sock, const proto_packet &p)
+{
+  const Peer &c = peers[sock];
+  if (c.pending_conn == c.conn) {
+    reply(sock, p);
+    return;
+  }
+
+  int i = c.pending_session;
+  if (i < 0 || sessions[i].id == 0 || sessions[i].gen != c.pending_gen) {
+    log_info("server", "Result for the closed client %d dropped", sock);
+    return;
+  }
+  Session &s = sessions[i];
+  if (s.sock >= 0) { // resumed meanwhile
+    reply(s.sock, p);
+  } else if (s.n_results < SERVER_SESSION_RESULTS) {
+    s.results[s.n_results++] = p;
+  } else {
+    log_warn("server", "Too many results kept for session %016llx",
+        (unsigned long long) s.id);
+  }
+}
+
+// the client sock closed, its session waits for it to come back
+void closed(int sock)
+{
+  Peer &c = peers[sock];
+  if (c.session >= 0) {
+    sessions[c.session].sock = -1;
+    sessions[c.session].left = micros();
+  }
+
+  // without a session, no one waits for the results of its messages, its
+  // pending one is cancelled and its deferred ones dropped
+  if (c.session < 0 && c.pending_conn == c.conn && com_is_pending(sock))
+    com_cancel(sock);
+  size_t n = 0;
+  for (const Deferred &d : deferred) {
+    if (d.sock != sock || d.conn != c.conn || d.session >= 0)
+      deferred[n++] = d;
+    else
+      pool_unref(d.h);
+  }
+  deferred.resize(n);
+  c.conn++;
+  c.session = -1;
+}
+
+// attach the session presented by the client sock to it, or a new one, and
+// replay what the client missed
+void session_resume(int sock, const proto_packetSessionResume *p)
+{
+  Peer &c = peers[sock];
+  if (c.session >= 0) { // a session replaced by another one
+    sessions[c.session].sock = -1;
+    sessions[c.session].left = micros();
+    c.session = -1;
+  }
+
+  // the presented session, if it is still kept
+  int i = SERVER_MAX_SESSIONS;
+  for (int j = 0; p->session && j < SERVER_MAX_SESSIONS; j++) {
+    if (sessions[j].id == p->session) {
+      i = j;
+      break;
+    }
+  }
+  uint64_t now = micros();
+  if (i < SERVER_MAX_SESSIONS && sessions[i].sock < 0
+      && now - sessions[i].left > SERVER_SESSION_TIMEOUT * 1'000'000ull) {
+    free_session(i);
+    i = SERVER_MAX_SESSIONS;
+  }
+  bool resumed = i < SERVER_MAX_SESSIONS;
+  if (!resumed && (i = new_session()) < 0) {
+    proto_packet p_error;
+    log_error("server", "Too many sessions, refusing the one of %d", sock);
+    proto_new_packetError((proto_packetError*) &p_error,
+        PROTO_ERROR_TOO_MANY_SESSIONS);
+    reply(sock, p_error);
+    return;
+  }
+
+  // taken over from a connection not known to be closed yet
+  Session &s = sessions[i];
+  if (s.sock >= 0)
+    peers[s.sock].session = -1;
+  s.sock = sock;
+  c.session = i;
+
+  // the ingoing messages still held after the last one received
+  proto_seq first = next_seq;
+  if (resumed && p->seq < next_seq) {
+    proto_seq oldest = next_seq > SERVER_REPLAY_SIZE
+      ? next_seq - SERVER_REPLAY_SIZE : 1;
+    first = p->seq + 1 > oldest ? p->seq + 1 : oldest;
+  }
+  log_info("server", "Session %016llx %s by %d from %u", 
+      (unsigned long long) s.id, resumed ? "resumed" : "opened", sock, first);
+
+  proto_packet p_session;
+  proto_new_packetSession((proto_packetSession*) &p_session, s.id, first,
+      resumed, s.n_results);
+  broadcast(p_session, sock);
+  for (proto_seq seq = first; seq < next_seq; seq++) {
+    pool_handle h = replay[seq % SERVER_REPLAY_SIZE];
+    if (h != POOL_NONE)
+      broadcast_handle(h, sock);
+  }
+  for (unsigned int j = 0; j < s.n_results; j++)
+    broadcast(s.results[j], sock);
+  s.n_results = 0;
+}
+
+// take a free slot of sessions, or the one of the client away for the longest
+// time
+// Return its index, or -1 if every session has its client
+int new_session()
+{
+  int i = -1;
+  for (int j = 0; j < SERVER_MAX_SESSIONS; j++) {
+    if (!sessions[j].id) {
+      i = j;
+      break;
+    }
+    if (sessions[j].sock < 0 && (i < 0 || sessions[j].left < sessions[i].left))
+      i = j;
+  }
+  if (i < 0)
+    return -1;
+  if (sessions[i].id)
+    free_session(i);
+
+  Session &s = sessions[i];
+  while (!s.id) {
+    if (getrandom(&s.id, sizeof(s.id), 0) != sizeof(s.id)) {
+      log_perror("server", "Failed to draw a session id");
+      return -1;
+    }
+  }
+  return i;
+}
+
+void free_session(int i)
+{
+  Session &s = sessions[i];
+  log_info("server", "Session %016llx dropped with %u results",
+      (unsigned long long) s.id, s.n_results);
+  s.id = 0;
+  s.gen++;
+  s.sock = -1;
+  s.n_results = 0;
+}
+
+// queue the packet p for the client sock to its worker
+void reply(int sock, const proto_packet &p)
+{
+  Worker *w = workers[sock % n_workers];
+  pool_handle h = pool_new(p);
+  if (h == POOL_NONE) {
+    log_error("server", "Packet pool exhausted, dropping a packet for %d", sock);
+    metrics_add(METRICS_POOL_EXHAUSTED, 0);
+    return;
+  }
+  w->woken = true;
+  if (!w->replies.push({sock, h})) {
+    pool_unref(h);
+    log_error("server", "Replies queue of worker %u full, dropping a packet "
+        "for %d", w->index, sock);
+    metrics_add(METRICS_SERVER_DROPPED, w->index);
+  }
+}
+
+// publish the packet p to all the clients (or only to sock), through all the
+// workers
+void broadcast(const proto_packet &p, int sock)
+{
+  pool_handle h = pool_new(p);
+  if (h == POOL_NONE) {
+    log_error("server", "Packet pool exhausted, dropping a broadcast");
+    metrics_add(METRICS_POOL_EXHAUSTED, 0);
+    return;
+  }
+  broadcast_handle(h, sock);
+  pool_unref(h);
+}
+
+// publish the packet of the slot h like broadcast, every worker taking a
+// reference to it
+void broadcast_handle(pool_handle h, int sock)
+{
+  for (Worker *w : workers)
+    w->woken = true;
+  pool_ref(h, workers.size());
+  if (!broadcasts.push({sock, h})) {
+    for (size_t i = 0; i < workers.size(); i++)
+      pool_unref(h);
+    log_error("server", "Broadcasts ring full, dropping a packet");
+    metrics_add(METRICS_SERVER_DROPPED, 0);
+  }
+}
+
+void wake_up(int fd)
+{
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0) {} // a full counter wakes up too
+}
+
+// stop the workers and wait for them, server_run returning
+void stop_workers()
+{
+  running.store(false, std::memory_order_relaxed);
+  for (Worker *w : workers) {
+    wake_up(w->fd);
+    if (w->thread.joinable())
+      w->thread.join();
+  }
+}
+
+void forward_rule(int sock, const proto_packetForwardRule *p)
+{
+  proto_packet p_reply;
+  bool valid = true;
+
+  switch (p->action) {
+    case PROTO_FORWARD_ADD:
+      valid = fwd_add(p->src, p->prefix, p->prefix_length, p->dest, p->tmpl,
+          p->template_length);
+      break;
+    case PROTO_FORWARD_REMOVE:
+      valid = p->prefix_length <= PROTO_FORWARD_PREFIX_MAX_LENGTH;
+      if (valid)
+        fwd_remove(p->src, p->prefix, p->prefix_length);
+      break;
+    case PROTO_FORWARD_CLEAR:
+      fwd_clear();
+      break;
+    default:
+      valid = false;
+  }
+
+  if (valid) {
+    proto_new_packetInfo((proto_packetInfo*) &p_reply,
+        PROTO_INFO_FORWARD_UPDATED);
+  } else {
+    log_error("server", "Invalid forward rule from %d", sock);
+    proto_new_packetError((proto_packetError*) &p_reply,
+        PROTO_ERROR_INVALID_FORWARD_RULE);
+  }
+  reply(sock, p_reply);
+}
+
+void stats(int sock, const proto_packetStatsRequest *p)
+{
+  const metrics_family *f = metrics_get_family(p->metric);
+  metrics_summary s;
+
+  if (p->metric == METRICS_LOG_DROPPED)
+    metrics_set(METRICS_LOG_DROPPED, 0, log_get_dropped());
+  if (!f || !metrics_summarize(p->metric, p->label, &s)) {
+    proto_packet p_error;
+    log_error("server", "Invalid stats request from %d", sock);
+    proto_new_packetError((proto_packetError*) &p_error,
+        PROTO_ERROR_INVALID_STATS_REQUEST);
+    reply(sock, p_error);
+    return;
+  }
+
+  proto_packet p_reply;
+  auto *r = (proto_packetStats*) &p_reply;
+  proto_new_packetStats(r, p->metric, p->label, f->type, METRICS_N, f->name);
+  r->value = s.value;
+  r->sum = s.sum;
+  r->p50 = s.p50;
+  r->p90 = s.p90;
+  r->p99 = s.p99;
+  r->max = s.max;
+  reply(sock, p_reply);
+}
+
+void profile_dump(int sock)
+{
+  AllocAllowed allowed;
+  proto_packet p_reply;
+  if (prof_dump()) {
+    proto_new_packetInfo((proto_packetInfo*) &p_reply,
+        PROTO_INFO_PROFILE_DUMPED);
+  } else {
+    proto_new_packetError((proto_packetError*) &p_reply,
+        PROTO_ERROR_FAILED_PROFILE_DUMP);
+  }
+  reply(sock, p_reply);
+}
+
+void shm_request(int sock)
+{
+  if (socket_open_shm(sock))
+    return;
+
+  proto_packet p_error;
+  log_error("server", "Failed to open the shared memory transport of %d", sock);
+  proto_new_packetError((proto_packetError*) &p_error,
+      PROTO_ERROR_FAILED_SHM);
+  socket_push(sock, p_error);
+}
+
+uint64_t micros()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1'000'000 + t.tv_nsec / 1'000;
 }
 
 /*
@@ -28,7 +28,52 @@
 #define SERVER_MAX_RECEPTION 1024 
 #endif
 
-void server_init(unsigned int update_period=200'000);
+// Outgoing messages pushed by the clients while their previous one is pending
+#ifndef SERVER_MAX_DEFERRED
+#define SERVER_MAX_DEFERRED 4096
+#endif
+
+// Sessions of the clients (see protocol.hpp), each one keeping at most
+// SERVER_SESSION_RESULTS results for SERVER_SESSION_TIMEOUT s after its client
+// went away, and ingoing messages held to be replayed to them
+#ifndef SERVER_MAX_SESSIONS
+#define SERVER_MAX_SESSIONS 256
+#endif
+#ifndef SERVER_SESSION_RESULTS
+#define SERVER_SESSION_RESULTS 16
+#endif
+#ifndef SERVER_SESSION_TIMEOUT
+#define SERVER_SESSION_TIMEOUT 60
+#endif
+#ifndef SERVER_REPLAY_SIZE
+#define SERVER_REPLAY_SIZE 1024
+#endif
+
+// Threads serving the clients around the thread of server_run owning the buses
+#ifndef SERVER_MAX_WORKERS
+#define SERVER_MAX_WORKERS 16
+#endif
+
+// Packets of the requests of the workers and of the replies to each of them,
+// and broadcasts not yet taken by all of them, powers of two
+#ifndef SERVER_QUEUE_SIZE
+#define SERVER_QUEUE_SIZE 4096
+#endif
+#ifndef SERVER_BROADCAST_SIZE
+#define SERVER_BROADCAST_SIZE 4096
+#endif
+
+// serve the requests of the clients, and the Prometheus text of the metrics
+// on the local socket metrics_socket unless it is nullptr, the packet pool
+// being allocated (see pool_init)
+void server_init(unsigned int update_period=200'000,
+    const char *metrics_socket=nullptr);
+
+// serve the clients by n workers (1 by default, at most SERVER_MAX_WORKERS),
+// each one owning a shard of the sockets, to be called before server_run
+void server_set_workers(unsigned int n);
 
+// run the buses and start the workers, does not return unless the wait of the
+// buses or of a worker fails, the workers being stopped then
 void server_run();
 
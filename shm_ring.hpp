@@ -0,0 +1,161 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "protocol.hpp"
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Shared memory transport of a local client: a memfd holding two single
+// producer single consumer rings of protocol packets, requests written by the
+// client and replies written by the daemon. The producer of a ring only writes
+// to the eventfd of the consumer when the consumer announced it is going to
+// sleep (waiting), so a busy client exchanges packets without system calls.
+// The socket of the client stays its control channel: the rings are granted on
+// it (PROTO_HEAD_SHM_REQUEST) and closing it closes the transport.
+
+#define SHM_RING_MAGIC "PJONRNG1"
+#define SHM_RING_VERSION 1
+
+// file descriptors sent with PROTO_HEAD_SHM_GRANT
+#define SHM_FD_REGION 0
+#define SHM_FD_DAEMON 1 // written by the client to wake the daemon up
+#define SHM_FD_CLIENT 2 // written by the daemon to wake the client up
+#define SHM_FDS 3
+
+// in packets, must be a power of two
+#ifndef SHM_RING_SIZE
+#	define SHM_RING_SIZE 256
+#endif
+
+static_assert((SHM_RING_SIZE & (SHM_RING_SIZE - 1)) == 0,
+    "SHM_RING_SIZE must be a power of two");
+
+typedef struct {
+  alignas(64) std::atomic<uint32_t> head;    // written by the consumer
+  alignas(64) std::atomic<uint32_t> tail;    // written by the producer
+  alignas(64) std::atomic<uint32_t> waiting; // the consumer is sleeping
+  alignas(64) proto_packet packets[SHM_RING_SIZE];
+} shm_ring;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;       // of the region
+  uint32_t ring_size;
+  shm_ring requests;   // client to daemon
+  shm_ring replies;    // daemon to client
+} shm_region;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+    "The indexes of the rings must be lock free");
+
+// Producer: append the packet p to the ring r
+// Return false if r is full
+inline bool shm_ring_push(shm_ring *r, const proto_packet *p)
+{
+  uint32_t tail = r->tail.load(std::memory_order_relaxed);
+  if (tail - r->head.load(std::memory_order_acquire) == SHM_RING_SIZE)
+    return false;
+  memcpy(&r->packets[tail & (SHM_RING_SIZE - 1)], p, sizeof(*p));
+  r->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// Consumer: remove the oldest packet of the ring r into p
+// Return false if r is empty
+inline bool shm_ring_pop(shm_ring *r, proto_packet *p)
+{
+  uint32_t head = r->head.load(std::memory_order_relaxed);
+  if (head == r->tail.load(std::memory_order_acquire))
+    return false;
+  memcpy(p, &r->packets[head & (SHM_RING_SIZE - 1)], sizeof(*p));
+  r->head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+// Consumer: announce the consumer of r is going to wait on its eventfd
+// Return false if a packet arrived meanwhile, the consumer must not wait
+inline bool shm_ring_sleep(shm_ring *r)
+{
+  r->waiting.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return r->head.load(std::memory_order_relaxed)
+    == r->tail.load(std::memory_order_acquire);
+}
+
+// Producer: after pushing, wake the consumer of r up through the eventfd fd if
+// it is waiting
+inline void shm_ring_wake(shm_ring *r, int fd)
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (r->waiting.load(std::memory_order_relaxed)
+      && r->waiting.exchange(0, std::memory_order_relaxed)) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {} // a full counter wakes up too
+  }
+}
+
+// The clients only need this header
+
+// read from the socket sock like read, the file descriptors of a grant are
+// stored in fds (set to -1 otherwise)
+inline ssize_t shm_recv(int sock, void *buf, size_t n, int fds[SHM_FDS])
+{
+  char control[CMSG_SPACE(SHM_FDS * sizeof(int))];
+  struct iovec iov = {buf, n};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  for (int i = 0; i < SHM_FDS; i++)
+    fds[i] = -1;
+  ssize_t count = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  if (count > 0 && c && c->cmsg_level == SOL_SOCKET
+      && c->cmsg_type == SCM_RIGHTS
+      && c->cmsg_len == CMSG_LEN(SHM_FDS * sizeof(int)))
+    memcpy(fds, CMSG_DATA(c), SHM_FDS * sizeof(int));
+  return count;
+}
+
+// map the region of the memfd fd granted by g
+// Return nullptr in case of failure
+inline shm_region *shm_map(int fd, const proto_packetShmGrant *g)
+{
+  if (g->size != sizeof(shm_region) || g->ring_size != SHM_RING_SIZE)
+    return nullptr;
+  void *m = mmap(nullptr, sizeof(shm_region), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED)
+    return nullptr;
+
+  auto *r = (shm_region*) m;
+  if (memcmp(r->magic, SHM_RING_MAGIC, sizeof(r->magic)) != 0
+      || r->version != SHM_RING_VERSION) {
+    munmap(m, sizeof(shm_region));
+    return nullptr;
+  }
+  return r;
+}
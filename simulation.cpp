@@ -0,0 +1,193 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simulation.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+Simulation::Simulation(uint8_t target, uint32_t seed)
+{
+  this->target = target;
+  this->stamped = false;
+  this->rng = seed ? seed : 1;
+}
+
+void Simulation::set_target(uint8_t id)
+{
+  this->target = id;
+}
+
+void Simulation::set_stamped(bool stamped)
+{
+  this->stamped = stamped;
+}
+
+void Simulation::add_node(const sim_node &node)
+{
+  Node n;
+  n.config = node;
+  n.next_message = sim_micros() + node.period;
+  n.counter = 0;
+  this->nodes.push_back(n);
+}
+
+bool Simulation::deliver(const frame_packet *p, uint64_t now,
+    uint32_t *ack_delay)
+{
+  bool acked = false;
+
+  for (auto &n : this->nodes) {
+    if (p->receiver != n.config.id && p->receiver != FRAME_BROADCAST)
+      continue;
+    if (this->draw(n.config.drop_rate))
+      continue;
+
+    if (p->receiver != FRAME_BROADCAST && (p->header & FRAME_ACK_REQ_BIT)) {
+      acked = true;
+      *ack_delay = n.config.ack_latency;
+    }
+    if (n.config.reply == SIM_REPLY_ECHO) {
+      this->schedule(now + n.config.ack_latency + n.config.reply_latency,
+          n.config.id, p->payload, p->length);
+    }
+  }
+
+  return acked;
+}
+
+bool Simulation::poll(uint64_t now, frame_packet *p)
+{
+  for (auto &n : this->nodes) {
+    if (!n.config.period || n.next_message > now)
+      continue;
+    char payload[32];
+    int length;
+    if (this->stamped) {
+      memcpy(payload, SIM_STAMP_MAGIC, SIM_STAMP_MAGIC_LENGTH);
+      memcpy(&payload[SIM_STAMP_MAGIC_LENGTH], &now, sizeof(now));
+      length = SIM_STAMP_MAGIC_LENGTH + sizeof(now);
+    } else {
+      length = snprintf(payload, sizeof(payload), "tick %u", n.counter);
+    }
+    n.counter++;
+    this->schedule(n.next_message, n.config.id, (uint8_t*) payload, length);
+    n.next_message += n.config.period;
+  }
+
+  if (this->scheduled.empty() || this->scheduled.top().time > now)
+    return false;
+  *p = this->scheduled.top().packet;
+  this->scheduled.pop();
+  return true;
+}
+
+// xorshift32, good enough to draw the drops
+bool Simulation::draw(float probability)
+{
+  if (probability <= 0)
+    return false;
+  this->rng ^= this->rng << 13;
+  this->rng ^= this->rng >> 17;
+  this->rng ^= this->rng << 5;
+  return this->rng < probability * 4294967295.f;
+}
+
+void Simulation::schedule(uint64_t time, uint8_t sender, const uint8_t *data,
+    uint16_t n)
+{
+  Scheduled s;
+  s.time = time;
+  s.packet.receiver = this->target;
+  s.packet.sender = sender;
+  s.packet.header = FRAME_DEFAULT_HEADER;
+  s.packet.id = 0;
+  s.packet.port = 0;
+  s.packet.length = n;
+  memcpy(s.packet.payload, data, n);
+  this->scheduled.push(s);
+}
+
+uint64_t sim_micros()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1'000'000 + t.tv_nsec / 1'000;
+}
+
+int sim_open_pty(const char *link)
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0) {
+    perror("posix_openpt");
+    return -1;
+  }
+  if (grantpt(master) < 0 || unlockpt(master) < 0) {
+    perror("grantpt");
+    close(master);
+    return -1;
+  }
+
+  const char *slave_path = ptsname(master);
+  int slave = open(slave_path, O_RDWR | O_NOCTTY);
+  if (slave < 0) {
+    perror("open slave");
+    close(master);
+    return -1;
+  }
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  struct stat st;
+  if (lstat(link, &st) == 0 && S_ISLNK(st.st_mode))
+    unlink(link);
+  if (symlink(slave_path, link) < 0) {
+    perror("symlink");
+    close(slave);
+    close(master);
+    return -1;
+  }
+
+  return master;
+}
+
+bool sim_write_packet(int fd, const frame_packet *p, uint32_t bd)
+{
+  uint8_t packet[FRAME_MAX_LENGTH];
+  uint8_t frame[FRAME_TSA_MAX_LENGTH];
+
+  size_t n = frame_encode(p, packet, sizeof(packet));
+  if (!n)
+    return false;
+  n = frame_tsa_wrap(packet, n, frame, sizeof(frame));
+  if (!n)
+    return false;
+
+  usleep(sim_line_time(n, bd));
+  return write(fd, frame, n) == (ssize_t) n;
+}
+
+uint32_t sim_line_time(size_t n, uint32_t bd)
+{
+  // 8N1: 10 bits per byte
+  return bd ? (uint64_t) n * 10 * 1'000'000 / bd : 0;
+}
@@ -0,0 +1,108 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "frame.hpp"
+
+#include <functional>
+#include <queue>
+#include <vector>
+
+#define SIM_REPLY_NONE 0
+#define SIM_REPLY_ECHO 1
+
+// Stamped unsolicited messages start with SIM_STAMP_MAGIC followed by the
+// sim_micros() time they were sent at (8 bytes, host order)
+#define SIM_STAMP_MAGIC "PJT"
+#define SIM_STAMP_MAGIC_LENGTH 3
+
+typedef struct {
+  uint8_t id;
+  uint32_t ack_latency;   // in us
+  uint32_t reply_latency; // in us, after the acknowledgement
+  float drop_rate;        // probability for a frame to be ignored
+  uint8_t reply;          // SIM_REPLY_NONE or SIM_REPLY_ECHO
+  uint32_t period;        // between unsolicited messages in us, 0 to disable
+} sim_node;
+
+// Virtual PJON nodes answering the packets sent on a simulated bus. The
+// drops are drawn from a seeded generator so a run can be reproduced.
+class Simulation {
+
+  public:
+
+    Simulation(uint8_t target=0, uint32_t seed=1);
+
+    // Set the id the replies and unsolicited messages are sent to
+    void set_target(uint8_t id);
+
+    void add_node(const sim_node &node);
+
+    // Stamp the unsolicited messages with their sending time instead of a
+    // counter, to measure their delivery latency
+    void set_stamped(bool stamped);
+
+    // Deliver the packet p sent on the bus at the time now (in us)
+    // Return true if a node acknowledges it, ack_delay is then set to the
+    // time the node takes to acknowledge
+    bool deliver(const frame_packet *p, uint64_t now, uint32_t *ack_delay);
+
+    // Pop into p the next packet a node sent before the time now (in us)
+    // Return false if there is none
+    bool poll(uint64_t now, frame_packet *p);
+
+  private:
+
+    struct Scheduled {
+      uint64_t time;
+      frame_packet packet;
+      bool operator>(const Scheduled &s) const { return time > s.time; }
+    };
+
+    struct Node {
+      sim_node config;
+      uint64_t next_message;
+      uint32_t counter;
+    };
+
+    bool draw(float probability);
+    void schedule(uint64_t time, uint8_t sender, const uint8_t *data,
+        uint16_t n);
+
+    uint8_t target;
+    bool stamped;
+    uint32_t rng;
+    std::vector<Node> nodes;
+    std::priority_queue<Scheduled, std::vector<Scheduled>,
+      std::greater<Scheduled>> scheduled;
+
+};
+
+// Monotonic time in us used by the simulation
+uint64_t sim_micros();
+
+// Open a pseudo-terminal pair whose slave end is reachable through the
+// symbolic link link (e.g. SERIAL_DEVICE), an existing link is replaced. The
+// slave end is kept open so the master end stays usable across reconnections.
+// Return the master file descriptor, -1 in case of failure
+int sim_open_pty(const char *link);
+
+// Write the packet p as a ThroughSerialAsync frame to fd, after the time the
+// frame takes on a line at the baudrate bd
+// Return false in case of failure, true otherwise
+bool sim_write_packet(int fd, const frame_packet *p, uint32_t bd);
+
+// Return the time in us n bytes take on a line at the baudrate bd
+uint32_t sim_line_time(size_t n, uint32_t bd);
@@ -13,7 +13,16 @@
 */
 
 #include "socket.hpp"
+#include "socket_buffer.hpp"
+#include "alloc_check.hpp"
+#include "capture.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "queue.hpp"
+#include "shm_ring.hpp"
+#include "uring.hpp"
+#include <atomic>
+#include <poll.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -21,184 +30,533 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
-#include <queue>
 
-class InputBuffer {
-
-  public:
-
-    InputBuffer()
-    {
-      this->start = 0;
-      this->stop = 0;
-    }
-
-    bool ready()
-    {
-      return (this->stop - this->start) >= PROTO_PACKET_SIZE;
-    }
-
-    bool get(proto_packet *p)
-    {
-      if (!this->ready())
-        return false;
-      memcpy(p, &this->data[this->start], PROTO_PACKET_SIZE);
-      this->start += PROTO_PACKET_SIZE;
-      return true;
-    }
-
-    ssize_t read_file(int fd)
-    {
-      if (this->start != 0) {
-        memmove(this->data, &this->data[this->start], this->stop - this->start);
-        this->stop = this->stop - this->start;
-        this->start = 0;
-      }
-      ssize_t count = read(fd, &this->data[this->stop],
-          SOCKET_INPUT_BUFFER_SIZE - this->stop);
-      if (count > 0)
-        this->stop += count;
-
-      return count;
-    }
-
-  private:
-
-    unsigned int start, stop;
-    char data[SOCKET_INPUT_BUFFER_SIZE];
+// the listening sockets and the limit are shared by the shards, the rest of
+// the state is the one of the thread serving the shard (see socket_attach)
+static int master_socket = -1;
+static int seqpacket_socket = -1;
+static int tcp_socket = -1;
+static unsigned int max_clients;
+static std::atomic<unsigned int> n_clients(0);
+static thread_local unsigned int shard = 0, n_shards = 1;
+static thread_local fd_set active_fds, watched_fds, read_fds, write_fds; 
 
+// the first shard accepts the connections and hands them over to the others
+// in turn, through their queue and waking them up with its eventfd
+struct Handoff {
+  int fd;
+  int master;
+};
+struct HandoffQueue {
+  SpscQueue<Handoff, SOCKET_HANDOFF_SIZE> queue;
+  int fd = -1;
 };
+static std::atomic<HandoffQueue*> handoffs[SOCKET_MAX_SHARDS];
+static thread_local HandoffQueue *handoff = nullptr;
+static unsigned int next_shard = 0;
 
-class OutputQueue: public std::queue<proto_packet> {
+// shared memory transport of a client (see shm_ring.hpp)
+struct ShmTransport {
+  shm_region *region = nullptr;
+  int fd = -1; // eventfd waking the client up
+};
+static thread_local unsigned int n_transports = 0;
+static thread_local int shm_fd = -1; // eventfd waking the shard up, shared by
+                                     // its clients
 
-  public:
+// io_uring backend (see uring.hpp), the operations are in the user data of
+// their requests with the slot and the generation of its connection
+enum uring_op : uint8_t {
+  URING_ACCEPT, URING_RECV, URING_SEND, URING_POLL, URING_READY, URING_CANCEL
+};
+struct UringSocket {
+  bool receiving = false; // a read is submitted
+  bool closing = false;   // the read failed or reached the end of file
+  int error = 0;
+  bool sending = false;   // a write of send_buffer is submitted
+  size_t send_n = 0, send_off = 0;
+  char send_buffer[SOCKET_URING_SEND_BATCH * PROTO_PACKET_SIZE];
+};
+static thread_local bool use_uring = false;
 
-    OutputQueue(): std::queue<proto_packet>()
-  {}
+// a connected client, taken from the pool on connect and given back on close
+struct Client {
+  int fd = -1;
+  InputBuffer input;
+  OutputQueue output;
+  size_t output_off = 0; // bytes of the front packet already written
+  bool seqpacket = false; // one message per packet
+  bool tcp = false;
+  bool readable = false;  // of a SOCK_SEQPACKET client with io_uring
+  bool overflowed = false; // reached SOCKET_MAX_QUEUED, to be closed
+  ShmTransport shm;
+  UringSocket uring;
+};
 
-    void clear()
-    {
-      while (!this->empty())
-        this->pop();
-    }
+// the table of the clients of the shard: the free slots are reused last freed
+// first, so the table only grows to the highest number of simultaneous
+// connections. The released clients are kept, a write of io_uring may still
+// read their send buffer. The sock of a client is its slot times the number of
+// shards plus its shard.
+struct Slot {
+  Client *client = nullptr; // nullptr if the slot is free
+  uint32_t gen = 0;         // completions of older connections are ignored
+  unsigned int live = 0;    // index of its sock in live while connected
+};
+static thread_local std::vector<Slot> slots;
+static thread_local std::vector<unsigned int> free_slots;
+static thread_local std::vector<int> live; // socks of the clients, unordered
+static thread_local std::vector<int> closed; // socks not yet popped
+static thread_local std::vector<Client*> pool;
 
-}; 
+// a drained input buffer always has room for a read
+static_assert(URING_BUFFER_SIZE + PROTO_PACKET_SIZE <= SOCKET_INPUT_BUFFER_SIZE,
+    "URING_BUFFER_SIZE does not fit in the input buffers");
 
-static int master_socket = -1;
-static unsigned int max_clients;
-static fd_set active_fds, read_fds, write_fds; 
-static std::vector<InputBuffer> input_buffers;
-static std::vector<OutputQueue> output_queues;
-
-static int open_socket(const char* filename);
-static bool can_read(int sock);
-static bool can_write(int sock);
-static int accept_slave();
+static int open_socket(const char* filename, int type=SOCK_STREAM);
+static int open_tcp_socket(const char *address, uint16_t port);
+static void set_cork(int fd, int cork);
+static bool can_read(int fd);
+static bool can_write(int fd);
+static Client *get_client(int sock);
+static Slot &get_slot(int sock);
+static void accept_slaves(int master);
+static void dispatch_slave(int fd, int master);
+static void take_handoffs();
+static void add_slave(int fd, int master);
+static void refuse_slave(int fd);
 static void close_slave(int sock);
+static void enqueue(int sock, Client *c, pool_handle h);
+static bool shm_sleep();
+static int shm_send(int sock, Client *c);
+static void close_shm(Client *c);
+static uint64_t user_data(uint8_t op, int fd, uint32_t gen=0);
+static size_t receive_seqpacket(int sock, Client *c, proto_packet *packets,
+    size_t n_max);
+static int send_seqpacket(int sock, Client *c);
+static void arm_accept(int master);
+static void arm_poll(int fd);
+static void arm_recv(int sock, Client *c);
+static void arm_ready(int sock, Client *c);
+static bool arm_send(int sock, Client *c);
+static void complete(const struct io_uring_cqe *cqe);
+static size_t receive_uring(int sock, Client *c, proto_packet *packets,
+    size_t n_max);
+static int send_uring(int sock, Client *c);
 
 bool socket_init(const char *fp, unsigned int mc)
 {
   log_info("socket", "openning master socket");
 	master_socket = open_socket(fp);
   max_clients = mc;
-  input_buffers.resize(mc);
-  output_queues.resize(mc);
-  FD_ZERO(&active_fds);
-  FD_SET(master_socket, &active_fds);
   return master_socket < 0 ? false : true;
 }
 
+bool socket_init_seqpacket(const char *fp)
+{
+  log_info("socket", "openning SOCK_SEQPACKET master socket");
+  seqpacket_socket = open_socket(fp, SOCK_SEQPACKET);
+  return seqpacket_socket >= 0;
+}
+
+bool socket_init_tcp(const char *address, uint16_t port)
+{
+  log_info("socket", "openning TCP master socket on %s:%u", address, port);
+  tcp_socket = open_tcp_socket(address, port);
+  return tcp_socket >= 0;
+}
+
+bool socket_attach(unsigned int sh, unsigned int n)
+{
+  if (master_socket < 0 || n == 0 || n > SOCKET_MAX_SHARDS || sh >= n)
+    return false;
+  shard = sh;
+  n_shards = n;
+  // the clients themselves are allocated on connect
+  slots.reserve(max_clients);
+  free_slots.reserve(max_clients);
+  live.reserve(max_clients);
+  closed.reserve(max_clients);
+  pool.reserve(max_clients);
+  FD_ZERO(&active_fds);
+  FD_ZERO(&watched_fds);
+#ifdef SOCKET_IO_URING
+  use_uring = uring_open();
+#endif
+
+  if (shard != 0) {
+    handoff = new HandoffQueue;
+    handoff->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handoff->fd < 0) {
+      log_perror("socket", "Failed to create the eventfd of shard %u", shard);
+      return false;
+    }
+    socket_watch(handoff->fd);
+    handoffs[shard].store(handoff, std::memory_order_release);
+    return true;
+  }
+
+  for (int master : {master_socket, seqpacket_socket, tcp_socket}) {
+    if (master < 0)
+      continue;
+    FD_SET(master, &active_fds);
+    if (use_uring)
+      arm_accept(master);
+  }
+  return true;
+}
+
 bool socket_wait(unsigned int timeout)
 {
+  // no waiting while requests are left in the rings
+  if (!shm_sleep())
+    timeout = 0;
+
+  // the completions mark the sockets to be handled as readable
+  if (use_uring) {
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    if (!uring_wait(timeout))
+      return false;
+    uring_reap(complete);
+    if (shm_fd >= 0 && FD_ISSET(shm_fd, &read_fds)) {
+      uint64_t count;
+      if (read(shm_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_perror("socket", "Read shared memory eventfd");
+    }
+    take_handoffs();
+    return true;
+  }
+
   read_fds = active_fds;
   write_fds = active_fds;
 
   struct timeval tv = {0, timeout};
   if (select(FD_SETSIZE, &read_fds, NULL, NULL, &tv) < 0) {
-    log_perror("select read socket", "select");
+    // interrupted by a signal (e.g. a profile dump request), nothing is ready
+    if (errno == EINTR) {
+      FD_ZERO(&read_fds);
+      FD_ZERO(&write_fds);
+      return true;
+    }
+    log_perror("socket", "select read socket");
     return false;
   }
 
+  // reset the wake up counter of the rings
+  if (shm_fd >= 0 && FD_ISSET(shm_fd, &read_fds)) {
+    uint64_t count;
+    if (read(shm_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      log_perror("socket", "Read shared memory eventfd");
+  }
+
+  if (shard == 0 && can_read(master_socket))
+    accept_slaves(master_socket);
+  if (shard == 0 && seqpacket_socket >= 0 && can_read(seqpacket_socket))
+    accept_slaves(seqpacket_socket);
+  if (shard == 0 && tcp_socket >= 0 && can_read(tcp_socket))
+    accept_slaves(tcp_socket);
+  take_handoffs();
+
   tv.tv_usec = 0;
   if (select(FD_SETSIZE, NULL, &write_fds, NULL, &tv) < 0) {
-    log_perror("select write socket", "select");
+    // interrupted by a signal (e.g. a profile dump request), nothing is ready
+    if (errno == EINTR) {
+      FD_ZERO(&read_fds);
+      FD_ZERO(&write_fds);
+      return true;
+    }
+    log_perror("socket", "select write socket");
     return false;
   }
 
   return true;
 }
 
-std::vector<proto_packet> socket_receive(int sock)
+void socket_watch(int fd)
 {
-  proto_packet p;
-  std::vector<proto_packet> packets;
+  FD_SET(fd, &active_fds);
+  FD_SET(fd, &watched_fds);
+  if (use_uring)
+    arm_poll(fd);
+}
 
-  // not readable
-  if (!can_read(sock))
-    return packets;
+bool socket_is_readable(int fd)
+{
+  return can_read(fd);
+}
 
-  // new
-  if (sock == master_socket) {
-    accept_slave();
-    return packets; //TODO check need to return -> I think so
-  }
+size_t socket_receive(int sock, proto_packet *packets, size_t n_max)
+{
+  Client *c = get_client(sock);
+  size_t n = 0;
 
-  ssize_t count = input_buffers[sock].read_file(sock);
+  if (!c)
+    return 0;
 
-  // reading error
-	if (count < 0)
-    log_perror("socket", "Read socket");
-  
-  // end of file or error -> closing
-  if (count <= 0) {
-    close_slave(sock);
-    return packets;
+  if (c->seqpacket) {
+    if (use_uring ? c->readable : can_read(c->fd))
+      n = receive_seqpacket(sock, c, packets, n_max);
+    // closed
+    if (!get_client(sock))
+      return 0;
+  } else if (use_uring) {
+    n = receive_uring(sock, c, packets, n_max);
+  } else if (can_read(c->fd)) {
+    ssize_t count = c->input.read_file(c->fd);
+    bool again = count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+    // reading error
+    if (count < 0 && !again)
+      log_perror("socket", "Read socket");
+
+    // end of file or error -> closing
+    if (count == 0 || (count < 0 && !again)) {
+      close_slave(sock);
+      return 0;
+    }
+
+    // get packets
+    if (count > 0)
+      metrics_add(METRICS_CLIENT_BYTES_IN, sock, count);
+    while(n < n_max && c->input.get(&packets[n])) {
+      capture_socket(CAPTURE_SOCKET_IN, sock, &packets[n]);
+      n++;
+    }
   }
 
-  // get packets
-  while(input_buffers[sock].get(&p))
-    packets.push_back(p);
+  // then the ones of the shared memory ring, the rest is left for the next call
+  if (c->shm.region) {
+    shm_ring *r = &c->shm.region->requests;
+    while (n < n_max && shm_ring_pop(r, &packets[n])) {
+      capture_socket(CAPTURE_SOCKET_IN, sock, &packets[n]);
+      n++;
+    }
+  }
+  metrics_add(METRICS_CLIENT_PACKETS_IN, sock, n);
 
-  return packets;
+  return n;
 }
 
 void socket_push(int sock, proto_packet p)
 {
-  if (sock != SOCKET_ALL) {
-    output_queues[sock].push(p);
+  Client *c = nullptr;
+  if (sock != SOCKET_ALL && !(c = get_client(sock)))
+    return;
+  pool_handle h = pool_new(p);
+  if (h == POOL_NONE) {
+    log_error("socket", "Packet pool exhausted, dropping a packet for %d", sock);
+    metrics_add(METRICS_POOL_EXHAUSTED, 0);
+    return;
+  }
+  if (!c) {
+    socket_push_handle(sock, h);
+    pool_unref(h);
     return;
   }
+  enqueue(sock, c, h);
+}
 
-  //TODO can be done better? 
-  int max_clients = socket_get_max_clients();
-  for (int sock = 0; sock < max_clients; sock++) {
-    if (FD_ISSET(sock, &active_fds) && sock != master_socket)
-      socket_push(sock, p);
+void socket_push_handle(int sock, pool_handle h)
+{
+  if (sock != SOCKET_ALL) {
+    Client *c = get_client(sock);
+    if (!c)
+      return;
+    pool_ref(h);
+    enqueue(sock, c, h);
+    return;
   }
 
+  // the references of all the clients at once
+  if (live.empty())
+    return;
+  pool_ref(h, live.size());
+  for (int sock : live)
+    enqueue(sock, get_slot(sock).client, h);
 }
 
 int socket_send(int sock)
 {
-  if (!can_write(sock))
+  Client *c = get_client(sock);
+  if (!c)
+    return 0;
+  // what it missed is only given back by resuming its session
+  if (c->overflowed) {
+    close_slave(sock);
+    return 0;
+  }
+  if (c->shm.region)
+    return shm_send(sock, c);
+  // with io_uring, a full socket is tried again on the next call
+  if (c->seqpacket)
+    return use_uring || can_write(c->fd) ? send_seqpacket(sock, c) : 0;
+  if (use_uring)
+    return send_uring(sock, c);
+  if (!can_write(c->fd))
     return 0;
 
-  auto& q = output_queues[sock];
+  // the packets are written together until the socket is full, a packet partly
+  // written is completed by the next call, a failed write is reported by the
+  // read closing the connection. A TCP client is corked while its queue takes
+  // several writes so that its segments stay full.
+  struct iovec iovs[SOCKET_WRITE_BATCH];
+  struct msghdr msg;
+  auto& q = c->output;
   unsigned int n = 0;
+  size_t bytes = 0;
+  bool cork = c->tcp && q.size() > SOCKET_WRITE_BATCH;
 
+  if (cork)
+    set_cork(c->fd, 1);
   while (!q.empty()) {
-    ssize_t count = write(sock, &q.front(), sizeof(proto_packet));
-    if (count == sizeof(proto_packet))
+    size_t batch = q.size() < SOCKET_WRITE_BATCH ? q.size()
+      : SOCKET_WRITE_BATCH;
+    for (size_t i = 0; i < batch; i++)
+      iovs[i] = {&q.at(i), sizeof(proto_packet)};
+    iovs[0].iov_base = (char*) iovs[0].iov_base + c->output_off;
+    iovs[0].iov_len -= c->output_off;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = batch;
+    ssize_t count = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (count <= 0)
+      break;
+    bytes += count;
+
+    size_t written = c->output_off + count;
+    size_t packets = written / sizeof(proto_packet);
+    for (size_t i = 0; i < packets; i++)
       q.pop();
-    n++;
+    n += packets;
+    c->output_off = written % sizeof(proto_packet);
+    if (packets < batch)
+      break;
+  }
+  if (cork)
+    set_cork(c->fd, 0);
+  metrics_add(METRICS_CLIENT_PACKETS_OUT, sock, n);
+  metrics_add(METRICS_CLIENT_BYTES_OUT, sock, bytes);
+
+  return n;
+}
+
+bool socket_open_shm(int sock)
+{
+  // a TCP client does not share the memory of the daemon
+  Client *c = get_client(sock);
+  if (!c || c->shm.region || c->tcp)
+    return false;
+  ShmTransport &t = c->shm;
+
+  if (shm_fd < 0) {
+    shm_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shm_fd < 0) {
+      log_perror("socket", "Failed to create the shared memory eventfd");
+      return false;
+    }
+    socket_watch(shm_fd);
   }
 
+  int fd = memfd_create("PJON-rings", MFD_CLOEXEC);
+  if (fd < 0) {
+    log_perror("socket", "Failed to create the rings of %d", sock);
+    return false;
+  }
+  void *m = MAP_FAILED;
+  if (ftruncate(fd, sizeof(shm_region)) == 0)
+    m = mmap(nullptr, sizeof(shm_region), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+  if (m == MAP_FAILED) {
+    log_perror("socket", "Failed to map the rings of %d", sock);
+    close(fd);
+    return false;
+  }
+  t.region = (shm_region*) m;
+  t.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  n_transports++;
+  if (t.fd < 0) {
+    log_perror("socket", "Failed to create the eventfd of %d", sock);
+    close(fd);
+    close_shm(c);
+    return false;
+  }
+
+  // the memfd is zeroed, the magic last as for the stats page
+  t.region->version = SHM_RING_VERSION;
+  t.region->size = sizeof(shm_region);
+  t.region->ring_size = SHM_RING_SIZE;
+  memcpy(t.region->magic, SHM_RING_MAGIC, sizeof(t.region->magic));
+
+  // the grant is sent before the packets still queued, which go to the ring
+  proto_packet p;
+  proto_new_packetShmGrant((proto_packetShmGrant*) &p, sizeof(shm_region),
+      SHM_RING_SIZE);
+  int fds[SHM_FDS];
+  fds[SHM_FD_REGION] = fd;
+  fds[SHM_FD_DAEMON] = shm_fd;
+  fds[SHM_FD_CLIENT] = t.fd;
+
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {&p, sizeof(p)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // a partly written packet would be cut by the grant
+  ssize_t count = -1;
+  if (c->output_off == 0)
+    count = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+  close(fd);
+  if (count != sizeof(p)) {
+    log_perror("socket", "Failed to grant the rings to %d", sock);
+    close_shm(c);
+    return false;
+  }
+
+  capture_socket(CAPTURE_SOCKET_OUT, sock, &p);
+  metrics_add(METRICS_CLIENT_PACKETS_OUT, sock);
+  metrics_add(METRICS_CLIENT_BYTES_OUT, sock, sizeof(p));
+  log_info("socket", "Shared memory transport for slave %d", sock);
+  return true;
+}
+
+size_t socket_pop_closed(int *socks, size_t n_max)
+{
+  size_t n = n_max < closed.size() ? n_max : closed.size();
+  for (size_t i = 0; i < n; i++)
+    socks[i] = closed[i];
+  closed.erase(closed.begin(), closed.begin() + n);
+  return n;
+}
+
+const char *socket_get_backend()
+{
+  return use_uring ? "io_uring" : "select";
+}
+
+size_t socket_get_clients(int *socks, size_t n_max)
+{
+  size_t n = n_max < live.size() ? n_max : live.size();
+  memcpy(socks, live.data(), n * sizeof(int));
   return n;
 }
 
@@ -212,9 +570,9 @@ bool socket_quit()
   return true;
 }
 
-int open_socket(const char* filename)
+int open_socket(const char* filename, int type)
 {
-	int sock = socket(PF_LOCAL, SOCK_STREAM, 0);
+	int sock = socket(PF_LOCAL, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sock < 0) {
 		perror("socket");
     return -1;
@@ -240,44 +598,603 @@ int open_socket(const char* filename)
 	return sock;
 }
 
-bool can_read(int sock)
+int open_tcp_socket(const char *address, uint16_t port)
+{
+  struct addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  int err = getaddrinfo(address, service, &hints, &ai);
+  if (err) {
+    log_error("socket", "Failed to resolve %s: %s", address, gai_strerror(err));
+    return -1;
+  }
+
+  int sock = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+      0);
+  int one = 1;
+  if (sock < 0
+      || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+      || bind(sock, ai->ai_addr, ai->ai_addrlen) < 0
+      || listen(sock, 10000) < 0) {
+    log_perror("socket", "Failed to listen on %s:%u", address, port);
+    if (sock >= 0)
+      close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(ai);
+  return sock;
+}
+
+void set_cork(int fd, int cork)
+{
+  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) < 0)
+    log_perror("socket", "Failed to set TCP_CORK");
+}
+
+bool can_read(int fd)
+{
+  return FD_ISSET(fd, &read_fds);
+}
+
+bool can_write(int fd)
 {
-  return FD_ISSET(sock, &read_fds);
+  return FD_ISSET(fd, &write_fds);
 }
 
-bool can_write(int sock)
+// Return the client sock, nullptr if it is not one of the shard or closed
+Client *get_client(int sock)
 {
-  return FD_ISSET(sock, &write_fds);
+  if (sock < 0 || (unsigned int) sock % n_shards != shard
+      || (unsigned int) sock / n_shards >= slots.size())
+    return nullptr;
+  return slots[sock / n_shards].client;
 }
 
-int accept_slave()
+// the slot of a client of the shard
+Slot &get_slot(int sock)
 {
-	struct sockaddr_in client;
-	socklen_t size = sizeof(client);
-	int slave = accept(master_socket, (struct sockaddr*) &client, &size);
-	if (slave < 0) {
-		log_perror("socket", "Accept slave");
+  return slots[sock / n_shards];
+}
+
+// accept all the pending connections of the master socket master
+void accept_slaves(int master)
+{
+  while (true) {
+    int fd = accept4(master, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_perror("socket", "Accept slave");
+      return;
+    }
+    dispatch_slave(fd, master);
+  }
+}
+
+// the limit is counted from the acceptation, the first shard keeps the
+// connection if the queue of the next one is full
+void dispatch_slave(int fd, int master)
+{
+  if (n_clients.fetch_add(1, std::memory_order_relaxed) >= max_clients) {
+    n_clients.fetch_sub(1, std::memory_order_relaxed);
+    refuse_slave(fd);
+    return;
+  }
+
+  unsigned int target = next_shard;
+  next_shard = (next_shard + 1) % n_shards;
+  HandoffQueue *h = nullptr;
+  if (target != shard)
+    h = handoffs[target].load(std::memory_order_acquire);
+  if (h && h->queue.push({fd, master})) {
+    uint64_t one = 1;
+    if (write(h->fd, &one, sizeof(one)) < 0) {} // a full counter wakes up too
+    return;
+  }
+  add_slave(fd, master);
+}
+
+// the connections accepted for the shard by the first one
+void take_handoffs()
+{
+  if (!handoff || !can_read(handoff->fd))
+    return;
+  uint64_t count;
+  if (read(handoff->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    log_perror("socket", "Read handoff eventfd");
+  Handoff h;
+  while (handoff->queue.pop(&h))
+    add_slave(h.fd, h.master);
+}
+
+void add_slave(int fd, int master)
+{
+  bool seqpacket = master == seqpacket_socket;
+  bool tcp = master == tcp_socket;
+
+  // select only handles the fds below FD_SETSIZE
+  if (!use_uring && fd >= FD_SETSIZE) {
+    n_clients.fetch_sub(1, std::memory_order_relaxed);
+    refuse_slave(fd);
+    return;
+  }
+
+  // a new slot and client may be allocated
+  AllocAllowed allowed;
+  unsigned int slot;
+  if (!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  } else {
+    slot = slots.size();
+    slots.emplace_back();
+  }
+  int sock = slot * n_shards + shard;
+  Client *c;
+  if (!pool.empty()) {
+    c = pool.back();
+    pool.pop_back();
   } else {
-    FD_SET(slave, &active_fds);
-    log_info("socket", "New slave %d", slave);
+    c = new Client;
   }
 
-  // be sure the output queue is empty
-  output_queues[slave].clear();
+  // be sure the buffers are empty
+  c->fd = fd;
+  c->input.clear();
+  c->output.clear();
+  c->output_off = 0;
+  c->seqpacket = seqpacket;
+  c->tcp = tcp;
+  c->readable = false;
+  c->overflowed = false;
+  c->uring.receiving = false;
+  c->uring.closing = false;
+  c->uring.error = 0;
+  c->uring.sending = false;
+  slots[slot].client = c;
+  slots[slot].live = live.size();
+  live.push_back(sock);
+
+  if (!use_uring)
+    FD_SET(fd, &active_fds);
+  log_info("socket", "New slave %d (fd %d%s)", sock, fd,
+      seqpacket ? ", SOCK_SEQPACKET" : tcp ? ", TCP" : "");
+
+  // the packets are small and latency bound, their writes are coalesced
+  int one = 1;
+  if (tcp && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+    log_perror("socket", "Failed to set TCP_NODELAY on %d", sock);
+  metrics_reset(METRICS_CLIENT_BYTES_IN, sock);
+  metrics_reset(METRICS_CLIENT_BYTES_OUT, sock);
+  metrics_reset(METRICS_CLIENT_PACKETS_IN, sock);
+  metrics_reset(METRICS_CLIENT_PACKETS_OUT, sock);
+  metrics_add(METRICS_CLIENTS, 0);
 
   // send version packet
   proto_packet p;
   proto_new_packetVersion((proto_packetVersion*) &p, PROTO_VERSION);
-  socket_push(slave, p);
-	return slave;
+  socket_push(sock, p);
+
+  if (use_uring && seqpacket)
+    arm_ready(sock, c);
+  else if (use_uring)
+    arm_recv(sock, c);
+}
+
+// tell the client why before closing, its socket buffer is empty
+void refuse_slave(int fd)
+{
+  log_error("socket", "Too many slaves, refusing fd %d", fd);
+  proto_packet p;
+  proto_new_packetError((proto_packetError*) &p,
+      PROTO_ERROR_TOO_MANY_CLIENTS);
+  if (send(fd, &p, sizeof(p), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {}
+  close(fd);
 }
 
 void close_slave(int sock)
 {
-  log_info("socket", "Remove slave %d", sock);
-  close(sock);
-  FD_CLR(sock, &active_fds);
-  // empty output queue
-  output_queues[sock].clear();
+  Slot &s = get_slot(sock);
+  Client *c = s.client;
+  log_info("socket", "Remove slave %d (fd %d)", sock, c->fd);
+  // the poll holds the socket open until removed
+  if (use_uring && c->seqpacket) {
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe) {
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->addr = user_data(URING_READY, sock, s.gen);
+      sqe->user_data = user_data(URING_CANCEL, sock);
+    } else {
+      log_error("socket", "io_uring full, slave %d left open", sock);
+    }
+  }
+  // a pending read of io_uring also holds the socket open (e.g. of a client
+  // closed for not reading), its completion is ignored
+  shutdown(c->fd, SHUT_RDWR);
+  close(c->fd);
+  if (!use_uring)
+    FD_CLR(c->fd, &active_fds);
+  metrics_add(METRICS_CLIENTS, 0, -1);
+  close_shm(c);
+  c->output.clear(); // its packets go back to the pool
+
+  // the storage was reserved, a write may still complete, the next connection
+  // of the slot will not see it
+  s.client = nullptr;
+  s.gen++;
+  int last = live.back();
+  live[s.live] = last;
+  get_slot(last).live = s.live;
+  live.pop_back();
+  free_slots.push_back(sock / n_shards);
+  pool.push_back(c);
+  n_clients.fetch_sub(1, std::memory_order_relaxed);
+  if (closed.size() < closed.capacity())
+    closed.push_back(sock);
+  else
+    log_error("socket", "Too many closed slaves, %d not announced", sock);
+}
+
+// append the slot h to the output queue of the client sock, taking over a
+// reference, or drop it if the client does not read its packets
+void enqueue(int sock, Client *c, pool_handle h)
+{
+  if (!c->overflowed && c->output.size() >= SOCKET_MAX_QUEUED) {
+    log_warn("socket", "Slave %d not reading %d queued packets, closing it",
+        sock, SOCKET_MAX_QUEUED);
+    c->overflowed = true;
+  }
+  if (c->overflowed) {
+    pool_unref(h);
+    metrics_add(METRICS_SOCKET_DROPPED, shard);
+    return;
+  }
+  capture_socket(CAPTURE_SOCKET_OUT, sock, pool_get(h));
+  c->output.push(h);
+}
+
+// announce the daemon is going to wait to the clients with rings
+// Return false if a ring still holds requests
+bool shm_sleep()
+{
+  bool empty = true;
+  for (size_t i = 0; n_transports && i < live.size(); i++) {
+    Client *c = get_slot(live[i]).client;
+    if (c->shm.region && !shm_ring_sleep(&c->shm.region->requests))
+      empty = false;
+  }
+  return empty;
+}
+
+// move the output queue of sock to its replies ring, what does not fit waits
+// for the next call
+int shm_send(int sock, Client *c)
+{
+  ShmTransport &t = c->shm;
+  auto& q = c->output;
+  unsigned int n = 0;
+
+  while (!q.empty() && shm_ring_push(&t.region->replies, &q.front())) {
+    q.pop();
+    n++;
+  }
+  if (n)
+    shm_ring_wake(&t.region->replies, t.fd);
+  metrics_add(METRICS_CLIENT_PACKETS_OUT, sock, n);
+
+  return n;
+}
+
+void close_shm(Client *c)
+{
+  ShmTransport &t = c->shm;
+  if (!t.region)
+    return;
+  munmap(t.region, sizeof(shm_region));
+  if (t.fd >= 0)
+    close(t.fd);
+  t.region = nullptr;
+  t.fd = -1;
+  n_transports--;
+}
+
+
+// each message of a SOCK_SEQPACKET client is a packet, read in place by one
+// call, a message of another size is dropped
+size_t receive_seqpacket(int sock, Client *c, proto_packet *packets,
+    size_t n_max)
+{
+  struct mmsghdr msgs[SOCKET_MAX_RECEPTION];
+  struct iovec iovs[SOCKET_MAX_RECEPTION];
+  size_t n = 0, bytes = 0;
+
+  if (n_max > SOCKET_MAX_RECEPTION)
+    n_max = SOCKET_MAX_RECEPTION;
+  memset(msgs, 0, n_max * sizeof(*msgs));
+  for (size_t i = 0; i < n_max; i++) {
+    iovs[i] = {&packets[i], sizeof(proto_packet)};
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int count = recvmmsg(c->fd, msgs, n_max, MSG_DONTWAIT, nullptr);
+  if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    c->readable = false;
+    return 0;
+  }
+  if (count < 0) {
+    log_perror("socket", "Read socket");
+    close_slave(sock);
+    return 0;
+  }
+  // the poll of io_uring only completes again for new messages
+  if ((size_t) count < n_max)
+    c->readable = false;
+
+  for (int i = 0; i < count; i++) {
+    // end of file -> closing, once the messages before are handled
+    if (msgs[i].msg_len == 0) {
+      c->readable = true;
+      if (n == 0)
+        close_slave(sock);
+      break;
+    }
+    if (msgs[i].msg_len != sizeof(proto_packet)
+        || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+      log_warn("socket", "Dropping a message of %s%u bytes of %d",
+          msgs[i].msg_hdr.msg_flags & MSG_TRUNC ? "more than " : "",
+          msgs[i].msg_len, sock);
+      continue;
+    }
+    bytes += msgs[i].msg_len;
+    if (n != (size_t) i)
+      packets[n] = packets[i];
+    capture_socket(CAPTURE_SOCKET_IN, sock, &packets[n]);
+    n++;
+  }
+  metrics_add(METRICS_CLIENT_BYTES_IN, sock, bytes);
+
+  return n;
+}
+
+// write the output queue of a SOCK_SEQPACKET client, one message per packet,
+// until its socket is full
+int send_seqpacket(int sock, Client *c)
+{
+  struct mmsghdr msgs[SOCKET_SEQPACKET_BATCH];
+  struct iovec iovs[SOCKET_SEQPACKET_BATCH];
+  auto& q = c->output;
+  unsigned int n = 0;
+
+  while (!q.empty()) {
+    size_t batch = q.size() < SOCKET_SEQPACKET_BATCH ? q.size()
+      : SOCKET_SEQPACKET_BATCH;
+    memset(msgs, 0, batch * sizeof(*msgs));
+    for (size_t i = 0; i < batch; i++) {
+      iovs[i] = {&q.at(i), sizeof(proto_packet)};
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    // a failed write is reported by the read closing the connection
+    int count = sendmmsg(c->fd, msgs, batch, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (count <= 0)
+      break;
+    for (int i = 0; i < count; i++)
+      q.pop();
+    n += count;
+    if ((size_t) count < batch)
+      break;
+  }
+  metrics_add(METRICS_CLIENT_PACKETS_OUT, sock, n);
+  metrics_add(METRICS_CLIENT_BYTES_OUT, sock, n*sizeof(proto_packet));
+
+  return n;
+}
+
+uint64_t user_data(uint8_t op, int fd, uint32_t gen)
+{
+  return (uint64_t) op << 56 | (uint64_t) (gen & 0xFFFFFF) << 32
+    | (uint32_t) fd;
 }
 
+void arm_accept(int master)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (!sqe) {
+    log_error("socket", "io_uring full, not accepting slaves anymore");
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = master;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = user_data(URING_ACCEPT, master);
+}
+
+void arm_poll(int fd)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (!sqe) {
+    log_error("socket", "io_uring full, not watching %d anymore", fd);
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = user_data(URING_POLL, fd);
+}
+
+// retried by the next receive_uring if the queue is full
+void arm_recv(int sock, Client *c)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->len = URING_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = user_data(URING_RECV, sock, get_slot(sock).gen);
+  c->uring.receiving = true;
+}
+
+// a SOCK_SEQPACKET client is read by recvmmsg once io_uring reports it readable
+void arm_ready(int sock, Client *c)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (!sqe) {
+    log_error("socket", "io_uring full, not reading %d anymore", sock);
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = c->fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = user_data(URING_READY, sock, get_slot(sock).gen);
+}
+
+// write what is left of the send buffer of sock
+bool arm_send(int sock, Client *c)
+{
+  UringSocket &u = c->uring;
+  struct io_uring_sqe *sqe = uring_get_sqe();
+  if (!sqe)
+    return false;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->fd;
+  sqe->addr = (uintptr_t) &u.send_buffer[u.send_off];
+  sqe->len = u.send_n - u.send_off;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data(URING_SEND, sock, get_slot(sock).gen);
+  u.sending = true;
+  return true;
+}
+
+void complete(const struct io_uring_cqe *cqe)
+{
+  uint8_t op = cqe->user_data >> 56;
+  uint32_t gen = (cqe->user_data >> 32) & 0xFFFFFF;
+  int fd = (uint32_t) cqe->user_data;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+
+  if (op == URING_ACCEPT) {
+    if (cqe->res >= 0) {
+      dispatch_slave(cqe->res, fd);
+    } else {
+      errno = -cqe->res;
+      log_perror("socket", "Accept slave");
+    }
+    if (!more)
+      arm_accept(fd);
+    return;
+  }
+
+  if (op == URING_CANCEL)
+    return;
+
+  if (op == URING_POLL) {
+    if (cqe->res >= 0)
+      FD_SET(fd, &read_fds);
+    if (!more)
+      arm_poll(fd);
+    return;
+  }
+
+  // the completions of a closed connection only give their buffer back
+  int sock = fd;
+  Client *c = get_client(sock);
+  if (!c || gen != (get_slot(sock).gen & 0xFFFFFF)) {
+    uring_recycle(cqe);
+    return;
+  }
+  UringSocket &u = c->uring;
+
+  if (op == URING_READY) {
+    if (cqe->res >= 0)
+      c->readable = true;
+    if (!more)
+      arm_ready(sock, c);
+    return;
+  }
+
+  if (op == URING_RECV) {
+    u.receiving = false;
+    if (cqe->res > 0) {
+      c->input.append(uring_buffer(cqe), cqe->res);
+      metrics_add(METRICS_CLIENT_BYTES_IN, sock, cqe->res);
+    } else if (cqe->res != -ENOBUFS) {
+      u.closing = true;
+      u.error = -cqe->res;
+    }
+    uring_recycle(cqe);
+    return;
+  }
+
+  // a failed write is reported by the read closing the connection
+  u.sending = false;
+  if (cqe->res > 0) {
+    u.send_off += cqe->res;
+    if (u.send_off < u.send_n && !arm_send(sock, c))
+      log_error("socket", "io_uring full, dropping packets of %d", sock);
+  }
+}
+
+// the reads completed by uring_wait are already in the input buffer of sock
+size_t receive_uring(int sock, Client *c, proto_packet *packets, size_t n_max)
+{
+  UringSocket &u = c->uring;
+  size_t n = 0;
+
+  // end of file or error -> closing
+  if (u.closing) {
+    if (u.error) {
+      errno = u.error;
+      log_perror("socket", "Read socket");
+    }
+    close_slave(sock);
+    return 0;
+  }
+
+  while (n < n_max && c->input.get(&packets[n])) {
+    capture_socket(CAPTURE_SOCKET_IN, sock, &packets[n]);
+    n++;
+  }
+  if (!u.receiving && c->input.space() >= URING_BUFFER_SIZE)
+    arm_recv(sock, c);
+
+  return n;
+}
+
+// copy a batch of the output queue of sock to its send buffer and submit its
+// write, the next batch waits for its completion
+int send_uring(int sock, Client *c)
+{
+  UringSocket &u = c->uring;
+  auto& q = c->output;
+  unsigned int n = 0;
+
+  if (u.sending || q.empty())
+    return 0;
+
+  while (!q.empty() && n < SOCKET_URING_SEND_BATCH) {
+    memcpy(&u.send_buffer[n * PROTO_PACKET_SIZE], &q.front(),
+        PROTO_PACKET_SIZE);
+    q.pop();
+    n++;
+  }
+  u.send_n = n * PROTO_PACKET_SIZE;
+  u.send_off = 0;
+  if (!arm_send(sock, c)) {
+    log_error("socket", "io_uring full, dropping packets of %d", sock);
+    return 0;
+  }
+  metrics_add(METRICS_CLIENT_PACKETS_OUT, sock, n);
+  metrics_add(METRICS_CLIENT_BYTES_OUT, sock, u.send_n);
+
+  return n;
+}
@@ -14,13 +14,12 @@
 
 //TODO check includes in .cpp
 //TODO implement socket_quit()
-//TODO empty output queue if socket closes
 //TODO check wrong term "stack" in other files and replace by "queue"
-//TODO correctly handle max clients -> refuse connection if too much
 //TODO bigger defualt SOCKET_INPUT_BUFFER_SIZE
 
 #pragma once
 
+#include "pool.hpp"
 #include "protocol.hpp"
 #include <sys/select.h>
 #include <vector>
@@ -29,33 +28,133 @@
 #define SOCKET_INPUT_BUFFER_SIZE 2048
 #endif
 
+// Initial capacity of the output queue of a client, in packets, must be a
+// power of two
+#ifndef SOCKET_OUTPUT_QUEUE_SIZE
+#define SOCKET_OUTPUT_QUEUE_SIZE 8
+#endif
+
+// Packets queued for a client beyond which it is taken as not reading: the
+// packets for it are dropped and it is disconnected by its next socket_send,
+// so that it cannot hold the slots of the pool (see pool.hpp) of the others
+#ifndef SOCKET_MAX_QUEUED
+#define SOCKET_MAX_QUEUED 4096
+#endif
+
+// Packets of a client written by one io_uring request
+#ifndef SOCKET_URING_SEND_BATCH
+#define SOCKET_URING_SEND_BATCH 16
+#endif
+
+// Packets of a stream client written by one sendmsg call with select
+#ifndef SOCKET_WRITE_BATCH
+#define SOCKET_WRITE_BATCH 32
+#endif
+
+// Packets of a SOCK_SEQPACKET client written by one sendmmsg call
+#ifndef SOCKET_SEQPACKET_BATCH
+#define SOCKET_SEQPACKET_BATCH 32
+#endif
+
+// Threads serving the clients (see socket_attach), and connections handed
+// over to one of them waiting to be taken, a power of two
+#ifndef SOCKET_MAX_SHARDS
+#define SOCKET_MAX_SHARDS 16
+#endif
+#ifndef SOCKET_HANDOFF_SIZE
+#define SOCKET_HANDOFF_SIZE 256
+#endif
+
+// Maximum number of packets returned by a socket_receive call
+#define SOCKET_MAX_RECEPTION (SOCKET_INPUT_BUFFER_SIZE / PROTO_PACKET_SIZE)
+
 #define SOCKET_ALL -1
 
 // Initialize the socket to the file path filepath with a maximum number of
-// clients mc 
+// clients mc, the packet pool being allocated (see pool_init), the further
+// connections are refused with a PROTO_ERROR_TOO_MANY_CLIENTS error. The
+// clients are then served by the threads calling socket_attach.
+// The clients are identified by sock, given by their slot in the table of the
+// clients of their thread (not their file descriptor), a slot being reused
+// once its client closed
 // Return false in case of failure, true otherwise
 bool socket_init(const char *filepath="/tmp/PJON.sock", unsigned int mc=256);
 
+// Also accept clients on a SOCK_SEQPACKET socket at the file path filepath
+// (abstract namespace as the stream one), each packet being one message, to be
+// called after socket_init and before socket_attach
+// Return false in case of failure, true otherwise
+bool socket_init_seqpacket(const char *filepath);
+
+// Also accept clients over TCP on the address (e.g. 127.0.0.1) and port, the
+// same stream of packets as on the local socket, to be called after
+// socket_init and before socket_attach
+// Return false in case of failure, true otherwise
+bool socket_init_tcp(const char *address, uint16_t port);
+
+// Serve the shard of the clients of index shard out of n_shards (at most
+// SOCKET_MAX_SHARDS) from the calling thread, the other functions being called
+// from it only and handling the clients of the shard: the socks sock % n_shards
+// == shard. The first shard accepts the connections and hands them over in
+// turn. A single thread serving all the clients attaches as the shard 0 of 1.
+// Return false in case of failure, true otherwise
+bool socket_attach(unsigned int shard=0, unsigned int n_shards=1);
+
 // Wait for any socket to be readable or writable, or for the timeout to be reached
 // timeout: maximum blocking time in us
 // Return false in case of error, true otherwise
 bool socket_wait(unsigned int timeout);
 
-// Return new packets from the socket sock
-std::vector<proto_packet> socket_receive(int sock);
+// Add the file descriptor fd to the ones socket_wait is waiting for, it is not
+// handled as a client socket
+void socket_watch(int fd);
+
+// Return true if the watched file descriptor fd is readable after socket_wait
+bool socket_is_readable(int fd);
+
+// Read the new packets from the socket sock into packets, at most n_max of
+// them (SOCKET_MAX_RECEPTION holds all the packets of a read)
+// Return the number of packets read
+size_t socket_receive(int sock, proto_packet *packets,
+    size_t n_max=SOCKET_MAX_RECEPTION);
 
 // Push to the output list new packet p to be send to socket sock at next call
-// of socket_send
+// of socket_send, the packet is copied once into the pool (see pool.hpp), and
+// dropped for a client with SOCKET_MAX_QUEUED packets queued
 // sock: destination socket, SOCKET_ALL can be used to send to all sockets
-// Return the number of packets in the output queue for the socket sock
 void socket_push(int sock, proto_packet p);
 
+// Push the packet of the slot h of the pool like socket_push, the output
+// lists taking their own references to it
+void socket_push_handle(int sock, pool_handle h);
+
 // Try to send packets pushed in the output queue for the socket sock
 // Return the number of packets sent
 int socket_send(int sock);
 
-// Return the maxium number of connections (a.k.a. the number of socket to
-// iterate over)
+// Grant the shared memory transport (see shm_ring.hpp) to the client socket
+// sock: its following packets are exchanged through the rings, its socket
+// staying open as the control channel
+// Return false in case of failure, if sock already has it or is a TCP client,
+// true otherwise
+bool socket_open_shm(int sock);
+
+// Take the socks of the clients of the shard closed since the previous call,
+// at most n_max of them into socks, in their order of closing
+// Return the number of socks taken
+size_t socket_pop_closed(int *socks, size_t n_max);
+
+// Return the name of the I/O backend of the sockets, "io_uring" or "select"
+const char *socket_get_backend();
+
+// Fill socks with the socks of the clients connected to the shard, at most
+// n_max of them, in no particular order. A client closed afterwards is ignored
+// by the other functions, a connection is only accepted by socket_wait.
+// Return the number of socks
+size_t socket_get_clients(int *socks, size_t n_max);
+
+// Return the maximum number of clients (given to socket_init), of all the
+// shards
 unsigned int socket_get_max_clients();
 
 // Quit
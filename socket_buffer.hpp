@@ -0,0 +1,178 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "alloc_check.hpp"
+#include "pool.hpp"
+#include "protocol.hpp"
+#include "socket.hpp"
+
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+// Buffers of the client sockets: the bytes read from a client until they form
+// whole packets, and the packets waiting to be written to it.
+
+class InputBuffer {
+
+  public:
+
+    InputBuffer()
+    {
+      this->start = 0;
+      this->stop = 0;
+    }
+
+    bool ready()
+    {
+      return (this->stop - this->start) >= PROTO_PACKET_SIZE;
+    }
+
+    bool get(proto_packet *p)
+    {
+      if (!this->ready())
+        return false;
+      memcpy(p, &this->data[this->start], PROTO_PACKET_SIZE);
+      this->start += PROTO_PACKET_SIZE;
+      return true;
+    }
+
+    ssize_t read_file(int fd)
+    {
+      this->compact();
+      ssize_t count = read(fd, &this->data[this->stop],
+          SOCKET_INPUT_BUFFER_SIZE - this->stop);
+      if (count > 0)
+        this->stop += count;
+
+      return count;
+    }
+
+    // the bytes of a completed read, n must not exceed space()
+    void append(const char *buf, size_t n)
+    {
+      this->compact();
+      memcpy(&this->data[this->stop], buf, n);
+      this->stop += n;
+    }
+
+    // room left once compacted
+    size_t space() const
+    {
+      return SOCKET_INPUT_BUFFER_SIZE - (this->stop - this->start);
+    }
+
+    void clear()
+    {
+      this->start = 0;
+      this->stop = 0;
+    }
+
+  private:
+
+    void compact()
+    {
+      if (this->start != 0) {
+        memmove(this->data, &this->data[this->start], this->stop - this->start);
+        this->stop = this->stop - this->start;
+        this->start = 0;
+      }
+    }
+
+    unsigned int start, stop;
+    char data[SOCKET_INPUT_BUFFER_SIZE];
+
+};
+
+// Ring of the handles of the packets waiting in the pool (see pool.hpp), each
+// one holding a reference given by push. Its storage grows by doubling when full and is
+// never shrunk, so a queue does not allocate once it reached its working size
+class OutputQueue {
+
+  public:
+
+    OutputQueue(): handles(SOCKET_OUTPUT_QUEUE_SIZE), head(0), n(0)
+    {}
+
+    ~OutputQueue()
+    {
+      this->clear();
+    }
+
+    bool empty() const
+    {
+      return this->n == 0;
+    }
+
+    size_t size() const
+    {
+      return this->n;
+    }
+
+    proto_packet &front()
+    {
+      return *pool_get(this->handles[this->head]);
+    }
+
+    // the i-th packet from the front, i must be below size()
+    proto_packet &at(size_t i)
+    {
+      return *pool_get(this->handles[(this->head + i)
+          & (this->handles.size() - 1)]);
+    }
+
+    // append the packet of the slot h, taking over a reference of the caller
+    void push(pool_handle h)
+    {
+      if (this->n == this->handles.size())
+        this->grow();
+      size_t mask = this->handles.size() - 1;
+      this->handles[(this->head + this->n) & mask] = h;
+      this->n++;
+    }
+
+    void pop()
+    {
+      pool_unref(this->handles[this->head]);
+      this->head = (this->head + 1) & (this->handles.size() - 1);
+      this->n--;
+    }
+
+    void clear()
+    {
+      while (this->n)
+        this->pop();
+      this->head = 0;
+    }
+
+  private:
+
+    // also after the warm-up of the allocation check, for a new client
+    void grow()
+    {
+      AllocAllowed allowed;
+      std::vector<pool_handle> larger(2 * this->handles.size());
+      size_t mask = this->handles.size() - 1;
+      for (size_t i = 0; i < this->n; i++)
+        larger[i] = this->handles[(this->head + i) & mask];
+      this->handles.swap(larger);
+      this->head = 0;
+    }
+
+    std::vector<pool_handle> handles;
+    size_t head, n;
+
+};
@@ -0,0 +1,162 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stats.hpp"
+#include "communication.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t micros();
+static void publish();
+static void collect(stats_data *data);
+static uint64_t value(enum metrics_id id, size_t label);
+
+static stats_page *page = nullptr;
+static char *page_name = nullptr;
+static uint64_t last_publication = 0;
+
+bool stats_open(const char *name)
+{
+  stats_close();
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    log_perror("stats", "Failed to open the stats page %s", name);
+    return false;
+  }
+  if (ftruncate(fd, sizeof(stats_page)) < 0) {
+    log_perror("stats", "Failed to size the stats page %s", name);
+    close(fd);
+    return false;
+  }
+  void *m = mmap(nullptr, sizeof(stats_page), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    log_perror("stats", "Failed to map the stats page %s", name);
+    return false;
+  }
+
+  page = (stats_page*) m;
+  page_name = strdup(name);
+  memset(&page->data, 0, sizeof(page->data));
+  page->version = STATS_VERSION;
+  page->size = sizeof(stats_page);
+  page->pid = getpid();
+  page->sequence.store(0, std::memory_order_relaxed);
+  // the magic last, readers ignore a page being initialized
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(page->magic, STATS_MAGIC, sizeof(page->magic));
+
+  log_info("stats", "Publishing the stats to %s", name);
+  publish();
+  return true;
+}
+
+void stats_update()
+{
+  if (page && micros() - last_publication >= STATS_PERIOD)
+    publish();
+}
+
+void stats_close()
+{
+  if (!page)
+    return;
+  munmap(page, sizeof(stats_page));
+  shm_unlink(page_name);
+  free(page_name);
+  page = nullptr;
+  page_name = nullptr;
+}
+
+uint64_t micros()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1'000'000 + t.tv_nsec / 1'000;
+}
+
+// the data is collected before the write so the page stays odd briefly
+void publish()
+{
+  stats_data data;
+  collect(&data);
+
+  uint32_t s = page->sequence.load(std::memory_order_relaxed);
+  page->sequence.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy((void*) &page->data, &data, sizeof(data));
+  page->sequence.store(s + 2, std::memory_order_release);
+
+  last_publication = data.time;
+}
+
+void collect(stats_data *data)
+{
+  metrics_summary s;
+  memset(data, 0, sizeof(*data));
+  data->time = micros();
+  data->clients = value(METRICS_CLIENTS, 0);
+  data->pending = value(METRICS_COM_PENDING, 0);
+  data->fwd_dropped = value(METRICS_FWD_DROPPED, 0);
+  data->log_dropped = log_get_dropped();
+
+  for (unsigned int id = 0; id < 256; id++) {
+    stats_node &n = data->nodes[id];
+    n.success = value(METRICS_PJON_SUCCESS, id);
+    n.lost = value(METRICS_PJON_LOST, id);
+    data->success += n.success;
+    data->lost += n.lost;
+    data->too_long += value(METRICS_PJON_TOO_LONG, id);
+    data->received += value(METRICS_PJON_RECEIVED, id);
+    if (n.success && metrics_summarize(METRICS_PJON_RTT, id, &s)) {
+      n.rtt_p50 = s.p50;
+      n.rtt_p99 = s.p99;
+    }
+  }
+
+  metrics_summarize_all(METRICS_PJON_RTT, &s);
+  data->rtt_p50 = s.p50;
+  data->rtt_p90 = s.p90;
+  data->rtt_p99 = s.p99;
+  data->rtt_max = s.max;
+  metrics_summarize(METRICS_LOOP_TIME, 0, &s);
+  data->loop_p50 = s.p50;
+  data->loop_p99 = s.p99;
+  data->loop_max = s.max;
+
+  data->n_buses = std::min(com_get_n_buses(), (unsigned int) STATS_MAX_BUSES);
+  for (unsigned int b = 0; b < data->n_buses; b++) {
+    stats_bus &bus = data->buses[b];
+    bus.connected = value(METRICS_BUS_CONNECTED, b);
+    bus.outgoing = value(METRICS_BUS_OUTGOING, b);
+    bus.reception = value(METRICS_BUS_RECEPTION, b);
+    bus.dropped = value(METRICS_BUS_DROPPED, b);
+    bus.reconnects = value(METRICS_BUS_RECONNECTS, b);
+  }
+}
+
+uint64_t value(enum metrics_id id, size_t label)
+{
+  metrics_summary s;
+  return metrics_summarize(id, label, &s) ? s.value : 0;
+}
@@ -0,0 +1,138 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Statistics of the daemon published in a shared memory page (shm_open), so
+// that monitoring tools can sample them without system calls nor waking the
+// daemon up. The page is written under a seqlock: sequence is odd while the
+// data is updated, a reader retries until it reads the same even sequence
+// before and after copying the data (see stats_read).
+
+#define STATS_MAGIC "PJONSTS1"
+#define STATS_VERSION 1
+#define STATS_MAX_BUSES 16
+
+#ifndef STATS_PERIOD
+#	define STATS_PERIOD 100'000 // in us
+#endif
+
+typedef struct {
+  uint8_t connected;
+  uint8_t padding[3];
+  uint32_t outgoing;   // requests handled by the bus thread
+  uint32_t reception;  // messages waiting for the server
+  uint32_t padding2;
+  uint64_t dropped;    // messages lost on a full reception queue
+  uint64_t reconnects;
+} stats_bus;
+
+typedef struct {
+  uint64_t success;
+  uint64_t lost;
+  uint32_t rtt_p50;    // in us
+  uint32_t rtt_p99;    // in us
+} stats_node;
+
+typedef struct {
+  uint64_t time;       // of the publication in us (CLOCK_MONOTONIC)
+  uint32_t clients;
+  uint32_t pending;    // requests pushed and not finished
+  uint64_t success;
+  uint64_t lost;
+  uint64_t too_long;
+  uint64_t received;
+  uint64_t fwd_dropped;
+  uint64_t log_dropped;
+  uint32_t rtt_p50;    // in us, all destinations
+  uint32_t rtt_p90;
+  uint32_t rtt_p99;
+  uint32_t rtt_max;
+  uint32_t loop_p50;   // in us
+  uint32_t loop_p99;
+  uint32_t loop_max;
+  uint32_t n_buses;
+  stats_bus buses[STATS_MAX_BUSES];
+  stats_node nodes[256]; // by PJON id
+} stats_data;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;       // of the page
+  uint32_t pid;
+  std::atomic<uint32_t> sequence;
+  stats_data data;
+} stats_page;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+    "The sequence of the stats page must be lock free");
+
+// create the page name (e.g. "/PJON-stats") and publish a first time
+// Return false in case of failure, true otherwise
+bool stats_open(const char *name);
+
+// publish the metrics if STATS_PERIOD elapsed since the last publication,
+// called from the server loop
+void stats_update();
+
+// unlink the page
+void stats_close();
+
+// The readers only need this header
+
+// map the page name read-only
+// Return nullptr in case of failure
+inline const stats_page *stats_map(const char *name)
+{
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return nullptr;
+  void *m = mmap(nullptr, sizeof(stats_page), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return nullptr;
+
+  auto *p = (const stats_page*) m;
+  if (memcmp(p->magic, STATS_MAGIC, sizeof(p->magic)) != 0
+      || p->version != STATS_VERSION || p->size != sizeof(stats_page)) {
+    munmap(m, sizeof(stats_page));
+    return nullptr;
+  }
+  return p;
+}
+
+// copy the data of the page into data, retrying while it is written
+inline void stats_read(const stats_page *page, stats_data *data)
+{
+  while (true) {
+    uint32_t s1 = page->sequence.load(std::memory_order_acquire);
+    if (s1 & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(data, (const void*) &page->data, sizeof(*data));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (page->sequence.load(std::memory_order_relaxed) == s1)
+      return;
+  }
+}
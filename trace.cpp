@@ -0,0 +1,375 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.hpp"
+
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+// generation in the high 16 bits, offset in the current file below
+#define STATE(generation, offset) ((uint64_t) (generation) << 48 | (offset))
+#define STATE_GENERATION(s) ((s) >> 48)
+#define STATE_OFFSET(s) ((s) & (((uint64_t) 1 << 48) - 1))
+
+static trace_site sites[TRACE_MAX_SITES];
+static std::atomic<uint16_t> sites_n(0);
+
+// the mapping of the previous file is kept until the next rotation, so the
+// writers still holding it finish without faulting
+static char *maps[2] = {nullptr, nullptr};
+static std::atomic<uint64_t> state(0);
+static std::atomic<bool> opened(false);
+static std::mutex rotation_mutex;
+static char *trace_path = nullptr;
+static size_t trace_size = 0;
+static unsigned int trace_files = 0;
+
+static char *reserve(size_t n);
+static bool rotate(uint64_t generation);
+static void write_site(uint16_t id);
+static uint64_t now();
+
+int trace_parse_format(const char *format, trace_spec *specs, size_t max)
+{
+  size_t n = 0;
+
+  for (const char *c = format; *c; c++) {
+    if (*c != '%')
+      continue;
+
+    trace_spec spec = {};
+    spec.start = c - format;
+    spec.precision = -1;
+    spec.size = 4;
+    c++;
+
+    // flags and width
+    while (*c && strchr("-+ #0'", *c))
+      c++;
+    if (*c == '*') {
+      spec.width_arg = true;
+      c++;
+    }
+    while (*c >= '0' && *c <= '9')
+      c++;
+
+    // precision
+    if (*c == '.') {
+      c++;
+      if (*c == '*') {
+        spec.precision_arg = true;
+        c++;
+      } else {
+        spec.precision = atoi(c);
+      }
+      while (*c >= '0' && *c <= '9')
+        c++;
+    }
+
+    // length modifier
+    if (c[0] == 'h' && c[1] == 'h') {
+      spec.size = 1;
+      c += 2;
+    } else if (c[0] == 'l' && c[1] == 'l') {
+      spec.size = 8;
+      c += 2;
+    } else if (*c == 'h') {
+      spec.size = 2;
+      c++;
+    } else if (*c && strchr("lzjtqL", *c)) {
+      spec.size = 8;
+      c++;
+    }
+
+    switch (*c) {
+      case 'd': case 'i':
+        spec.conversion = 'i';
+        break;
+      case 'u': case 'x': case 'X': case 'o':
+        spec.conversion = 'u';
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a':
+      case 'A':
+        spec.conversion = 'f';
+        break;
+      case 's': case 'c': case 'p':
+        spec.conversion = *c;
+        break;
+      default: // %% and invalid conversions do not take an argument
+        spec.conversion = 'n';
+        if (!*c)
+          c--;
+    }
+    spec.length = c - format - spec.start + 1;
+
+    if (spec.conversion == 'n' && !spec.width_arg && !spec.precision_arg)
+      continue;
+    if (n >= max)
+      return -1;
+    specs[n++] = spec;
+  }
+
+  return n;
+}
+
+uint16_t trace_register_site(uint8_t kind, const char *module,
+    const char *format)
+{
+  std::lock_guard<std::mutex> lock(rotation_mutex);
+
+  uint16_t id = sites_n;
+  if (id >= TRACE_MAX_SITES)
+    return TRACE_NO_SITE;
+
+  trace_site &site = sites[id];
+  int n = trace_parse_format(format, site.specs, TRACE_MAX_ARGS);
+  if (n < 0)
+    return TRACE_NO_SITE;
+  site.n_specs = n;
+  site.kind = kind;
+  site.module = module;
+  site.format = format;
+  sites_n = id + 1;
+
+  if (opened)
+    write_site(id);
+  return id;
+}
+
+const trace_site *trace_get_site(uint16_t id)
+{
+  return id < sites_n ? &sites[id] : nullptr;
+}
+
+bool trace_open(const char *path, size_t size, unsigned int n)
+{
+  trace_close();
+
+  std::lock_guard<std::mutex> lock(rotation_mutex);
+  free(trace_path);
+  trace_path = strdup(path);
+  trace_size = ALIGN(size);
+  trace_files = n ? n : 1;
+  if (trace_size < sizeof(trace_file_header) + 4096)
+    return false;
+
+  state = STATE((uint64_t) 0xFFFF, trace_size);
+  if (!rotate(0xFFFF))
+    return false;
+  opened = true;
+  return true;
+}
+
+void trace_close()
+{
+  std::lock_guard<std::mutex> lock(rotation_mutex);
+  opened = false;
+  for (auto &m : maps) {
+    if (m)
+      munmap(m, trace_size);
+    m = nullptr;
+  }
+}
+
+void trace_event(uint16_t site, uint8_t flags, int error, const void *packet,
+    const trace_arg *args, size_t n)
+{
+  if (!opened || site >= sites_n)
+    return;
+  const trace_site &s = sites[site];
+
+  // size of the record, the arguments are laid out as the format asks
+  size_t size = sizeof(trace_header);
+  if (flags & TRACE_FLAG_ERROR)
+    size += 8;
+  if (flags & TRACE_FLAG_PACKET)
+    size += TRACE_PACKET_SIZE;
+  size_t lengths[TRACE_MAX_ARGS];
+  size_t a = 0;
+  for (size_t i = 0; i < s.n_specs && a < n; i++) {
+    const trace_spec &spec = s.specs[i];
+    int precision = spec.precision;
+    if (spec.width_arg)
+      a++;
+    if (spec.precision_arg && a < n)
+      precision = args[a++].i;
+    if (spec.conversion == 'n' || a >= n)
+      continue;
+    if (spec.conversion == 's') {
+      size_t max = (precision >= 0 && precision < TRACE_MAX_STRING) ?
+        precision : TRACE_MAX_STRING;
+      lengths[a] = args[a].p ? strnlen((const char*) args[a].p, max) : 0;
+      size += ALIGN(lengths[a]);
+    }
+    a++;
+  }
+  size += 8*n;
+
+  char *r = reserve(size);
+  if (!r)
+    return;
+
+  trace_header *h = (trace_header*) r;
+  h->site = site;
+  h->type = TRACE_RECORD_EVENT;
+  h->flags = flags;
+  h->time = now();
+  char *c = r + sizeof(trace_header);
+  if (flags & TRACE_FLAG_ERROR) {
+    *(int64_t*) c = error;
+    c += 8;
+  }
+  if (flags & TRACE_FLAG_PACKET) {
+    memcpy(c, packet, TRACE_PACKET_SIZE);
+    c += TRACE_PACKET_SIZE;
+  }
+
+  // same walk as above, copying the strings after their slot
+  a = 0;
+  for (size_t i = 0; i < s.n_specs && a < n; i++) {
+    const trace_spec &spec = s.specs[i];
+    for (int k = spec.width_arg + spec.precision_arg; k && a < n; k--) {
+      memcpy(c, &args[a++], 8);
+      c += 8;
+    }
+    if (spec.conversion == 'n' || a >= n)
+      continue;
+    if (spec.conversion == 's') {
+      *(uint64_t*) c = lengths[a];
+      memcpy(c + 8, args[a].p, lengths[a]);
+      c += 8 + ALIGN(lengths[a]);
+    } else {
+      memcpy(c, &args[a], 8);
+      c += 8;
+    }
+    a++;
+  }
+  for (; a < n; a++) {
+    memcpy(c, &args[a], 8);
+    c += 8;
+  }
+
+  // the size is written last, a reader stops on a record not written yet
+  __atomic_store_n(&h->size, size, __ATOMIC_RELEASE);
+}
+
+char *reserve(size_t n)
+{
+  while (opened) {
+    uint64_t s = state.fetch_add(n, std::memory_order_relaxed);
+    uint64_t generation = STATE_GENERATION(s);
+    uint64_t offset = STATE_OFFSET(s);
+    if (offset + n <= trace_size)
+      return maps[generation % 2] + offset;
+    if (!rotate(generation))
+      return nullptr;
+  }
+  return nullptr;
+}
+
+// move to the next file of the rotation unless another writer already did it
+bool rotate(uint64_t generation)
+{
+  std::unique_lock<std::mutex> lock(rotation_mutex, std::defer_lock);
+  if (opened)
+    lock.lock();
+  if (STATE_GENERATION(state.load()) != generation)
+    return true;
+
+  uint64_t next = (generation + 1) & 0xFFFF;
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.%lu", trace_path,
+      (unsigned long) (next % trace_files));
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || ftruncate(fd, trace_size) < 0) {
+    perror("trace");
+    if (fd >= 0)
+      close(fd);
+    opened = false;
+    return false;
+  }
+  char *m = (char*) mmap(nullptr, trace_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    perror("trace");
+    opened = false;
+    return false;
+  }
+
+  char *&slot = maps[next % 2];
+  if (slot)
+    munmap(slot, trace_size);
+  slot = m;
+
+  trace_file_header *h = (trace_file_header*) m;
+  memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+  h->generation = next;
+  h->size = trace_size;
+  state = STATE(next, sizeof(trace_file_header));
+
+  // each file holds the definitions of all the sites
+  for (uint16_t i = 0; i < sites_n; i++)
+    write_site(i);
+  if (STATE_OFFSET(state.load()) > trace_size / 2) {
+    fprintf(stderr, "trace: files too small for the site definitions\n");
+    opened = false;
+    return false;
+  }
+  return true;
+}
+
+// must be called with rotation_mutex held
+void write_site(uint16_t id)
+{
+  const trace_site &s = sites[id];
+  size_t module_n = s.module ? strlen(s.module) : 0;
+  size_t format_n = strlen(s.format);
+  size_t size = ALIGN(sizeof(trace_header) + 4 + module_n + format_n);
+
+  uint64_t st = state.fetch_add(size);
+  if (STATE_OFFSET(st) + size > trace_size)
+    return; // the file is too small for the definitions
+  char *r = maps[STATE_GENERATION(st) % 2] + STATE_OFFSET(st);
+
+  trace_header *h = (trace_header*) r;
+  h->site = id;
+  h->type = TRACE_RECORD_SITE;
+  h->flags = 0;
+  h->time = now();
+  uint8_t *c = (uint8_t*) (r + sizeof(trace_header));
+  c[0] = s.kind;
+  c[1] = module_n;
+  c[2] = format_n & 0xFF;
+  c[3] = format_n >> 8;
+  memcpy(&c[4], s.module, module_n);
+  memcpy(&c[4 + module_n], s.format, format_n);
+  __atomic_store_n(&h->size, size, __ATOMIC_RELEASE);
+}
+
+uint64_t now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  return (uint64_t) t.tv_sec * 1'000'000'000 + t.tv_nsec;
+}
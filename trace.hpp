@@ -0,0 +1,120 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Binary trace of the log sites. Each site is registered once with its
+// format, the events only record the site id, the time and the raw
+// arguments into memory mapped files, rendered later by PJON-tracedump.
+//
+// A trace is a rotation of files <path>.0 to <path>.<n-1>, each made of a
+// trace_file_header followed by records: the definitions of all the known
+// sites then the events. A record of size 0 ends the file.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TRACE_MAX_SITES
+#define TRACE_MAX_SITES 1024
+#endif
+
+#ifndef TRACE_MAX_ARGS
+#define TRACE_MAX_ARGS 16
+#endif
+
+// Longest recorded string argument, longer ones are truncated
+#ifndef TRACE_MAX_STRING
+#define TRACE_MAX_STRING 255
+#endif
+
+#define TRACE_MAGIC "PJONTRC1"
+#define TRACE_NO_SITE 0xFFFF
+
+#define TRACE_RECORD_SITE  1
+#define TRACE_RECORD_EVENT 2
+
+#define TRACE_FLAG_ERROR   0x01 // an errno value follows the header
+#define TRACE_FLAG_PACKET  0x02 // a TRACE_PACKET_SIZE bytes packet follows
+
+#define TRACE_PACKET_SIZE 64
+
+typedef union {
+  int64_t i;
+  uint64_t u;
+  double d;
+  const void *p;
+} trace_arg;
+
+typedef struct {
+  char magic[8];
+  uint64_t generation;
+  uint64_t size;
+} trace_file_header;
+
+// Records are 8 bytes aligned.
+// Site definition: kind (1 byte), module length (1 byte), format length
+// (2 bytes), module, format.
+// Event: [errno (8 bytes)], [packet], then an 8 bytes slot per argument, a
+// string argument slot holding its length followed by its padded bytes.
+typedef struct {
+  uint32_t size;
+  uint16_t site;
+  uint8_t type;
+  uint8_t flags;
+  uint64_t time; // in ns since the epoch
+} trace_header;
+
+// A conversion of a printf format
+typedef struct {
+  uint16_t start;
+  uint16_t length;
+  char conversion;    // 'i', 'u', 'f', 's', 'c', 'p' or 'n' (not an argument)
+  uint8_t size;       // of an integer argument in bytes
+  bool width_arg;     // width given by a preceding int argument
+  bool precision_arg; // precision given by a preceding int argument
+  int precision;      // literal precision, -1 if none
+} trace_spec;
+
+typedef struct {
+  uint8_t kind;
+  const char *module;
+  const char *format;
+  uint8_t n_specs;
+  trace_spec specs[TRACE_MAX_ARGS];
+} trace_site;
+
+// Parse the conversions of the printf format into specs of max elements
+// Return the number of conversions, -1 if there are too many
+int trace_parse_format(const char *format, trace_spec *specs, size_t max);
+
+// Register a site of the given kind (opaque to the trace), module and format,
+// both static strings
+// Return the site id, TRACE_NO_SITE if the table is full or the format invalid
+uint16_t trace_register_site(uint8_t kind, const char *module,
+    const char *format);
+
+// Return the site with the given id, nullptr if unknown
+const trace_site *trace_get_site(uint16_t id);
+
+// Start tracing to the rotation of n files of size bytes at path
+// Return false in case of failure, true otherwise
+bool trace_open(const char *path, size_t size, unsigned int n);
+
+// Stop tracing and unmap the files
+void trace_close();
+
+// Record an event of the site with the n raw arguments args, the errno error
+// if flags has TRACE_FLAG_ERROR and the packet if flags has TRACE_FLAG_PACKET
+void trace_event(uint16_t site, uint8_t flags, int error, const void *packet,
+    const trace_arg *args, size_t n);
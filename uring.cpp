@@ -0,0 +1,241 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "uring.hpp"
+#include "logger.hpp"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static_assert((URING_BUFFERS & (URING_BUFFERS - 1)) == 0,
+    "URING_BUFFERS must be a power of two");
+
+// each thread serving clients has its own ring
+static thread_local int ring_fd = -1;
+static thread_local void *ring_map = MAP_FAILED;
+static thread_local size_t ring_size;
+static thread_local struct io_uring_sqe *sqes
+  = (struct io_uring_sqe*) MAP_FAILED;
+static thread_local size_t sqes_size;
+
+// the tails written by the daemon are only published by uring_wait
+static thread_local unsigned int *sq_head, *sq_tail, sq_mask, sq_entries;
+static thread_local unsigned int *cq_head, *cq_tail, cq_mask;
+static thread_local struct io_uring_cqe *cqes;
+static thread_local unsigned int sqe_tail;
+
+// struct io_uring_buf_ring is not used, its flexible array of buffers does not
+// start at 0 in C++: the tail overlays the resv field of the first buffer
+static thread_local struct io_uring_buf *buf_ring
+  = (struct io_uring_buf*) MAP_FAILED;
+static thread_local unsigned short buf_tail;
+static thread_local char (*buffers)[URING_BUFFER_SIZE]
+  = (char (*)[URING_BUFFER_SIZE]) MAP_FAILED;
+
+static int enter(unsigned int to_submit, unsigned int min_complete,
+    unsigned int flags, void *arg, size_t size);
+static void add_buffer(unsigned short bid);
+
+bool uring_open()
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_CQ_FACTOR * URING_ENTRIES;
+  ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (ring_fd < 0) {
+    log_perror("socket", "io_uring unavailable");
+    return false;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+      || !(p.features & IORING_FEAT_NODROP)
+      || !(p.features & IORING_FEAT_EXT_ARG)) {
+    log_warn("socket", "io_uring lacks features (features 0x%x)", p.features);
+    uring_close();
+    return false;
+  }
+
+  // one mapping for both queues, then the submission queue entries
+  ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > ring_size)
+    ring_size = cq_size;
+  ring_map = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe*) mmap(nullptr, sqes_size,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+      IORING_OFF_SQES);
+  if (ring_map == MAP_FAILED || sqes == MAP_FAILED) {
+    log_perror("socket", "Failed to map the io_uring queues");
+    uring_close();
+    return false;
+  }
+
+  char *m = (char*) ring_map;
+  sq_head = (unsigned int*) (m + p.sq_off.head);
+  sq_tail = (unsigned int*) (m + p.sq_off.tail);
+  sq_mask = *(unsigned int*) (m + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  cq_head = (unsigned int*) (m + p.cq_off.head);
+  cq_tail = (unsigned int*) (m + p.cq_off.tail);
+  cq_mask = *(unsigned int*) (m + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*) (m + p.cq_off.cqes);
+  sqe_tail = *sq_tail;
+  // the entries are used in order
+  unsigned int *array = (unsigned int*) (m + p.sq_off.array);
+  for (unsigned int i = 0; i < sq_entries; i++)
+    array[i] = i;
+
+  // the ring of provided buffers must be page aligned
+  buf_ring = (struct io_uring_buf*) mmap(nullptr,
+      URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  buffers = (char (*)[URING_BUFFER_SIZE]) mmap(nullptr,
+      URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED || buffers == MAP_FAILED) {
+    log_perror("socket", "Failed to map the provided buffers");
+    uring_close();
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1) < 0) {
+    log_perror("socket", "Failed to register the provided buffers");
+    uring_close();
+    return false;
+  }
+  buf_tail = 0;
+  for (unsigned short bid = 0; bid < URING_BUFFERS; bid++)
+    add_buffer(bid);
+  __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+
+  log_info("socket", "Using io_uring");
+  return true;
+}
+
+struct io_uring_sqe *uring_get_sqe()
+{
+  if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit = sqe_tail - __atomic_load_n(sq_head,
+        __ATOMIC_ACQUIRE);
+    if (enter(to_submit, 0, 0, nullptr, 0) < 0)
+      log_perror("socket", "Failed to submit to io_uring");
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+      return nullptr;
+  }
+  struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe_tail++;
+  return sqe;
+}
+
+bool uring_wait(unsigned int timeout)
+{
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  unsigned int to_submit = sqe_tail - __atomic_load_n(sq_head,
+      __ATOMIC_ACQUIRE);
+  bool ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head;
+  if (!to_submit && (ready || !timeout))
+    return true;
+
+  struct __kernel_timespec ts;
+  ts.tv_sec = timeout / 1'000'000;
+  ts.tv_nsec = (timeout % 1'000'000) * 1'000;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uintptr_t) &ts;
+  int r = enter(to_submit, ready || !timeout ? 0 : 1,
+      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+  // a timeout, a signal or completions to be reaped first
+  if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    log_perror("socket", "io_uring_enter");
+    return false;
+  }
+  return true;
+}
+
+size_t uring_reap(void (*handle)(const struct io_uring_cqe *cqe))
+{
+  unsigned int head = *cq_head;
+  unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  size_t n = 0;
+
+  for (; head != tail; head++, n++)
+    handle(&cqes[head & cq_mask]);
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+const char *uring_buffer(const struct io_uring_cqe *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return nullptr;
+  return buffers[cqe->flags >> IORING_CQE_BUFFER_SHIFT];
+}
+
+void uring_recycle(const struct io_uring_cqe *cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return;
+  add_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+  __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring_close()
+{
+  if (buf_ring != MAP_FAILED)
+    munmap(buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+  if (buffers != MAP_FAILED)
+    munmap(buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqes_size);
+  if (ring_map != MAP_FAILED)
+    munmap(ring_map, ring_size);
+  if (ring_fd >= 0)
+    close(ring_fd);
+  buf_ring = (struct io_uring_buf*) MAP_FAILED;
+  buffers = (char (*)[URING_BUFFER_SIZE]) MAP_FAILED;
+  sqes = (struct io_uring_sqe*) MAP_FAILED;
+  ring_map = MAP_FAILED;
+  ring_fd = -1;
+}
+
+int enter(unsigned int to_submit, unsigned int min_complete,
+    unsigned int flags, void *arg, size_t size)
+{
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+      arg, size);
+}
+
+void add_buffer(unsigned short bid)
+{
+  struct io_uring_buf *b = &buf_ring[buf_tail & (URING_BUFFERS - 1)];
+  b->addr = (uintptr_t) buffers[bid];
+  b->len = URING_BUFFER_SIZE;
+  b->bid = bid;
+  buf_tail++;
+}
@@ -0,0 +1,66 @@
+/* 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Minimal io_uring interface of the threads serving the clients, each one
+// having its own ring, over the system calls of <linux/io_uring.h>: the
+// submission queue entries prepared during an iteration of the loop are
+// submitted at once by uring_wait, in the same io_uring_enter waiting for the
+// completions, which uring_reap then hands over. The reads select their buffer
+// in a ring of provided buffers, so idle clients do not hold one.
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// submission queue, the completion queue being URING_CQ_FACTOR times larger
+#ifndef URING_ENTRIES
+#	define URING_ENTRIES 256
+#endif
+#define URING_CQ_FACTOR 4
+
+// provided buffers of the reads, their number must be a power of two
+#ifndef URING_BUFFERS
+#	define URING_BUFFERS 64
+#endif
+#ifndef URING_BUFFER_SIZE
+#	define URING_BUFFER_SIZE 1024
+#endif
+#define URING_BUFFER_GROUP 0
+
+// Open the ring and register the provided buffers
+// Return false if io_uring or one of the features used (Linux 5.19) is
+// unavailable
+bool uring_open();
+
+// Return a zeroed submission queue entry, the queue being submitted if it is
+// full, nullptr if it still is
+struct io_uring_sqe *uring_get_sqe();
+
+// Submit the queued entries and wait for a completion, at most timeout us
+// Return false in case of error, true otherwise (also on timeout or signal)
+bool uring_wait(unsigned int timeout);
+
+// Call handle on each completion, which may queue new entries
+// Return the number of completions
+size_t uring_reap(void (*handle)(const struct io_uring_cqe *cqe));
+
+// Return the provided buffer filled by the read of cqe, nullptr if none
+const char *uring_buffer(const struct io_uring_cqe *cqe);
+
+// Give the buffer of cqe back to the kernel once its data was copied
+void uring_recycle(const struct io_uring_cqe *cqe);
+
+// Close the ring
+void uring_close();